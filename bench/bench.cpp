@@ -0,0 +1,269 @@
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <functional>
+#include "raytrace.h"
+#include "scenefile.h"
+
+/*
+ * Micro-benchmarks for the ray and shading kernels, run by `make bench`.
+ *
+ * Every kernel runs over fixed ray sets built from the scene, so two runs
+ * of the same build see exactly the same work:
+ *   primary     camera rays through a grid of pixel centres (coherent)
+ *   reflection  primary hits bounced off their normal with a hashed
+ *               jitter, so neighbouring rays diverge (incoherent)
+ *   shadow      primary hits towards spots on the scene's first light
+ * Each benchmark is timed over BENCH_RUNS passes after BENCH_WARMUP
+ * untimed ones. The mean and standard deviation are across passes, and a
+ * checksum of the results catches a kernel whose output changed. The
+ * scene's shadow cache is turned off, it would make the passes differ.
+ */
+
+#define BENCH_GRID 128
+#define BENCH_WARMUP 2
+#define BENCH_RUNS 15
+
+struct Result {
+    std::string name;
+    std::string set;
+    const char *unit;
+    size_t items;
+    double mean_ns;
+    double stddev_ns;
+    double min_ns;
+    double checksum;
+};
+
+// A kernel does one pass over its items and returns a checksum
+typedef std::function<double()> Kernel;
+
+static Result measure(const std::string &name, const std::string &set,
+                      const char *unit, size_t items, const Kernel &kernel)
+{
+    double checksum = 0;
+    for (unsigned i = 0; i < BENCH_WARMUP; i++)
+        checksum = kernel();
+
+    std::vector<double> per_item;
+    for (unsigned i = 0; i < BENCH_RUNS; i++) {
+        auto start = std::chrono::steady_clock::now();
+        double sum = kernel();
+        std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+        if (sum != checksum)
+            throw std::runtime_error(name + " isn't deterministic");
+        per_item.push_back(took.count() / items);
+    }
+
+    double mean = 0, min = per_item[0];
+    for (double t : per_item) {
+        mean += t;
+        min = std::min(min, t);
+    }
+    mean /= per_item.size();
+    double var = 0;
+    for (double t : per_item)
+        var += (t - mean) * (t - mean);
+    double stddev = sqrt(var / (per_item.size() - 1));
+
+    printf("%-24s %-11s %9zu %-4s %10.1f ns/%s  +- %5.1f%%  %12.0f %s/s\n",
+        name.c_str(), set.c_str(), items, unit, mean, unit,
+        100 * stddev / mean, 1e9 / mean, unit);
+    return { name, set, unit, items, mean, stddev, min, checksum };
+}
+
+struct Bench {
+    struct Ray {
+        XYZ from;
+        XYZ to;
+        double max_t;
+    };
+
+    Raytracer &r;
+    std::vector<Ray> primary;
+    std::vector<Ray> reflection;
+    std::vector<Ray> shadow;
+    // Primary hits with their ray direction and surface normal
+    std::vector<Hit> hits;
+    std::vector<XYZ> hit_deltas;
+    std::vector<XYZ> hit_normals;
+
+    Bench(Raytracer &raytracer) : r(raytracer)
+    {
+        r.finalize();
+        // What the shadow cache holds depends on what was traced before, so
+        // with it the passes wouldn't match. It only lives inside render()'s
+        // tiles anyway, the kernels here are timed without it.
+        if (r.m_shadow_cache_cell > 0) {
+            printf("the shadow cache is off for the benchmarks\n");
+            r.set_shadow_cache(0, r.m_shadow_cache_tolerance, r.m_shadow_cache_entries);
+        }
+        if (r.m_lights.empty())
+            throw std::runtime_error("the bench scene needs a light");
+        const Light &light = r.m_lights[0];
+        for (unsigned gy = 0; gy < BENCH_GRID; gy++) {
+            for (unsigned gx = 0; gx < BENCH_GRID; gx++) {
+                unsigned x = (gx * r.m_width + r.m_width / 2) / BENCH_GRID;
+                unsigned y = (gy * r.m_height + r.m_height / 2) / BENCH_GRID;
+                RayTask ray = r.primary_ray(x, y, 0, 1);
+                primary.push_back({ ray.from, ray.to, 0 });
+
+                Hit hit = r.intersect(ray.from, ray.to);
+                if (hit.id == NO_FORM)
+                    continue;
+                XYZ delta = (ray.to - ray.from).normal();
+                XYZ norm = r.surface_normal(hit, delta);
+                hits.push_back(hit);
+                hit_deltas.push_back(delta);
+                hit_normals.push_back(norm);
+
+                uint64_t key = Random::derive(ray.key, 7);
+                XYZ jitter = {
+                    (Random::mix(key) >> 11) * 0x1p-53 - 0.5,
+                    (Random::mix(key + 1) >> 11) * 0x1p-53 - 0.5,
+                    (Random::mix(key + 2) >> 11) * 0x1p-53 - 0.5,
+                };
+                XYZ bounce = delta - norm * 2 * dot(delta, norm) + jitter;
+                XYZ from = hit.point + norm * EPSILON;
+                reflection.push_back({ from, from + bounce, 0 });
+
+                if (r.light_rays(light) > 0) {
+                    unsigned grid = r.m_shadow_grid_size;
+                    unsigned spot = light.type == LightType::Area ? gx % grid * grid + gy % grid : 0;
+                    Ray to_light = { hit.point };
+                    r.light_ray(light, hit.point, spot, key, to_light.to, to_light.max_t);
+                    shadow.push_back(to_light);
+                }
+            }
+        }
+    }
+
+    std::vector<Result> run()
+    {
+        std::vector<Result> results;
+        auto intersect = [&](const std::vector<Ray> &rays) {
+            return [&]() {
+                double sum = 0;
+                for (auto &ray : rays) {
+                    Hit hit = r.intersect(ray.from, ray.to);
+                    sum += hit.id == NO_FORM ? 0 : hit.id + hit.point.z;
+                }
+                return sum;
+            };
+        };
+        results.push_back(measure("intersect", "primary", "ray", primary.size(), intersect(primary)));
+        results.push_back(measure("intersect", "reflection", "ray", reflection.size(), intersect(reflection)));
+        results.push_back(measure("occluded", "shadow", "ray", shadow.size(), [&]() {
+            double sum = 0;
+            for (auto &ray : shadow)
+                sum += r.occluded(ray.from, ray.to, ray.max_t) == NO_FORM;
+            return sum;
+        }));
+
+        // Full recursive shading, one primary ray at the scene's depth
+        results.push_back(measure("cast_ray", "primary", "ray", primary.size(), [&]() {
+            double sum = 0;
+            for (auto &ray : primary) {
+                Color c = r.cast_ray(ray.from, ray.to, r.m_reflection_depth, false);
+                sum += c.r + c.g + c.b;
+            }
+            return sum;
+        }));
+
+        // One call traces the first light's shadow rays, shadow_grid_size^2
+        // for an area light
+        results.push_back(measure("shadow_amount", "primary", "call", hits.size(), [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < hits.size(); i++)
+                sum += r.shadow_amount(hits[i].point, 0, i);
+            return sum;
+        }));
+        results.push_back(measure("fresnel_amount", "primary", "call", hits.size(), [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < hits.size(); i++)
+                sum += fresnel_amount(hit_deltas[i], hit_normals[i],
+                                      r.material(hits[i].id).refractive_index);
+            return sum;
+        }));
+        results.push_back(measure("diffuse", "primary", "call", hits.size(), [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < hits.size(); i++) {
+                Color c = r.diffuse(r.material(hits[i].id).color, hits[i].point, hit_normals[i], 0);
+                sum += c.r + c.g + c.b;
+            }
+            return sum;
+        }));
+
+        // linear.h over the primary hits' directions and normals
+        size_t n = hits.size();
+        results.push_back(measure("linear/dot", "primary", "op", n, [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < n; i++)
+                sum += dot(hit_deltas[i], hit_normals[i]);
+            return sum;
+        }));
+        results.push_back(measure("linear/cross", "primary", "op", n, [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < n; i++)
+                sum += cross(hit_deltas[i], hit_normals[i]).x;
+            return sum;
+        }));
+        results.push_back(measure("linear/normal", "primary", "op", n, [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < n; i++)
+                sum += (hits[i].point - r.m_camera).normal().y;
+            return sum;
+        }));
+        results.push_back(measure("linear/distance", "primary", "op", n, [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < n; i++)
+                sum += distance(hits[i].point, r.m_lights[0].position);
+            return sum;
+        }));
+        return results;
+    }
+};
+
+static void write_json(const std::string &path, const std::string &scene,
+                       const std::vector<Result> &results)
+{
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+        throw std::runtime_error("can't write " + path);
+    fprintf(out, "{\n  \"scene\": \"%s\",\n  \"simd\": \"%s\",\n  \"runs\": %d,\n  \"benchmarks\": [\n",
+        scene.c_str(), simd_kernels().name, BENCH_RUNS);
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &res = results[i];
+        fprintf(out,
+            "    { \"name\": \"%s\", \"set\": \"%s\", \"unit\": \"%s\", \"items\": %zu, "
+            "\"ns_mean\": %.3f, \"ns_stddev\": %.3f, \"ns_min\": %.3f, "
+            "\"per_second\": %.0f, \"checksum\": %.17g }%s\n",
+            res.name.c_str(), res.set.c_str(), res.unit, res.items,
+            res.mean_ns, res.stddev_ns, res.min_ns, 1e9 / res.mean_ns, res.checksum,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+}
+
+int main(int argc, char **argv)
+{
+    std::string scene = argc > 1 ? argv[1] : "scenes/demo.scene";
+    std::string json = argc > 2 ? argv[2] : "build/bench.json";
+
+    try {
+        SceneInfo info;
+        std::unique_ptr<Raytracer> raytracer = load_scene(scene, info);
+        Bench bench(*raytracer);
+        printf("%s, %s kernels, %zu primary hits\n", scene.c_str(), simd_kernels().name, bench.hits.size());
+        write_json(json, scene, bench.run());
+        printf("wrote %s\n", json.c_str());
+    } catch (const std::runtime_error &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
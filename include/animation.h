@@ -0,0 +1,81 @@
+#ifndef _ANIMATION_H
+#define _ANIMATION_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+#include "linear.h"
+
+// Where a form sits relative to the geometry it was added with: scaled
+// and rotated about its pivot (a sphere's or wall's position, the
+// centroid of a triangle, the bounding box centre of a mesh), then
+// moved. Rotation is in degrees about x, then y, then z.
+struct Transform {
+    XYZ translation { 0, 0, 0 };
+    XYZ rotation { 0, 0, 0 };
+    double scale { 1 };
+
+    bool operator==(const Transform &) const;
+
+    // A point, given the pivot it turns about
+    XYZ apply(const XYZ &, const XYZ &) const;
+    // Scale and rotation, for edges
+    XYZ apply_vector(const XYZ &) const;
+    // Rotation only, for normals
+    XYZ rotate(const XYZ &) const;
+};
+
+XYZ lerp(const XYZ &, const XYZ &, double);
+Transform lerp(const Transform &, const Transform &, double);
+
+// Values at given frames, linearly interpolated in between and held
+// before the first and after the last key
+template <typename T>
+class Track {
+public:
+    bool empty() const { return m_keys.empty(); }
+
+    void add(double frame, const T &value)
+    {
+        auto at = m_keys.begin();
+        while (at != m_keys.end() && at->first < frame)
+            at++;
+        if (at != m_keys.end() && at->first == frame)
+            at->second = value;
+        else
+            m_keys.insert(at, { frame, value });
+    }
+
+    T at(double frame) const
+    {
+        if (frame <= m_keys.front().first)
+            return m_keys.front().second;
+        for (size_t i = 1; i < m_keys.size(); i++) {
+            if (frame < m_keys[i].first) {
+                auto &a = m_keys[i - 1], &b = m_keys[i];
+                return lerp(a.second, b.second, (frame - a.first) / (b.first - a.first));
+            }
+        }
+        return m_keys.back().second;
+    }
+
+private:
+    std::vector<std::pair<double, T>> m_keys;
+};
+
+// Keyframes for the camera, the light and any forms, by form id.
+// Raytracer::set_frame() poses the scene from it.
+struct Animation {
+    Track<XYZ> camera;
+    Track<XYZ> light;
+    std::map<unsigned, Track<Transform>> forms;
+
+    bool empty() const { return camera.empty() && light.empty() && forms.empty(); }
+};
+
+// Replaces %d or %04d and the like in a file name pattern with the frame
+// number, or puts it before the extension, four digits wide, if there's none
+std::string frame_filename(const std::string &, unsigned);
+
+#endif
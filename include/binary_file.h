@@ -0,0 +1,98 @@
+#ifndef _BINARY_FILE_H
+#define _BINARY_FILE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include "mapped_file.h"
+
+// Plain structs dumped as their bytes and arrays as a 64-bit element count
+// followed by theirs, everything padded to 8 bytes. Only meant to be read
+// back by the same build on the same kind of machine, so whoever uses
+// these puts the sizes of what they dump in a header and checks it.
+class BinaryWriter {
+public:
+    BinaryWriter(const std::string &path) : m_out(path, std::ios::binary)
+    {
+        if (!m_out)
+            throw std::runtime_error("can't write " + path);
+    }
+
+    template <typename T>
+    void value(const T &v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "dumped as bytes");
+        bytes(&v, sizeof(T));
+    }
+
+    template <typename T>
+    void array(const std::vector<T> &v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "dumped as bytes");
+        value((uint64_t)v.size());
+        bytes(v.data(), v.size() * sizeof(T));
+    }
+
+    // Throws std::runtime_error if anything failed to write
+    void finish(const std::string &path)
+    {
+        m_out.close();
+        if (!m_out)
+            throw std::runtime_error("failed writing " + path);
+    }
+
+private:
+    void bytes(const void *p, size_t n)
+    {
+        static const char zeros[8] = {};
+        m_out.write((const char *)p, n);
+        m_out.write(zeros, (8 - n % 8) % 8);
+    }
+
+    std::ofstream m_out;
+};
+
+// Reads what a BinaryWriter wrote, throwing std::runtime_error saying
+// `what` is truncated if it runs out of file
+class BinaryReader {
+public:
+    BinaryReader(const MappedFile &file, const std::string &what)
+        : m_at(file.data()), m_end(file.data() + file.size()), m_what(what) {}
+
+    template <typename T>
+    void value(T &v)
+    {
+        bytes(&v, sizeof(T));
+    }
+
+    template <typename T>
+    void array(std::vector<T> &v)
+    {
+        uint64_t count;
+        value(count);
+        if (count > (uint64_t)(m_end - m_at) / sizeof(T))
+            throw std::runtime_error(m_what + " is truncated");
+        v.resize(count);
+        bytes(v.data(), count * sizeof(T));
+    }
+
+private:
+    void bytes(void *p, size_t n)
+    {
+        size_t padded = n + (8 - n % 8) % 8;
+        if (padded > (size_t)(m_end - m_at))
+            throw std::runtime_error(m_what + " is truncated");
+        memcpy(p, m_at, n);
+        m_at += padded;
+    }
+
+    const char *m_at;
+    const char *m_end;
+    std::string m_what;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef _BVH_H
+#define _BVH_H
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include "linear.h"
+
+struct AABB {
+    XYZ min;
+    XYZ max;
+
+    static AABB empty();
+
+    void extend(const XYZ &);
+    void extend(const AABB &);
+    XYZ center() const;
+    double area() const;
+
+    // Slab test against from + delta * t, returns entry t or a negative
+    // value on a miss
+    inline double hit(const XYZ &, const XYZ &, double) const;
+};
+
+struct BVHNode {
+    AABB bounds;
+    unsigned first;  // first primitive for leaves, left child otherwise
+    unsigned count;  // primitive count, 0 for interior nodes
+};
+
+// Bounding volume hierarchy over a list of primitive bounds, built with
+// binned SAH. build() reports the order the primitives must be stored in
+// so every leaf covers a contiguous range [first, first + count).
+class BVH {
+public:
+    void build(const std::vector<AABB> &, std::vector<unsigned> &);
+    // Recomputes every node's box bottom up for primitives that moved but
+    // kept their order. Returns the tree's SAH cost relative to when it was
+    // built, which grows as things move away from where they started.
+    double refit(const std::vector<AABB> &);
+    void clear() { m_nodes.clear(); }
+    bool empty() const { return m_nodes.empty(); }
+
+    // Raw nodes, for writing out and reading back compiled scenes
+    const std::vector<BVHNode> &nodes() const { return m_nodes; }
+    void set_nodes(std::vector<BVHNode> nodes) { m_nodes = std::move(nodes); m_built_cost = cost(); }
+    // Whether set_nodes() was given a tree build() could have made over
+    // that many primitives, so traversing it stays in bounds
+    bool valid(size_t) const;
+
+    // Front-to-back closest-hit traversal. `test(first, count)` intersects
+    // a leaf's primitives and lowers closest_t on a hit, which in turn
+    // prunes every node that starts beyond it.
+    template <typename Test>
+    void traverse(const XYZ &, const XYZ &, double &, Test &&) const;
+
+    // Any-hit traversal for occlusion queries. Children are visited in
+    // whatever order and the walk stops as soon as `test(first, count)`
+    // reports a blocker.
+    template <typename Test>
+    bool traverse_any(const XYZ &, const XYZ &, double, Test &&) const;
+
+private:
+    void build_node(unsigned, const std::vector<AABB> &, const std::vector<XYZ> &,
+                    std::vector<unsigned> &, unsigned, unsigned, unsigned);
+
+    // Expected primitive and node tests per ray, relative to the root box
+    double cost() const;
+
+    std::vector<BVHNode> m_nodes;
+    double m_built_cost { 0 };
+};
+
+static inline XYZ inverse_delta(const XYZ &delta)
+{
+    // Keep the slab test free of infinities, -ffast-math assumes there are none
+    auto safe = [](double d) { return 1 / (d >= 0 ? std::max(d, 1e-12) : std::min(d, -1e-12)); };
+    return { safe(delta.x), safe(delta.y), safe(delta.z) };
+}
+
+double AABB::hit(const XYZ &from, const XYZ &inv_delta, double max_t) const
+{
+    double tx0 = (min.x - from.x) * inv_delta.x, tx1 = (max.x - from.x) * inv_delta.x;
+    double ty0 = (min.y - from.y) * inv_delta.y, ty1 = (max.y - from.y) * inv_delta.y;
+    double tz0 = (min.z - from.z) * inv_delta.z, tz1 = (max.z - from.z) * inv_delta.z;
+    double t_near = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+    double t_far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+    if (t_near > t_far || t_far < 0 || t_near >= max_t)
+        return -1;
+    return std::max(t_near, 0.0);
+}
+
+template <typename Test>
+void BVH::traverse(const XYZ &from, const XYZ &inv_delta, double &closest_t, Test &&test) const
+{
+    if (m_nodes.empty() || m_nodes[0].bounds.hit(from, inv_delta, closest_t) < 0)
+        return;
+
+    // Entries carry the node's entry distance so nodes queued before a
+    // closer hit was found can be dropped without another slab test
+    struct Entry { unsigned node; double t; };
+    Entry stack[64];
+    unsigned size = 0;
+    stack[size++] = { 0, 0 };
+
+    while (size > 0) {
+        Entry entry = stack[--size];
+        if (entry.t >= closest_t)
+            continue;
+        const BVHNode &node = m_nodes[entry.node];
+        if (node.count > 0) {
+            test(node.first, node.count);
+            continue;
+        }
+        double t_left = m_nodes[node.first].bounds.hit(from, inv_delta, closest_t);
+        double t_right = m_nodes[node.first + 1].bounds.hit(from, inv_delta, closest_t);
+        // Push the farther child first so the nearer one is visited next
+        if (t_left >= 0 && t_right >= 0) {
+            if (t_left < t_right) {
+                stack[size++] = { node.first + 1, t_right };
+                stack[size++] = { node.first, t_left };
+            } else {
+                stack[size++] = { node.first, t_left };
+                stack[size++] = { node.first + 1, t_right };
+            }
+        } else if (t_left >= 0) {
+            stack[size++] = { node.first, t_left };
+        } else if (t_right >= 0) {
+            stack[size++] = { node.first + 1, t_right };
+        }
+    }
+}
+
+template <typename Test>
+bool BVH::traverse_any(const XYZ &from, const XYZ &inv_delta, double max_t, Test &&test) const
+{
+    if (m_nodes.empty() || m_nodes[0].bounds.hit(from, inv_delta, max_t) < 0)
+        return false;
+
+    unsigned stack[64];
+    unsigned size = 0;
+    stack[size++] = 0;
+
+    while (size > 0) {
+        const BVHNode &node = m_nodes[stack[--size]];
+        if (node.count > 0) {
+            if (test(node.first, node.count))
+                return true;
+            continue;
+        }
+        if (m_nodes[node.first].bounds.hit(from, inv_delta, max_t) >= 0)
+            stack[size++] = node.first;
+        if (m_nodes[node.first + 1].bounds.hit(from, inv_delta, max_t) >= 0)
+            stack[size++] = node.first + 1;
+    }
+    return false;
+}
+
+#endif
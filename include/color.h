@@ -7,19 +7,25 @@
 #define MAX(a, b) (a > b ? a : b)
 #define MIN(a, b) (a < b ? a : b)
 
-struct Color {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-    uint8_t a;
+// Linear RGB in the same 0-255 units scenes are written in, but unclamped:
+// values past 255 are kept as HDR and only tonemapped when the image is
+// written. The fourth lane pads a Color out to one 16-byte SIMD register.
+struct alignas(16) Color {
+    float r;
+    float g;
+    float b;
+    float a;
 
-    Color operator+(uint8_t) const;
-    Color operator-(uint8_t) const;
-    Color operator*(uint8_t) const;
-    Color operator*(double x) const;
-    Color operator/(uint8_t) const;
-    Color operator+(const Color &) const;
-    Color operator-(const Color &) const;
+    Color operator+(float x) const { return { r + x, g + x, b + x, a }; }
+    Color operator-(float x) const { return { r - x, g - x, b - x, a }; }
+    Color operator*(double x) const { return { r * (float)x, g * (float)x, b * (float)x, a }; }
+    Color operator/(double x) const { return *this * (1 / x); }
+    Color operator+(const Color &o) const { return { r + o.r, g + o.g, b + o.b, a }; }
+    Color operator-(const Color &o) const { return { r - o.r, g - o.g, b - o.b, a }; }
+    Color operator*(const Color &o) const { return { r * o.r, g * o.g, b * o.b, a }; }
+    Color &operator+=(const Color &o) { r += o.r; g += o.g; b += o.b; return *this; }
+
+    double luminance() const { return 0.2126 * r + 0.7152 * g + 0.0722 * b; }
 };
 
 Color color_blend(std::initializer_list<Color>);
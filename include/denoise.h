@@ -0,0 +1,104 @@
+#ifndef _DENOISE_H
+#define _DENOISE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "color.h"
+#include "linear.h"
+#include "scheduler.h"
+
+/*
+ * Feature buffers and the edge-aware denoiser that runs on them. Alongside
+ * the colour, render() can record what each pixel's primary rays hit, and
+ * the denoiser blurs the image only across pixels whose features agree,
+ * so the noise of soft shadows and sampling goes while the edges of
+ * forms, creases and depth discontinuities stay sharp.
+ */
+
+enum class Feature {
+    Albedo,     // colour of the form hit, the background for misses
+    Normal,     // surface normal of the hit
+    Depth,      // distance from the camera to the hit, 0 for misses
+    Id,         // form hit by the pixel's first sample, NO_FORM for misses
+    Variance,   // of the pixel's mean luminance, how noisy it still is
+};
+
+// One pixel's sums over its samples, as render() gathers them
+struct FeatureSums {
+    Color albedo;
+    XYZ normal;
+    double depth;
+    unsigned samples;   // albedo is summed over all of them
+    unsigned hits;      // normal and depth over those that hit something
+    unsigned id;        // hit by the first sample
+    bool edge;          // the samples hit more than one form, saw more than
+                        // one in a reflection or hit glass
+    double variance;
+};
+
+// Per-pixel features, averaged over the pixel's samples
+class FeatureBuffers {
+public:
+    // Holds no pixels until reset()
+    FeatureBuffers() = default;
+
+    void reset(unsigned, unsigned);
+    void clear() { *this = FeatureBuffers(); }
+    bool empty() const { return m_depth.empty(); }
+
+    void set(unsigned x, unsigned y, const FeatureSums &);
+
+    const Color &albedo(size_t i) const { return m_albedo[i]; }
+    const XYZf &normal(size_t i) const { return m_normal[i]; }
+    float depth(size_t i) const { return m_depth[i]; }
+    uint32_t id(size_t i) const { return m_id[i]; }
+    float variance(size_t i) const { return m_variance[i]; }
+    bool edge(size_t i) const { return m_edge[i]; }
+
+    // A pixel's features as stored, for checkpoints
+    struct Pixel {
+        Color albedo;
+        XYZf normal;
+        float depth;
+        uint32_t id;
+        float variance;
+        uint32_t edge;
+    };
+    Pixel pixel(size_t) const;
+    void set_pixel(size_t, const Pixel &);
+
+    unsigned width() const { return m_width; }
+    unsigned height() const { return m_height; }
+
+    // PFM gets the values themselves (colours with 255 as 1.0), the other
+    // formats a picture of them: normals mapped to colours, depth from
+    // white near to black far, ids as random colours and the standard
+    // deviation of luminance. Throws std::runtime_error on I/O errors.
+    void save(Feature, const std::string &) const;
+
+private:
+    unsigned m_width { 0 };
+    unsigned m_height { 0 };
+    std::vector<Color> m_albedo;
+    std::vector<XYZf> m_normal;
+    std::vector<float> m_depth;
+    std::vector<uint32_t> m_id;
+    std::vector<float> m_variance;
+    std::vector<uint8_t> m_edge;
+};
+
+// Filters a width x height image of linear HDR pixels in place with
+// `passes` rounds of the edge-avoiding a-trous wavelet transform (Dammertz
+// et al. 2010): a 5x5 B3 spline kernel whose taps spread twice as far
+// every pass, weighted down by differences in albedo, normal, depth and
+// luminance and cut off entirely across different forms. As in SVGF
+// (Schied et al. 2017) luminance may differ by `sigma` times a pixel's
+// standard deviation, which the filter carries along, so it leaves alone
+// what was already clean. Pixels on the edges of forms, or of forms seen
+// in a reflection, are left as they are: their variance is antialiasing
+// rather than noise.
+void denoise(std::vector<Color> &, const FeatureBuffers &, unsigned passes, double sigma,
+    TileScheduler &);
+
+#endif
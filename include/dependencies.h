@@ -0,0 +1,21 @@
+#ifndef _DEPENDENCIES_H
+#define _DEPENDENCIES_H
+
+#include <vector>
+#include <utility>
+
+// Forms the rays of the batch a worker is tracing hit or were shadowed
+// by, as pairs of the batch's ray index and form id. Only collected while
+// `on`, which render_tile() sets for renders tracking dependencies (see
+// Raytracer::rerender()). trace() files what it sees under `ray`.
+struct TouchedForms {
+    bool on { false };
+    unsigned ray { 0 };
+    std::vector<std::pair<unsigned, unsigned>> pairs;
+
+    void add(unsigned form) { pairs.emplace_back(ray, form); }
+};
+
+extern thread_local TouchedForms t_touched;
+
+#endif
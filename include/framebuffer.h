@@ -0,0 +1,62 @@
+#ifndef _FRAMEBUFFER_H
+#define _FRAMEBUFFER_H
+
+#include <vector>
+#include "color.h"
+
+enum class Tonemap {
+    Clamp,      // clip at 255, the look of the old 8-bit pipeline
+    Reinhard,   // x / (1 + x), rolls highlights off instead of clipping
+};
+
+// zlib level PNGs get written with unless told otherwise, zlib's own
+// default: a good deal smaller than 1 for not much more time
+#define PNG_DEFAULT_LEVEL 6
+
+// Maps an HDR colour onto displayable 0-255 values
+Color tonemap(const Color &, Tonemap, double);
+
+// Float accumulation buffer. Samples are summed per pixel and only
+// averaged, tonemapped and quantized when the image is read out, so no
+// precision is lost however many samples land in a pixel.
+class Framebuffer {
+public:
+    // Holds no pixels until reset(), so a raytracer that only streams its
+    // output never pays for a full-size buffer
+    Framebuffer() = default;
+
+    // Resize to w x h and zero every pixel
+    void reset(unsigned, unsigned);
+    bool empty() const { return m_sums.empty(); }
+    void add(unsigned x, unsigned y, const Color &sum, unsigned count)
+    {
+        unsigned i = y * m_width + x;
+        m_sums[i] += sum;
+        m_counts[i] += count;
+    }
+
+    // Replaces a pixel's samples
+    void set(unsigned x, unsigned y, const Color &sum, unsigned count)
+    {
+        unsigned i = y * m_width + x;
+        m_sums[i] = sum;
+        m_counts[i] = count;
+    }
+
+    // Mean of the samples in a pixel, in linear HDR units
+    Color pixel(unsigned, unsigned) const;
+    // Sum of the samples in a pixel
+    const Color &sum(unsigned x, unsigned y) const { return m_sums[y * m_width + x]; }
+    unsigned samples(unsigned x, unsigned y) const { return m_counts[y * m_width + x]; }
+
+    unsigned width() const { return m_width; }
+    unsigned height() const { return m_height; }
+
+private:
+    unsigned m_width { 0 };
+    unsigned m_height { 0 };
+    std::vector<Color> m_sums;
+    std::vector<unsigned> m_counts;
+};
+
+#endif
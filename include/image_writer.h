@@ -0,0 +1,63 @@
+#ifndef _IMAGE_WRITER_H
+#define _IMAGE_WRITER_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <functional>
+#include <png.h>
+#include "framebuffer.h"
+#include "scheduler.h"
+
+enum class ImageFormat {
+    PNG,   // 8-bit RGB, tonemapped
+    PPM,   // binary P6, 8-bit RGB, tonemapped
+    PFM,   // 32-bit float RGB, linear HDR with 255 mapped to 1.0
+};
+
+// Picked from the file extension, PNG unless it's .ppm or .pfm
+ImageFormat image_format(const std::string &);
+
+// Writes a whole width x height image at once. `row(y, pixels)` fills in
+// row y's linear HDR pixels; bands of rows are converted and, for PNG,
+// filtered and deflated on the scheduler's workers in parallel, then
+// written out in order. PNG takes a zlib level from 0 (stored) to 9.
+// Throws std::runtime_error on I/O errors.
+void write_image(const std::string &, unsigned, unsigned,
+    const std::function<void(unsigned, Color *)> &, Tonemap, double, int, TileScheduler &);
+
+// Writes an image row by row, top to bottom, without ever holding more
+// than one row of it. Throws std::runtime_error on I/O errors.
+class ImageWriter {
+public:
+    ImageWriter(const std::string &, unsigned, unsigned, Tonemap, double, int level = PNG_DEFAULT_LEVEL);
+    ~ImageWriter();
+
+    ImageWriter(const ImageWriter &) = delete;
+    ImageWriter &operator=(const ImageWriter &) = delete;
+
+    // `count` rows of linear HDR pixels, width each
+    void write_rows(const Color *, unsigned count);
+    // Must be called once every row is in
+    void finish();
+
+private:
+    void release();
+    [[noreturn]] void fail(const char *);
+
+    std::string m_filename;
+    ImageFormat m_format;
+    unsigned m_width;
+    unsigned m_height;
+    Tonemap m_tonemap;
+    double m_exposure;
+
+    FILE *m_file { nullptr };
+    png_structp m_png { nullptr };
+    png_infop m_info { nullptr };
+    unsigned m_row { 0 };
+    long m_header_bytes { 0 };
+    std::vector<unsigned char> m_bytes;
+};
+
+#endif
@@ -1,14 +1,53 @@
 #ifndef _LIGHT_H
 #define _LIGHT_H
 
+#include <vector>
+#include <cstddef>
+#include <cstdint>
 #include "color.h"
 #include "linear.h"
 
-// TODO customizable lights
-struct PointLight {
-    XYZ source;
-    //Color color;
-    //double intensity;
+// At most this many lights are shaded per hit, see set_light_samples()
+#define MAX_LIGHT_SAMPLES 4
+// What a hit is lit by when the scene has no lights: ambient only
+#define NO_LIGHT ((unsigned)-1)
+
+enum class LightType : uint8_t {
+    Point,         // hard shadows, one shadow ray
+    Area,          // soft shadows from a grid of shadow rays
+    Directional,   // infinitely far away, one shadow ray
+};
+
+// Area lights are a square of shadow_grid_size x shadow_grid_size cells
+// facing along z, each `size` across (0 uses the shadow unit size).
+// Directional lights keep the direction they shine in as their position.
+struct Light {
+    LightType type;
+    XYZ position;
+    Color color;        // tints the diffuse and specular terms, 255 leaves them be
+    double intensity;   // scales the diffuse and specular terms
+    double size;
+
+    // What light selection weighs this one by
+    double power() const { return intensity * color.luminance() / 255; }
+};
+
+// Picks a light in proportion to its power in constant time, whatever the
+// number of lights, with Vose's alias method: every light gets a bucket
+// holding its own probability and the remainder goes to an alias.
+class LightSampler {
+public:
+    void build(const std::vector<Light> &);
+    // u is uniform in [0, 1)
+    unsigned sample(double u) const;
+    // The odds of sample() picking light i
+    double pdf(unsigned i) const { return m_pdf[i]; }
+    size_t size() const { return m_alias.size(); }
+
+private:
+    std::vector<double> m_pdf;
+    std::vector<double> m_probability;
+    std::vector<unsigned> m_alias;
 };
 
 #endif
@@ -1,25 +1,130 @@
 #ifndef _LINEAR_H
 #define _LINEAR_H
 
-struct XYZ {
-    double x;
-    double y;
-    double z;
-
-    XYZ normal() const;
-    double magnitude() const;
-
-    XYZ operator+(double) const;
-    XYZ operator-(double) const;
-    XYZ operator*(double) const;
-    XYZ operator/(double) const;
-    XYZ operator+(const XYZ &) const;
-    XYZ operator-(const XYZ &) const;
-    XYZ operator-() const;
+#include <cmath>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#define LINEAR_SSE
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define LINEAR_NEON
+#endif
+
+#define EPSILON 1e-4
+
+/*
+ * Three-component vectors over any scalar type. Everything is defined here
+ * so the per-ray maths inlines into its callers, and is constexpr apart
+ * from what needs a square root. dot(), cross() and distance() are found
+ * through the arguments, so they work on any Vec3.
+ */
+
+template <typename T>
+struct Vec3 {
+    T x;
+    T y;
+    T z;
+
+    constexpr Vec3 operator+(T a) const { return { x + a, y + a, z + a }; }
+    constexpr Vec3 operator-(T a) const { return { x - a, y - a, z - a }; }
+    constexpr Vec3 operator*(T a) const { return { x * a, y * a, z * a }; }
+    constexpr Vec3 operator/(T a) const { return { x / a, y / a, z / a }; }
+    constexpr Vec3 operator+(const Vec3 &o) const { return { x + o.x, y + o.y, z + o.z }; }
+    constexpr Vec3 operator-(const Vec3 &o) const { return { x - o.x, y - o.y, z - o.z }; }
+    constexpr Vec3 operator-() const { return { -x, -y, -z }; }
+
+    T magnitude() const { return std::sqrt(x * x + y * y + z * z); }
+    Vec3 normal() const { return *this / magnitude(); }
+
+    friend constexpr T dot(const Vec3 &a, const Vec3 &b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    friend constexpr Vec3 cross(const Vec3 &a, const Vec3 &b)
+    {
+        return {
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x,
+        };
+    }
+
+    friend T distance(const Vec3 &a, const Vec3 &b)
+    {
+        Vec3 d = b - a;
+        return std::sqrt(d.z * d.z + d.y * d.y + d.x * d.x);
+    }
+};
+
+#if defined(LINEAR_SSE) || defined(LINEAR_NEON)
+
+// Single precision fits in one 128-bit register, padded out by w the same
+// way Color is. w isn't part of the vector: keep it 0 or leave it be.
+template <>
+struct alignas(16) Vec3<float> {
+    float x;
+    float y;
+    float z;
+    float w;
+
+#if defined(LINEAR_SSE)
+    typedef __m128 Lanes;
+    Lanes lanes() const { return _mm_load_ps(&x); }
+    static Lanes splat(float a) { return _mm_set1_ps(a); }
+    static Lanes add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+    static Lanes sub(Lanes a, Lanes b) { return _mm_sub_ps(a, b); }
+    static Lanes mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+    static Lanes div(Lanes a, Lanes b) { return _mm_div_ps(a, b); }
+    static Vec3 from(Lanes v) { Vec3 r; _mm_store_ps(&r.x, v); return r; }
+#else
+    typedef float32x4_t Lanes;
+    Lanes lanes() const { return vld1q_f32(&x); }
+    static Lanes splat(float a) { return vdupq_n_f32(a); }
+    static Lanes add(Lanes a, Lanes b) { return vaddq_f32(a, b); }
+    static Lanes sub(Lanes a, Lanes b) { return vsubq_f32(a, b); }
+    static Lanes mul(Lanes a, Lanes b) { return vmulq_f32(a, b); }
+    static Lanes div(Lanes a, Lanes b) { return vdivq_f32(a, b); }
+    static Vec3 from(Lanes v) { Vec3 r; vst1q_f32(&r.x, v); return r; }
+#endif
+
+    Vec3 operator+(float a) const { return from(add(lanes(), splat(a))); }
+    Vec3 operator-(float a) const { return from(sub(lanes(), splat(a))); }
+    Vec3 operator*(float a) const { return from(mul(lanes(), splat(a))); }
+    Vec3 operator/(float a) const { return from(div(lanes(), splat(a))); }
+    Vec3 operator+(const Vec3 &o) const { return from(add(lanes(), o.lanes())); }
+    Vec3 operator-(const Vec3 &o) const { return from(sub(lanes(), o.lanes())); }
+    Vec3 operator-() const { return from(sub(splat(0), lanes())); }
+
+    float magnitude() const { return std::sqrt(dot(*this, *this)); }
+    Vec3 normal() const { return *this / magnitude(); }
+
+    friend float dot(const Vec3 &a, const Vec3 &b)
+    {
+        Vec3 p = from(mul(a.lanes(), b.lanes()));
+        return p.x + p.y + p.z;
+    }
+
+    friend Vec3 cross(const Vec3 &a, const Vec3 &b)
+    {
+        return {
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x,
+            0,
+        };
+    }
+
+    friend float distance(const Vec3 &a, const Vec3 &b)
+    {
+        return (b - a).magnitude();
+    }
 };
 
-double dot(const XYZ &, const XYZ &);
-XYZ cross(const XYZ &, const XYZ &);
-double distance(const XYZ &, const XYZ &);
+#endif
+
+typedef Vec3<double> XYZ;
+typedef Vec3<float> XYZf;
 
 #endif
@@ -0,0 +1,25 @@
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+// Read-only mapping of a whole file, unmapped on destruction. Throws
+// std::runtime_error if the file can't be opened or is empty.
+class MappedFile {
+public:
+    MappedFile(const std::string &);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data;
+    size_t m_size;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _MESH_H
+#define _MESH_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "linear.h"
+
+// Indexed triangle mesh. Triangle i is made of the vertices at
+// indices[3*i .. 3*i + 2], so vertices shared by neighbouring triangles
+// are stored once.
+struct Mesh {
+    std::vector<XYZ> vertices;
+    std::vector<uint32_t> indices;
+
+    size_t triangle_count() const { return indices.size() / 3; }
+    size_t memory() const;
+
+    XYZ vertex(size_t tri, unsigned corner) const { return vertices[indices[3 * tri + corner]]; }
+
+    // Uniformly scale and move the mesh so its bounding box is centred on
+    // center with its longest side size units long
+    void fit(const XYZ &center, double size);
+
+    // Reorders triangles, triangle i becomes the old order[i]
+    void permute(const std::vector<unsigned> &order);
+
+    // Closest Moller-Trumbore hit among triangles [first, first + count)
+    // below closest_t, same contract as the SIMD kernels
+    bool intersect(unsigned, unsigned, const XYZ &, const XYZ &, double &, unsigned &) const;
+};
+
+struct MeshLoadStats {
+    double seconds;
+    size_t file_bytes;
+    size_t mesh_bytes;   // vertex and index buffers
+    long peak_rss_kb;    // of the whole process once loading is done
+};
+
+// Loads a Wavefront OBJ or binary PLY file, picked by extension. The file
+// is mapped rather than read and split between threads for parsing.
+// Polygons are fanned into triangles, anything but positions and faces is
+// ignored. Throws std::runtime_error on files it can't make sense of.
+Mesh load_mesh(const std::string &, unsigned threads = 0, MeshLoadStats *stats = nullptr);
+
+#endif
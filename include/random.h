@@ -0,0 +1,22 @@
+#ifndef _RANDOM_H
+#define _RANDOM_H
+
+#include <cstdint>
+
+// Counter-based generator (splitmix64): every value is a hash of a key and
+// a counter, so there's no shared state. Keys are derived from the seed
+// and a pixel's coordinates, then per sample and per ray, which gives every
+// ray its own stream no matter which thread renders it or in what order.
+struct Random {
+    uint64_t state;
+
+    static uint64_t mix(uint64_t);
+    // Key for a branch of whatever `key` names, e.g. a pixel's samples or
+    // a hit's reflection and refraction rays
+    static uint64_t derive(uint64_t, uint64_t);
+
+    void seed(uint64_t key) { state = key; }
+    uint32_t next();
+};
+
+#endif
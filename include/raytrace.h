@@ -3,62 +3,283 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <utility>
-#include <png++/png.hpp>
 #include "light.h"
+#include "bvh.h"
+#include "scene.h"
+#include "simd.h"
+#include "random.h"
+#include "sampler.h"
+#include "shading.h"
+#include "scheduler.h"
+#include "framebuffer.h"
+#include "stats.h"
+#include "animation.h"
+#include "shadow_cache.h"
+#include "denoise.h"
+#include "dependencies.h"
 
 struct Form;
 struct Sphere;
 struct Wall;
 struct Triangle;
+struct MeshForm;
+struct Instance;
 
 class Raytracer {
+    // bench/bench.cpp times the private shading kernels directly
+    friend struct Bench;
+
 public:
     Raytracer(unsigned, unsigned);
 
+    // Builds the acceleration structures and the light sampler. Must run
+    // after the forms or lights change and before intersect(), render()
+    // calls it itself. Forms that were only moved get their BVH refit
+    // rather than rebuilt.
+    void finalize();
     void render();
-    std::pair<XYZ, Form *> intersect(const XYZ &, const XYZ &);
+    // Renders straight into an image file (PNG, PPM or PFM by extension)
+    // without a full-size framebuffer. Tiles are handed out in raster
+    // order and rows go to disk as soon as every tile covering them is
+    // done, so memory stays at a couple of rows of tiles. save() has
+    // nothing to write afterwards.
+    void render_to(const std::string &);
+    // Coordinates a render by worker processes connecting to the address
+    // (see Socket for the forms it takes) and collects their tiles into
+    // the framebuffer for save(). Returns once every pixel is in; workers
+    // may come and go in the meantime.
+    void render_distributed(const std::string &);
+    // Renders tiles for the coordinator at the address until it's done.
+    // Throws std::runtime_error if it can't be reached or was started on
+    // a different scene.
+    void serve_tiles(const std::string &);
+    Hit intersect(const XYZ &, const XYZ &);
+    unsigned occluded(const XYZ &, const XYZ &, double);
     Color cast_ray(const XYZ &, const XYZ &, unsigned, bool);
 
+    // PNG, PPM or PFM by extension, converted and compressed on all the
+    // render threads. Throws std::runtime_error on failure.
     void save(const std::string &);
 
-    void add_form(Sphere &&);
-    void add_form(const Sphere &);
-
-    void add_form(Wall &&);
-    void add_form(const Wall &);
+    // Compiled scenes hold the forms, materials, settings and built BVHs
+    // as flat arrays, so loading one maps the file and copies them back
+    // without any parsing or BVH building. Only meant to be read by the
+    // same build on the same kind of machine that wrote it.
+    void save_compiled(const std::string &);
+    static std::unique_ptr<Raytracer> load_compiled(const std::string &);
 
-    void add_form(Triangle &&);
-    void add_form(const Triangle &);
+    unsigned add_form(const Sphere &);
+    unsigned add_form(const Wall &);
+    unsigned add_form(const Triangle &);
+    unsigned add_form(MeshForm);
+    // Stores a mesh once for instances to place, returns its index. A
+    // prototype isn't drawn by itself.
+    unsigned add_prototype(Mesh);
+    // Throws std::runtime_error for prototypes that don't exist
+    unsigned add_form(const Instance &);
 
+    // Moves the first light, adding a white area light if there are none
     void set_light(const XYZ &);
+    // Returns the new light's index
+    unsigned add_light(const Light &);
+    // How many lights each hit is shaded with, up to MAX_LIGHT_SAMPLES.
+    // With more than one light they're picked at random in proportion to
+    // their power, so a hit costs the same whatever the number of lights.
+    // Each picked light is weighted by the inverse of its odds of being
+    // picked, so the picks estimate the sum of all the lights and adding
+    // lights adds light.
+    void set_light_samples(unsigned);
     void set_camera(const XYZ &);
 
+    // Places a form at a transform of the geometry it was added with,
+    // throws std::runtime_error for ids that don't exist
+    void move_form(unsigned, const Transform &);
+    // Gives a form another material, throws std::runtime_error for ids
+    // that don't exist
+    void set_material(unsigned, const Material &);
+    // Has render() note which forms each pixel's rays hit or were shadowed
+    // by, so rerender() can tell which pixels a material change reaches.
+    // Doesn't work with the shadow cache, whose results come from other
+    // pixels, or when resuming a checkpoint; render() throws.
+    void set_dependency_tracking(bool);
+    // Renders again only the pixels whose rays touched a form whose
+    // material changed since the last render() or rerender(), straight
+    // into the framebuffer, and returns how many. The image is the one a
+    // full render() would give. After forms were added or moved it falls
+    // back to render(); changing the camera, lights or settings needs a
+    // render() of its own. Throws std::runtime_error unless the last
+    // render() tracked dependencies.
+    unsigned rerender();
+
+    // Poses the camera, the light and the forms for a frame
+    void set_frame(const Animation &, double);
+    // Renders and saves frames first to last inclusive, see frame_filename()
+    // for the file names. Only what moves between frames gets updated.
+    void render_animation(const Animation &, unsigned, unsigned, const std::string &, bool stream = false);
+
     void set_diffuse(double);
     void set_ambient(double);
     void set_specular(double);
     void set_specular_size(int);
 
     void set_reflection_depth(unsigned);
+    // Secondary rays counting for less than `weight` of their pixel go on
+    // with odds in proportion, brighter to make up for the ones that don't
+    // (Russian roulette), and those under `cutoff` aren't traced at all.
+    // Both 0, the default, traces every ray up to the reflection depth.
+    void set_russian_roulette(double, double);
 
     void set_shadow_unit_size(double);
     void set_shadow_grid_size(unsigned);
+    // Reuse soft-shadow results between hits in the same cell of a grid
+    // with the given cell size, within the tolerance (see ShadowCache).
+    // Each worker's table holds `entries`, 32 bytes each. A cell size of
+    // 0 turns it off, which is the default.
+    void set_shadow_cache(double, double, unsigned);
 
     void set_pixel_sample_size(unsigned);
+    void set_sampler(SampleSequence);
+    void set_adaptive_sampling(unsigned, unsigned, double);
+
+    bool adaptive_sampling() const { return m_adaptive; }
+    double average_samples_per_pixel() const;
+
+    // Counters from the last render(), all zero unless built with RT_STATS
+    // (but for the samples per pixel, which are always counted)
+    RenderStats stats() const;
+    // Per-pixel cost recorded by the next render, throws unless built with
+    // RT_STATS. save_heatmap() writes it false-coloured, or raw for PFM.
+    void set_heatmap(Heatmap);
+    void save_heatmap(const std::string &);
+
+    // Filters what render() produces with that many passes of the
+    // edge-aware denoiser and its luminance sigma (see denoise()), 0 passes
+    // turns it off, which is the default. save() writes the filtered
+    // image. Neither denoising nor the feature buffers work with
+    // render_to() or render_distributed(), which throw.
+    void set_denoise(unsigned, double);
+    // Records the feature buffers in render() even without denoising
+    void set_features(bool);
+    // Throws std::runtime_error if the last render() recorded none
+    void save_feature(Feature, const std::string &);
 
     void set_background(const Color &);
+    // Applied by save(), the framebuffer itself stays linear HDR
+    void set_tonemap(Tonemap, double);
+    // zlib level for PNG output, 0 (stored, fastest) to 9 (smallest)
+    void set_png_compression(int);
+
+    // render() saves the tiles it has finished to the file every that many
+    // seconds, replacing it atomically, so a render that gets killed can
+    // be resumed. With resume it starts from what the file holds rather
+    // than overwriting it, and renders the same image as if it had never
+    // stopped; a missing file is an empty checkpoint, one written for a
+    // different scene or settings throws std::runtime_error. An empty
+    // file name, the default, turns checkpoints off.
+    void set_checkpoint(const std::string &, double, bool resume = false);
+
+    void set_thread_count(unsigned);
+    void set_tile_size(unsigned);
+    void set_seed(uint64_t);
 
 private:
     const unsigned m_width;
     const unsigned m_height;
 
-    png::image<png::rgb_pixel> m_image;
-    std::vector<Sphere> m_spheres;
-    std::vector<Wall> m_walls;
-    std::vector<Triangle> m_triangles;
+    Framebuffer m_framebuffer;
+
+    // Indexed by form id
+    std::vector<FormRef> m_forms;
+    std::vector<Material> m_materials;
+    std::map<Material, unsigned> m_material_index;
+
+    SphereSoA m_spheres;
+    std::vector<WallGeometry> m_walls;
+    TriangleSoA m_triangles;
+    std::vector<MeshGeometry> m_meshes;
+    std::vector<PrototypeGeometry> m_prototypes;
+    std::vector<InstanceGeometry> m_instances;
+
+    // Built by finalize() over the bounded forms, walls stay unbounded.
+    // Instances have a BVH over their world bounds on top of their
+    // prototypes' own.
+    BVH m_sphere_bvh;
+    BVH m_triangle_bvh;
+    BVH m_instance_bvh;
+    bool m_scene_dirty { true };
+
+    // The geometry of every form move_form() has touched, as it was added
+    struct RestPose {
+        Transform transform;
+        XYZ pivot;
+        XYZ a, b, c;                  // sphere centre, wall position and normal,
+                                      // triangle v0, e1, e2, instance translation
+        XYZ axes[3];                  // instances
+        double radius;
+        std::vector<XYZ> vertices;    // meshes
+    };
+    std::map<unsigned, RestPose> m_rest;
+    // Forms moved since the last finalize()
+    std::vector<unsigned> m_moved;
+    RestPose rest_pose(unsigned) const;
 
-    Color diffuse(const Color &, const XYZ &, const XYZ &);
-    double shadow_amount(const XYZ &);
+    unsigned add_form_ref(const Form &, FormType, unsigned);
+    const Material &material(unsigned id) const { return m_materials[m_forms[id].material]; }
+
+    RayTask primary_ray(unsigned, unsigned, unsigned, unsigned);
+    // Renders the tile's pixels, or only those set in `only`, and adds the
+    // (form << 32 | pixel) pairs of what they touched to `dependencies`,
+    // sorted, if given
+    void render_tile(const Tile &, std::vector<Color> &, std::vector<unsigned> &,
+        const std::vector<uint8_t> *only = nullptr, std::vector<uint64_t> *dependencies = nullptr);
+    // Index of one of make_tiles()' tiles of that size
+    size_t tile_index(const Tile &, unsigned) const;
+    // Fills m_denoised from the framebuffer, if denoising is on
+    void denoise_frame(TileScheduler &);
+    // Intersects a pixel's first `count` primary rays again for its
+    // features, the variance is its mean luminance's
+    void record_features(unsigned, unsigned, unsigned, unsigned, double);
+    // For render paths that never hold the whole image: throws if
+    // denoising or the feature buffers are on, and drops any left over
+    void no_features(const char *);
+    // costs, when given, gets the heatmap cost of each ray's whole tree
+    void trace_batch(const std::vector<RayTask> &, std::vector<Color> &, std::vector<float> *);
+    // Write and read back the finished tiles of render()'s list, the
+    // framebuffer, features and heatmap pixels they cover included
+    void save_checkpoint(const std::vector<Tile> &, const std::vector<uint8_t> &);
+    void load_checkpoint(const std::vector<Tile> &, std::vector<uint8_t> &);
+    // Clears the counters and sizes the heatmap for a new render
+    void reset_stats();
+    void merge_stats();
+    // Hash of the scene distributed workers must agree on
+    uint64_t fingerprint() const;
+
+    Color trace(const RayTask &);
+    XYZ surface_normal(const Hit &, const XYZ &);
+    ShadePoint shade_point(const Hit &, const RayTask &);
+    // Takes one shadow amount per light the point was shaded with
+    Color combine(const ShadePoint &, const Color &, const Color &, const double *);
+    void pick_lights(ShadePoint &, const Color &, uint64_t);
+    Color diffuse(const Color &, const XYZ &, const XYZ &, unsigned);
+    // Key for the shadow rays towards a hit's k-th light
+    static uint64_t light_key(uint64_t, unsigned);
+    // Whether a secondary ray with that weight gets traced, and the scale
+    // for its colour if it does
+    bool survives(uint64_t, double, double &);
+    // Shadow rays a light needs per hit, and where ray i goes and how far
+    // along it blockers count
+    unsigned light_rays(const Light &) const;
+    void light_ray(const Light &, const XYZ &, unsigned, uint64_t, XYZ &, double &);
+    XYZ shadow_spot(const Light &, unsigned, unsigned, uint64_t);
+    double shadow_amount(const XYZ &, unsigned, uint64_t);
+    // shadow_amount() for each of the point's lights through the shadow
+    // cache, if it's on
+    void shadow(const ShadePoint &, uint64_t, double *);
 
     double m_diffuse { 0.6 };
     double m_ambient { 0.28 };
@@ -66,25 +287,74 @@ private:
     double m_specular_size { 90 };
 
     unsigned m_reflection_depth { 4 };
+    double m_roulette_weight { 0 };
+    double m_roulette_cutoff { 0 };
 
     double m_shadow_unit_size { 12.0 };
     unsigned m_shadow_grid_size { 12 };
+    double m_shadow_cache_cell { 0 };
+    double m_shadow_cache_tolerance { 0.05 };
+    unsigned m_shadow_cache_entries { 1 << 18 };
+    // Tells the workers' shadow caches that a new render started
+    uint64_t m_render_id { 0 };
 
     unsigned m_pixel_sample_size { 8 };
+    Sampler m_sampler { SampleSequence::Sobol };
+
+    // Adaptive sampling takes rounds of m_adaptive_min samples until the
+    // standard error of a pixel's luminance drops under the threshold or
+    // it has m_adaptive_max samples
+    bool m_adaptive { false };
+    unsigned m_adaptive_min { 4 };
+    unsigned m_adaptive_max { 64 };
+    double m_adaptive_threshold { 1.0 };
+    std::atomic<uint64_t> m_samples_taken { 0 };
+
+    RenderStats m_stats {};
+    std::mutex m_stats_lock;
+    Heatmap m_heatmap_mode { Heatmap::Off };
+    std::vector<float> m_heatmap;
+
+    // Recorded by render() when denoising or asked to, empty otherwise
+    FeatureBuffers m_features;
+    bool m_record_features { false };
+    unsigned m_denoise_passes { 0 };
+    double m_denoise_sigma { 4 };
+    std::vector<Color> m_denoised;
 
     Color m_background_color { 0, 0, 0 };
+    Tonemap m_tonemap { Tonemap::Clamp };
+    double m_exposure { 1.0 };
+    int m_png_level { PNG_DEFAULT_LEVEL };
 
-    XYZ m_light;
-    XYZ m_camera;
+    // Per tile of the last render(), m_dependency_tile_size wide: the
+    // sorted (form << 32 | pixel) pairs of what each pixel's rays touched
+    bool m_track_dependencies { false };
+    std::vector<std::vector<uint64_t>> m_dependencies;
+    unsigned m_dependency_tile_size { 0 };
+    // Forms set_material() changed since
+    std::vector<unsigned> m_edited;
+
+    std::string m_checkpoint;
+    double m_checkpoint_seconds { 60 };
+    bool m_resume { false };
+    // Held while a finished tile goes into the framebuffer when
+    // checkpointing, so a checkpoint never sees half a tile
+    std::mutex m_checkpoint_lock;
 
-    friend class Sphere;
-    friend class Wall;
-    friend class Triangle;
+    unsigned m_thread_count;
+    unsigned m_tile_size { 16 };
+    uint64_t m_seed { 0 };
+
+    std::vector<Light> m_lights;
+    LightSampler m_light_sampler;
+    unsigned m_light_samples { 1 };
+    XYZ m_camera;
 };
 
+// Descriptions handed to add_form(). The raytracer splits them into
+// geometry and a Material and doesn't keep them around.
 struct Form {
-    virtual Color render(Raytracer *, const XYZ &, const XYZ &, unsigned) = 0;
-    unsigned id;
     Color color;
     double reflectance;
     double refractive_index;
@@ -95,23 +365,36 @@ struct Form {
 struct Sphere : Form {
     Sphere() = default;
     Sphere(const Color &, double, double, double, const XYZ &, double);
-    Color render(Raytracer *, const XYZ &, const XYZ &, unsigned) override;
     double radius;
 };
 
 struct Wall : Form {
     Wall() = default;
     Wall(const Color &, double, double, double, const XYZ &, const XYZ &);
-    Color render(Raytracer *, const XYZ &, const XYZ &, unsigned) override;
     XYZ normal;
 };
 
 struct Triangle : Form {
     Triangle() = default;
     Triangle(const Color &, double, double, double, const XYZ &, const XYZ &, const XYZ &);
-    Color render(Raytracer *, const XYZ &, const XYZ &, unsigned) override;
     XYZ vertices[3];
     XYZ edges[2];
 };
 
+// Taken by value so a loaded mesh can be moved in rather than copied
+struct MeshForm : Form {
+    MeshForm() = default;
+    MeshForm(const Color &, double, double, double, Mesh);
+    Mesh mesh;
+};
+
+// A prototype placed by a transform about the prototype's origin, with a
+// material of its own
+struct Instance : Form {
+    Instance() = default;
+    Instance(const Color &, double, double, double, unsigned, const Transform &);
+    unsigned prototype;
+    Transform transform;
+};
+
 #endif
@@ -0,0 +1,35 @@
+#ifndef _SAMPLER_H
+#define _SAMPLER_H
+
+#include <cstdint>
+#include <utility>
+
+enum class SampleSequence {
+    Random,
+    Stratified,
+    Halton,
+    Sobol,
+};
+
+// Sample dimensions. Each one gets its own scramble (and Halton bases), so
+// a pixel's sample positions don't line up with its light samples.
+#define SAMPLE_PIXEL 0
+#define SAMPLE_LIGHT 1
+
+// Stateless 2D sample generator. A point is a pure function of the key it
+// is scrambled with, its index among `count` points and its dimension, so
+// any thread can produce any sample and a seed always gives the same image.
+class Sampler {
+public:
+    Sampler(SampleSequence sequence) : m_sequence(sequence) {}
+
+    // Point `index` of `count`, in [0, 1) x [0, 1)
+    std::pair<double, double> sample(uint64_t, unsigned, unsigned, unsigned) const;
+
+    SampleSequence sequence() const { return m_sequence; }
+
+private:
+    SampleSequence m_sequence;
+};
+
+#endif
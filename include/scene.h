@@ -0,0 +1,130 @@
+#ifndef _SCENE_H
+#define _SCENE_H
+
+#include <vector>
+#include "color.h"
+#include "linear.h"
+#include "mesh.h"
+#include "bvh.h"
+
+// Every form added to a Raytracer gets an id, which indexes its FormRef.
+// Geometry and materials live apart from it, see below.
+#define NO_FORM ((unsigned)-1)
+
+struct Material {
+    Color color;
+    double reflectance;
+    double refractive_index;
+    double transmittance;
+
+    bool operator<(const Material &) const;
+};
+
+enum class FormType : uint8_t {
+    Sphere,
+    Wall,
+    Triangle,
+    Mesh,
+    Instance,
+};
+
+// Where a form's geometry currently sits and which material it uses.
+// Bounded forms are reordered whenever the BVHs are rebuilt, so index is
+// refreshed by finalize(). Forms with equal materials share one entry.
+struct FormRef {
+    FormType type;
+    unsigned index;
+    unsigned material;
+};
+
+struct Hit {
+    XYZ point;
+    unsigned id;
+    FormType type;
+    unsigned index;
+};
+
+// Geometry-only storage, one array per component so the intersection
+// kernels stream through it and can load several primitives at once. The
+// double arrays carry SIMD_PAD zeroed entries past the end so the last
+// group of a range may over-read; id has none.
+#define SIMD_PAD 3
+
+struct SphereSoA {
+    std::vector<double> x, y, z;
+    std::vector<double> r2;
+    std::vector<unsigned> id;
+
+    unsigned size() const { return id.size(); }
+    XYZ center(unsigned i) const { return { x[i], y[i], z[i] }; }
+
+    void push(const XYZ &, double, unsigned);
+    void permute(const std::vector<unsigned> &);
+};
+
+// Walls are unbounded and few, they're tested one by one ahead of the
+// BVHs and stay an array of structs. A Wall's normal is a point off the
+// wall, here it's the unit direction to it.
+struct WallGeometry {
+    XYZ position;
+    XYZ normal;
+    unsigned id;
+};
+
+struct TriangleSoA {
+    std::vector<double> v0x, v0y, v0z;
+    std::vector<double> e1x, e1y, e1z;
+    std::vector<double> e2x, e2y, e2z;
+    std::vector<unsigned> id;
+
+    unsigned size() const { return id.size(); }
+    XYZ v0(unsigned i) const { return { v0x[i], v0y[i], v0z[i] }; }
+    XYZ e1(unsigned i) const { return { e1x[i], e1y[i], e1z[i] }; }
+    XYZ e2(unsigned i) const { return { e2x[i], e2y[i], e2z[i] }; }
+
+    void push(const XYZ &, const XYZ &, const XYZ &, unsigned);
+    void permute(const std::vector<unsigned> &);
+};
+
+// A whole indexed mesh is one form with one material, its triangles are
+// read straight out of the shared buffers through a BVH of its own
+struct MeshGeometry {
+    Mesh mesh;
+    BVH bvh;
+    unsigned id;
+};
+
+// A mesh stored once for any number of instances to place. It isn't a
+// form and isn't drawn by itself.
+struct PrototypeGeometry {
+    Mesh mesh;
+    BVH bvh;
+};
+
+// One placement of a prototype. Rays are taken into the prototype's space
+// rather than its triangles into the world's, so an instance costs this
+// much whatever the size of the mesh. axes are the columns of the object
+// to world matrix and inverse the rows of its inverse. The transform is
+// affine, so a ray's t means the same in both spaces.
+struct InstanceGeometry {
+    unsigned prototype;
+    XYZ translation;
+    XYZ axes[3];
+    XYZ inverse[3];
+    unsigned id;
+
+    // Sets translation and axes and works out the inverse
+    void place(const XYZ &, const XYZ *);
+    XYZ to_object(const XYZ &p) const { return to_object_vector(p - translation); }
+    XYZ to_object_vector(const XYZ &v) const
+    {
+        return { dot(inverse[0], v), dot(inverse[1], v), dot(inverse[2], v) };
+    }
+    XYZ to_world(const XYZ &p) const { return translation + axes[0] * p.x + axes[1] * p.y + axes[2] * p.z; }
+    // An object space normal in world space, not normalized
+    XYZ normal_to_world(const XYZ &n) const { return inverse[0] * n.x + inverse[1] * n.y + inverse[2] * n.z; }
+    // World bounds of a box in object space
+    AABB bounds(const AABB &) const;
+};
+
+#endif
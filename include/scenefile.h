@@ -0,0 +1,88 @@
+#ifndef _SCENEFILE_H
+#define _SCENEFILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "raytrace.h"
+
+/*
+ * Text scene descriptions, one directive per line, `#` starts a comment:
+ *
+ *   size <width> <height>                  must come before any form
+ *   output <file>                          .png, .ppm or .pfm
+ *   stream on|off                          render_to() the output instead
+ *                                          of render() and save()
+ *   checkpoint <file> <seconds>            save the finished tiles that
+ *                                          often, see --resume; not with
+ *                                          the shadow cache
+ *   stats <file.json>                      write the render counters, needs
+ *   heatmap rays|time <file>               a build with RT_STATS, as does
+ *                                          the per-pixel cost image
+ *   feature albedo|normal|depth|id|variance <file>
+ *                                          save a feature buffer, any number
+ *                                          of times
+ *   camera <x> <y> <z>
+ *   light <x> <y> <z>                      moves the first light, a white
+ *                                          area light if there's none yet
+ *   point_light <x> <y> <z> [color <r> <g> <b>] [intensity <i>]
+ *   area_light <x> <y> <z> [size <cell size>] [color <r> <g> <b>] [intensity <i>]
+ *   directional_light <dx> <dy> <dz> [color <r> <g> <b>] [intensity <i>]
+ *   background <r> <g> <b>
+ *   material <name> <r> <g> <b> <reflectance> <refractive index> <transmittance>
+ *   wall <material> <px> <py> <pz> <nx> <ny> <nz>
+ *   sphere <material> <x> <y> <z> <radius>
+ *   triangle <material> <x0> <y0> <z0> <x1> <y1> <z1> <x2> <y2> <z2>
+ *   mesh <material> <file> [flip_y] [fit <x> <y> <z> <size>]
+ *   prototype <name> <file> [flip_y] [fit <x> <y> <z> <size>]
+ *                                          a mesh stored once for instances,
+ *                                          not drawn by itself
+ *   instance <material> <prototype> [translate <x> <y> <z>]
+ *            [rotate <x> <y> <z>] [scale <s>]
+ *   name <name>                            names the form just added
+ *
+ * Animations render frames first to last into the output file name with
+ * %d or %04d replaced by the frame number (see frame_filename()):
+ *
+ *   frames <first> <last>
+ *   keyframe <frame> camera|light <x> <y> <z>
+ *   keyframe <frame> <form name> [translate <x> <y> <z>]
+ *                    [rotate <x> <y> <z>] [scale <s>]
+ *                                          relative to the form as added
+ *
+ * and one line per setter, named after it without `set_`:
+ *
+ *   diffuse, ambient, specular, specular_size, reflection_depth,
+ *   shadow_unit_size, shadow_grid_size, pixel_sample_size, thread_count,
+ *   tile_size, seed, light_samples         one number each
+ *   sampler random|stratified|halton|sobol
+ *   adaptive_sampling <min> <max> <threshold>
+ *   russian_roulette <weight> <cutoff>
+ *   denoise <passes> <sigma>
+ *   shadow_cache <cell size> <tolerance> <entries per worker>
+ *   tonemap clamp|reinhard <exposure>
+ *   png_compression <0-9>
+ *
+ * Mesh paths are relative to the scene file.
+ */
+
+struct SceneInfo {
+    std::string output { "out.png" };
+    bool stream { false };
+    std::string checkpoint;
+    double checkpoint_seconds { 60 };
+    std::string stats;
+    Heatmap heatmap { Heatmap::Off };
+    std::string heatmap_output;
+    std::vector<std::pair<Feature, std::string>> features;
+    bool animated { false };
+    unsigned first_frame { 0 };
+    unsigned last_frame { 0 };
+    Animation animation;
+    std::vector<std::pair<std::string, MeshLoadStats>> meshes;
+};
+
+// Throws std::runtime_error naming the file and line on bad input
+std::unique_ptr<Raytracer> load_scene(const std::string &, SceneInfo &);
+
+#endif
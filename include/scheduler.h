@@ -0,0 +1,48 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <functional>
+
+// Rectangular block of pixels, [x0, x1) x [y0, y1)
+struct Tile {
+    unsigned x0;
+    unsigned y0;
+    unsigned x1;
+    unsigned y1;
+};
+
+std::vector<Tile> make_tiles(unsigned, unsigned, unsigned);
+
+// Pool of worker threads, each owning a queue of tiles. A worker pops from
+// the back of its own queue and, once that runs dry, steals from the front
+// of the others so that expensive regions don't leave threads idle.
+class TileScheduler {
+public:
+    TileScheduler(unsigned);
+
+    void run(const std::vector<Tile> &, const std::function<void(unsigned, const Tile &)> &);
+
+    // Hands tiles out strictly in list order from one shared counter, for
+    // consumers that must see them complete roughly in order
+    void run_in_order(const std::vector<Tile> &, const std::function<void(unsigned, const Tile &)> &);
+
+    unsigned thread_count() const { return m_thread_count; }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<Tile> tiles;
+    };
+
+    bool pop(unsigned, Tile &);
+    bool steal(unsigned, Tile &);
+
+    const unsigned m_thread_count;
+    std::vector<std::unique_ptr<Queue>> m_queues;
+};
+
+#endif
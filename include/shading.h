@@ -0,0 +1,51 @@
+#ifndef _SHADING_H
+#define _SHADING_H
+
+#include <cstdint>
+#include "color.h"
+#include "linear.h"
+#include "light.h"
+
+// A ray waiting to be traced. The key names its place in a sample's ray
+// tree (see Random::derive) and seeds anything random about shading its
+// hit, so results don't depend on the order rays are evaluated in. The
+// weight is the most its colour can count for in the pixel's.
+struct RayTask {
+    XYZ from;
+    XYZ to;
+    unsigned depth;
+    bool is_reflect;
+    uint64_t key;
+    double weight { 1 };
+};
+
+// Everything a hit contributes on its own, plus the secondary rays it
+// asked for. Raytracer::combine() folds their colours back in once traced.
+struct ShadePoint {
+    XYZ hit;
+    XYZ normal;
+    unsigned id;
+    // The lights picked for this hit and its colour under each of them,
+    // see Raytracer::pick_lights()
+    unsigned lights;
+    unsigned light[MAX_LIGHT_SAMPLES];
+    Color surface[MAX_LIGHT_SAMPLES];
+    Color base;
+    double reflectance;
+    double transmittance;
+    double fresnel;
+    bool reflect;
+    bool refract;
+    // What the secondary colours get scaled by for the rays Russian
+    // roulette let through, 1 when it's off
+    double reflect_scale;
+    double refract_scale;
+    RayTask reflect_ray;
+    RayTask refract_ray;
+};
+
+// Fresnel reflectance for a ray along delta meeting a surface with the
+// given unit normal and refractive index
+double fresnel_amount(const XYZ &, const XYZ &, double);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef _SHADOW_CACHE_H
+#define _SHADOW_CACHE_H
+
+#include <vector>
+#include <cstdint>
+#include "linear.h"
+
+// A cell needs this many exact results before it's trusted
+#define SHADOW_CACHE_SAMPLES 16
+// Entries a cell can go in, see ShadowCache::slot()
+#define SHADOW_CACHE_WAYS 4
+
+// Soft-shadow results on a hashed world-space grid, keyed by cell, form,
+// which way the surface faces and the light. A cell answers lookups once it has
+// SHADOW_CACHE_SAMPLES exact results that all lie within the tolerance of
+// each other, and none of its neighbours has seen anything different, so
+// fully lit and fully shadowed surfaces stop tracing shadow rays while
+// penumbrae and the cells around them keep being traced exactly.
+//
+// Every render worker has its own that lasts for the whole render, so
+// there's no locking, but what a worker has cached depends on which tiles
+// it happened to get. With more than one thread, pixels near shadow edges
+// can come out a little differently from run to run. The table's size is
+// fixed, new cells push out the least sampled ones.
+class ShadowCache {
+public:
+    struct Cell {
+        uint64_t base;   // form, facing and light
+        int64_t x, y, z;
+    };
+
+    // A fresh id for each render, the first begin() with a new one sizes
+    // the table for at least `capacity` entries and clears it
+    static uint64_t new_render();
+    void begin(uint64_t render, double cell, double tolerance, unsigned capacity);
+    // Forgets everything, without touching the table
+    void clear();
+
+    // Cell of a hit point with its normal, form id and light
+    Cell cell(const XYZ &, const XYZ &, unsigned, unsigned) const;
+    bool lookup(const Cell &, double &) const;
+    void record(const Cell &, double);
+
+private:
+    struct Entry {
+        uint64_t key;
+        uint32_t generation;
+        uint32_t count;
+        float min, max;
+        double sum;
+    };
+
+    static uint64_t key(const Cell &, int, int, int);
+    const Entry *find(uint64_t) const;
+    size_t slot(uint64_t) const;
+
+    std::vector<Entry> m_entries;
+    uint64_t m_render { 0 };
+    uint32_t m_generation { 0 };
+    double m_inv_cell { 0 };
+    double m_tolerance { 0 };
+};
+
+extern thread_local ShadowCache t_shadow_cache;
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include "scene.h"
+
+// Intersect from + delta * t with primitives [first, first + count). On a
+// hit with EPSILON < t < closest_t the nearest such primitive is written to
+// index and closest_t is lowered. Ties go to the lowest index, exactly like
+// a scalar loop, so every implementation picks the same hit.
+typedef bool (*SphereKernel)(const SphereSoA &, unsigned, unsigned,
+                             const XYZ &, const XYZ &, double &, unsigned &);
+typedef bool (*TriangleKernel)(const TriangleSoA &, unsigned, unsigned,
+                               const XYZ &, const XYZ &, double &, unsigned &);
+
+struct SimdKernels {
+    const char *name;
+    SphereKernel spheres;
+    TriangleKernel triangles;
+};
+
+// Picked once from the CPU's features: avx2 (4 lanes), sse2 (2 lanes) or
+// scalar. RT_SIMD=scalar|sse2|avx2 in the environment can ask for a lower
+// level, which is handy for comparing them.
+const SimdKernels &simd_kernels();
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _SOCKET_H
+#define _SOCKET_H
+
+#include <string>
+#include <cstddef>
+
+// Stream socket, closed on destruction. Addresses are "unix:<path>" for a
+// Unix domain socket, "<host>:<port>" for TCP, or just "<port>" for TCP
+// on 127.0.0.1; listening on "0.0.0.0:<port>" takes any interface.
+// Setting up throws std::runtime_error on failure.
+class Socket {
+public:
+    Socket() = default;
+    ~Socket();
+    Socket(Socket &&);
+    Socket &operator=(Socket &&);
+
+    Socket(const Socket &) = delete;
+    Socket &operator=(const Socket &) = delete;
+
+    // A listening Unix socket removes its file again when closed
+    static Socket listen(const std::string &);
+    // Keeps retrying for up to `seconds` while nothing is listening yet
+    static Socket connect(const std::string &, double seconds);
+    Socket accept();
+
+    // All of it, throws std::runtime_error if the peer is gone
+    void send(const void *, size_t);
+    // Exactly n bytes, false if the stream ended or failed first
+    bool receive(void *, size_t);
+    // Whatever has arrived, up to n bytes, 0 once the stream ended or failed
+    size_t receive_some(void *, size_t);
+
+    int fd() const { return m_fd; }
+
+private:
+    explicit Socket(int fd) : m_fd(fd) {}
+    void close();
+
+    int m_fd { -1 };
+    std::string m_unlink;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+
+// Counting only happens in builds with RT_STATS defined (`make STATS=1`),
+// everywhere else STATS() expands to nothing and costs nothing
+#ifdef RT_STATS
+#define STATS(...) do { __VA_ARGS__; } while (0)
+#else
+#define STATS(...) do { } while (0)
+#endif
+
+enum StatRay {
+    STAT_PRIMARY,
+    STAT_REFLECTION,
+    STAT_REFRACTION,
+    STAT_SHADOW,
+    STAT_RAY_KINDS,
+};
+
+enum StatPhase {
+    STAT_BUILD,    // finalize(), the BVHs
+    STAT_TRACE,    // rendering tiles
+    STAT_CHECKPOINT, // saving checkpoints, while tracing
+    STAT_DENOISE,  // filtering the image
+    STAT_OUTPUT,   // writing the image
+    STAT_PHASES,
+};
+
+// Indexed by FormType
+#define STAT_FORM_TYPES 5
+// Recursion levels, the last one also counts everything deeper
+#define STAT_DEPTHS 16
+
+// What a heatmap records for each pixel: every ray its samples led to
+// (shadow rays included), or the time spent tracing them
+enum class Heatmap {
+    Off,
+    Rays,
+    Time,
+};
+
+struct RenderStats {
+    uint64_t rays[STAT_RAY_KINDS];
+    uint64_t tests[STAT_FORM_TYPES];
+    uint64_t hits[STAT_FORM_TYPES];
+    uint64_t depth[STAT_DEPTHS];
+    double seconds[STAT_PHASES];
+    uint64_t shadow_cache_hits;
+    double samples_per_pixel;
+
+    uint64_t total_rays() const;
+    void count_depth(unsigned level) { depth[level < STAT_DEPTHS ? level : STAT_DEPTHS - 1]++; }
+    void merge(const RenderStats &);
+
+    void print(FILE *) const;
+    // Throws std::runtime_error if the file can't be written
+    void write_json(const std::string &) const;
+};
+
+// Adds the time until it goes out of scope to a phase, or does nothing
+// without RT_STATS
+class PhaseTimer {
+public:
+#ifdef RT_STATS
+    PhaseTimer(double &seconds) : m_seconds(seconds), m_start(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer()
+    {
+        m_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    double &m_seconds;
+    std::chrono::steady_clock::time_point m_start;
+#else
+    PhaseTimer(double &) {}
+#endif
+};
+
+// The calling thread's counters. Render workers fold theirs into the
+// raytracer's totals after every tile.
+extern thread_local RenderStats t_stats;
+
+#endif
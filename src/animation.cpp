@@ -0,0 +1,217 @@
+#include <cmath>
+#include <cctype>
+#include <stdexcept>
+#include "animation.h"
+#include "raytrace.h"
+
+bool Transform::operator==(const Transform &other) const
+{
+    return translation.x == other.translation.x && translation.y == other.translation.y &&
+           translation.z == other.translation.z && rotation.x == other.rotation.x &&
+           rotation.y == other.rotation.y && rotation.z == other.rotation.z &&
+           scale == other.scale;
+}
+
+XYZ Transform::rotate(const XYZ &v) const
+{
+    XYZ r = v;
+    if (rotation.x != 0) {
+        double s = sin(rotation.x * M_PI / 180), c = cos(rotation.x * M_PI / 180);
+        r = { r.x, r.y * c - r.z * s, r.y * s + r.z * c };
+    }
+    if (rotation.y != 0) {
+        double s = sin(rotation.y * M_PI / 180), c = cos(rotation.y * M_PI / 180);
+        r = { r.x * c + r.z * s, r.y, r.z * c - r.x * s };
+    }
+    if (rotation.z != 0) {
+        double s = sin(rotation.z * M_PI / 180), c = cos(rotation.z * M_PI / 180);
+        r = { r.x * c - r.y * s, r.x * s + r.y * c, r.z };
+    }
+    return r;
+}
+
+XYZ Transform::apply_vector(const XYZ &v) const
+{
+    return scale == 1 ? rotate(v) : rotate(v) * scale;
+}
+
+XYZ Transform::apply(const XYZ &p, const XYZ &pivot) const
+{
+    // Plain moves leave the point itself alone, so a form keyed back to
+    // where it started ends up exactly where it was added
+    if (scale == 1 && rotation.x == 0 && rotation.y == 0 && rotation.z == 0)
+        return p + translation;
+    return pivot + translation + apply_vector(p - pivot);
+}
+
+XYZ lerp(const XYZ &a, const XYZ &b, double t)
+{
+    return a + (b - a) * t;
+}
+
+Transform lerp(const Transform &a, const Transform &b, double t)
+{
+    return {
+        lerp(a.translation, b.translation, t),
+        lerp(a.rotation, b.rotation, t),
+        a.scale + (b.scale - a.scale) * t,
+    };
+}
+
+std::string frame_filename(const std::string &pattern, unsigned frame)
+{
+    // Look for %d or %0<width>d
+    size_t at = pattern.find('%'), end = at;
+    size_t width = 0;
+    while (at != std::string::npos) {
+        end = at + 1;
+        while (end < pattern.size() && isdigit((unsigned char)pattern[end]))
+            width = width * 10 + (pattern[end++] - '0');
+        if (end < pattern.size() && pattern[end] == 'd')
+            break;
+        at = pattern.find('%', at + 1);
+        width = 0;
+    }
+
+    std::string name = pattern;
+    if (at != std::string::npos) {
+        name.erase(at, end + 1 - at);
+    } else {
+        size_t dot = pattern.rfind('.'), slash = pattern.rfind('/');
+        width = 4;
+        at = dot != std::string::npos && (slash == std::string::npos || dot > slash) ?
+            dot : pattern.size();
+    }
+    std::string number = std::to_string(frame);
+    if (number.size() < width)
+        number.insert(0, width - number.size(), '0');
+    return name.insert(at, number);
+}
+
+Raytracer::RestPose Raytracer::rest_pose(unsigned id) const
+{
+    const FormRef &ref = m_forms[id];
+    RestPose rest;
+    switch (ref.type) {
+    case FormType::Sphere:
+        rest.a = m_spheres.center(ref.index);
+        rest.radius = sqrt(m_spheres.r2[ref.index]);
+        rest.pivot = rest.a;
+        break;
+    case FormType::Wall:
+        rest.a = m_walls[ref.index].position;
+        rest.b = m_walls[ref.index].normal;
+        rest.pivot = rest.a;
+        break;
+    case FormType::Triangle:
+        rest.a = m_triangles.v0(ref.index);
+        rest.b = m_triangles.e1(ref.index);
+        rest.c = m_triangles.e2(ref.index);
+        rest.pivot = rest.a + (rest.b + rest.c) / 3;
+        break;
+    case FormType::Mesh: {
+        AABB box = AABB::empty();
+        rest.vertices = m_meshes[ref.index].mesh.vertices;
+        for (auto &v : rest.vertices)
+            box.extend(v);
+        rest.pivot = box.center();
+        break;
+    }
+    case FormType::Instance: {
+        // Turns about the middle of the prototype as placed
+        const InstanceGeometry &instance = m_instances[ref.index];
+        AABB box = AABB::empty();
+        for (auto &v : m_prototypes[instance.prototype].mesh.vertices)
+            box.extend(v);
+        rest.a = instance.translation;
+        for (unsigned i = 0; i < 3; i++)
+            rest.axes[i] = instance.axes[i];
+        rest.pivot = instance.to_world(box.center());
+        break;
+    }
+    }
+    return rest;
+}
+
+void Raytracer::move_form(unsigned id, const Transform &transform)
+{
+    if (id >= m_forms.size())
+        throw std::runtime_error("can't move form " + std::to_string(id) + ", there's no such form");
+
+    auto found = m_rest.find(id);
+    if (found == m_rest.end())
+        found = m_rest.emplace(id, rest_pose(id)).first;
+    RestPose &rest = found->second;
+    if (transform == rest.transform)
+        return;
+    rest.transform = transform;
+
+    const FormRef &ref = m_forms[id];
+    switch (ref.type) {
+    case FormType::Sphere: {
+        XYZ center = transform.apply(rest.a, rest.pivot);
+        double radius = rest.radius * transform.scale;
+        m_spheres.x[ref.index] = center.x;
+        m_spheres.y[ref.index] = center.y;
+        m_spheres.z[ref.index] = center.z;
+        m_spheres.r2[ref.index] = radius * radius;
+        break;
+    }
+    case FormType::Wall:
+        m_walls[ref.index].position = transform.apply(rest.a, rest.pivot);
+        m_walls[ref.index].normal = transform.rotate(rest.b);
+        break;
+    case FormType::Triangle: {
+        XYZ v0 = transform.apply(rest.a, rest.pivot);
+        XYZ e1 = transform.apply_vector(rest.b), e2 = transform.apply_vector(rest.c);
+        unsigned i = ref.index;
+        m_triangles.v0x[i] = v0.x; m_triangles.v0y[i] = v0.y; m_triangles.v0z[i] = v0.z;
+        m_triangles.e1x[i] = e1.x; m_triangles.e1y[i] = e1.y; m_triangles.e1z[i] = e1.z;
+        m_triangles.e2x[i] = e2.x; m_triangles.e2y[i] = e2.y; m_triangles.e2z[i] = e2.z;
+        break;
+    }
+    case FormType::Mesh: {
+        auto &vertices = m_meshes[ref.index].mesh.vertices;
+        for (size_t i = 0; i < vertices.size(); i++)
+            vertices[i] = transform.apply(rest.vertices[i], rest.pivot);
+        break;
+    }
+    case FormType::Instance: {
+        XYZ axes[3];
+        for (unsigned i = 0; i < 3; i++)
+            axes[i] = transform.apply_vector(rest.axes[i]);
+        m_instances[ref.index].place(transform.apply(rest.a, rest.pivot), axes);
+        break;
+    }
+    }
+    m_moved.push_back(id);
+}
+
+void Raytracer::set_frame(const Animation &animation, double frame)
+{
+    if (!animation.camera.empty())
+        set_camera(animation.camera.at(frame));
+    if (!animation.light.empty())
+        set_light(animation.light.at(frame));
+    for (auto &form : animation.forms)
+        move_form(form.first, form.second.at(frame));
+}
+
+void Raytracer::render_animation(
+    const Animation &animation,
+    unsigned first,
+    unsigned last,
+    const std::string &pattern,
+    bool stream
+){
+    for (unsigned frame = first; frame <= last; frame++) {
+        set_frame(animation, frame);
+        std::string filename = frame_filename(pattern, frame);
+        if (stream) {
+            render_to(filename);
+        } else {
+            render();
+            save(filename);
+        }
+    }
+}
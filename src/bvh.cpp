@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include "bvh.h"
+
+#define BVH_BINS 16
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 60
+
+AABB AABB::empty()
+{
+    double inf = std::numeric_limits<double>::max();
+    return { { inf, inf, inf }, { -inf, -inf, -inf } };
+}
+
+void AABB::extend(const XYZ &p)
+{
+    min = { std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z) };
+    max = { std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z) };
+}
+
+void AABB::extend(const AABB &other)
+{
+    extend(other.min);
+    extend(other.max);
+}
+
+XYZ AABB::center() const
+{
+    return (min + max) / 2;
+}
+
+double AABB::area() const
+{
+    XYZ d = max - min;
+    if (d.x < 0 || d.y < 0 || d.z < 0)
+        return 0;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static double axis(const XYZ &v, int a)
+{
+    return a == 0 ? v.x : a == 1 ? v.y : v.z;
+}
+
+void BVH::build(const std::vector<AABB> &bounds, std::vector<unsigned> &order)
+{
+    m_nodes.clear();
+    order.resize(bounds.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (bounds.empty())
+        return;
+
+    std::vector<XYZ> centers;
+    centers.reserve(bounds.size());
+    for (auto &b : bounds)
+        centers.push_back(b.center());
+
+    m_nodes.reserve(2 * bounds.size());
+    m_nodes.push_back({});
+    build_node(0, bounds, centers, order, 0, bounds.size(), 0);
+    m_built_cost = cost();
+}
+
+// Children always come after their parent, so walking the nodes backwards
+// sees both children of a node before the node itself
+double BVH::refit(const std::vector<AABB> &bounds)
+{
+    for (size_t i = m_nodes.size(); i-- > 0;) {
+        BVHNode &node = m_nodes[i];
+        node.bounds = AABB::empty();
+        if (node.count > 0) {
+            for (unsigned p = node.first; p < node.first + node.count; p++)
+                node.bounds.extend(bounds[p]);
+        } else {
+            node.bounds.extend(m_nodes[node.first].bounds);
+            node.bounds.extend(m_nodes[node.first + 1].bounds);
+        }
+    }
+    return m_built_cost > 0 ? cost() / m_built_cost : 1;
+}
+
+// Children come after their parent, so there are no cycles, and a tree no
+// deeper than build() makes fits the traversal stacks
+bool BVH::valid(size_t primitives) const
+{
+    std::vector<unsigned> depth(m_nodes.size(), 0);
+    for (size_t i = 0; i < m_nodes.size(); i++) {
+        const BVHNode &node = m_nodes[i];
+        if (node.count > 0) {
+            if (node.first > primitives || node.count > primitives - node.first)
+                return false;
+            continue;
+        }
+        if (node.first <= i || node.first >= m_nodes.size() - 1 || depth[i] >= BVH_MAX_DEPTH)
+            return false;
+        depth[node.first] = std::max(depth[node.first], depth[i] + 1);
+        depth[node.first + 1] = std::max(depth[node.first + 1], depth[i] + 1);
+    }
+    return true;
+}
+
+double BVH::cost() const
+{
+    if (m_nodes.empty() || m_nodes[0].bounds.area() <= 0)
+        return 0;
+    double total = 0;
+    for (auto &node : m_nodes)
+        total += node.bounds.area() * (node.count > 0 ? node.count : 1);
+    return total / m_nodes[0].bounds.area();
+}
+
+void BVH::build_node(
+    unsigned index,
+    const std::vector<AABB> &bounds,
+    const std::vector<XYZ> &centers,
+    std::vector<unsigned> &order,
+    unsigned first,
+    unsigned count,
+    unsigned depth
+){
+    AABB node_bounds = AABB::empty(), center_bounds = AABB::empty();
+    for (unsigned i = first; i < first + count; i++) {
+        node_bounds.extend(bounds[order[i]]);
+        center_bounds.extend(centers[order[i]]);
+    }
+    m_nodes[index] = { node_bounds, first, count };
+    if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH)
+        return;
+
+    // Split along the widest axis of the centroids
+    XYZ extent = center_bounds.max - center_bounds.min;
+    int split_axis = 0;
+    if (extent.y > extent.x) split_axis = 1;
+    if (extent.z > axis(extent, split_axis)) split_axis = 2;
+    double lo = axis(center_bounds.min, split_axis);
+    double width = axis(extent, split_axis);
+    if (width <= 0)
+        return;
+
+    struct Bin { AABB bounds; unsigned count; };
+    Bin bins[BVH_BINS];
+    for (auto &bin : bins)
+        bin = { AABB::empty(), 0 };
+    auto bin_of = [&](unsigned prim) {
+        int b = (int)((axis(centers[prim], split_axis) - lo) / width * BVH_BINS);
+        return std::min(std::max(b, 0), BVH_BINS - 1);
+    };
+    for (unsigned i = first; i < first + count; i++) {
+        Bin &bin = bins[bin_of(order[i])];
+        bin.bounds.extend(bounds[order[i]]);
+        bin.count++;
+    }
+
+    // Sweep from the right to get suffix areas, then from the left to
+    // evaluate the surface area heuristic at each bin boundary
+    double right_area[BVH_BINS];
+    unsigned right_count[BVH_BINS];
+    AABB acc = AABB::empty();
+    unsigned acc_count = 0;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+        acc.extend(bins[b].bounds);
+        acc_count += bins[b].count;
+        right_area[b] = acc.area();
+        right_count[b] = acc_count;
+    }
+
+    double best_cost = std::numeric_limits<double>::max();
+    int best_split = -1;
+    acc = AABB::empty();
+    acc_count = 0;
+    for (int b = 1; b < BVH_BINS; b++) {
+        acc.extend(bins[b - 1].bounds);
+        acc_count += bins[b - 1].count;
+        if (acc_count == 0 || right_count[b] == 0)
+            continue;
+        double cost = acc.area() * acc_count + right_area[b] * right_count[b];
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_split = b;
+        }
+    }
+
+    // Keep the leaf if no split beats intersecting everything in it
+    if (best_split < 0 || best_cost >= node_bounds.area() * count)
+        return;
+
+    auto middle = std::partition(order.begin() + first, order.begin() + first + count,
+        [&](unsigned prim) { return bin_of(prim) < best_split; });
+    unsigned left_count = middle - (order.begin() + first);
+
+    unsigned left = m_nodes.size();
+    m_nodes.push_back({});
+    m_nodes.push_back({});
+    m_nodes[index].first = left;
+    m_nodes[index].count = 0;
+    build_node(left, bounds, centers, order, first, left_count, depth + 1);
+    build_node(left + 1, bounds, centers, order, first + left_count, count - left_count, depth + 1);
+}
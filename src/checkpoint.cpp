@@ -0,0 +1,169 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "raytrace.h"
+#include "binary_file.h"
+
+/*
+ * Checkpoints of render(). A pixel's samples are all taken by the one
+ * tile that covers it and every sample is keyed by its pixel and number
+ * (see Random::derive), so there is no sampler state to keep: the tiles
+ * finished so far, with their framebuffer sums and counts and whatever
+ * feature buffers and heatmap were recorded for them, are everything a
+ * resumed render needs to end up with the same image. Only finished tiles
+ * are written, so a checkpoint never waits on the tiles in progress.
+ *
+ * The file is written next to the checkpoint, synced and renamed over it,
+ * so a render killed at any point leaves either the old checkpoint or the
+ * new one. Like compiled scenes it's the machine's own byte order and
+ * struct layout, for resuming with the same build on the same machine.
+ */
+
+#define CHECKPOINT_MAGIC "RTCHKPT"
+#define CHECKPOINT_VERSION 1
+
+namespace {
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t sizes[2];
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_size;
+    uint32_t features;
+    uint32_t heatmap;
+    uint32_t padding;
+    uint64_t scene;
+};
+
+CheckpointHeader header_for(unsigned width, unsigned height, unsigned tile_size, bool features,
+    Heatmap heatmap, uint64_t scene
+){
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    h.version = CHECKPOINT_VERSION;
+    h.byte_order = 0x01020304;
+    h.sizes[0] = sizeof(Color);
+    h.sizes[1] = sizeof(FeatureBuffers::Pixel);
+    h.width = width;
+    h.height = height;
+    h.tile_size = tile_size;
+    h.features = features;
+    h.heatmap = (uint32_t)heatmap;
+    h.scene = scene;
+    return h;
+}
+
+}
+
+void Raytracer::save_checkpoint(const std::vector<Tile> &tiles, const std::vector<uint8_t> &done)
+{
+    std::vector<uint32_t> finished;
+    std::vector<Color> sums;
+    std::vector<uint32_t> counts;
+    std::vector<FeatureBuffers::Pixel> features;
+    std::vector<float> costs;
+    for (uint32_t t = 0; t < tiles.size(); t++) {
+        if (!done[t])
+            continue;
+        finished.push_back(t);
+        const Tile &tile = tiles[t];
+        for (unsigned y = tile.y0; y < tile.y1; y++)
+            for (unsigned x = tile.x0; x < tile.x1; x++) {
+                size_t i = (size_t)y * m_width + x;
+                sums.push_back(m_framebuffer.sum(x, y));
+                counts.push_back(m_framebuffer.samples(x, y));
+                if (!m_features.empty())
+                    features.push_back(m_features.pixel(i));
+                if (!m_heatmap.empty())
+                    costs.push_back(m_heatmap[i]);
+            }
+    }
+
+    std::string temp = m_checkpoint + ".tmp";
+    {
+        BinaryWriter out(temp);
+        out.value(header_for(m_width, m_height, m_tile_size, !m_features.empty(), m_heatmap_mode,
+            fingerprint()));
+        out.array(finished);
+        out.array(sums);
+        out.array(counts);
+        out.array(features);
+        out.array(costs);
+        out.finish(temp);
+    }
+    // The data has to be on disk before the rename makes it the checkpoint
+    int fd = open(temp.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        std::string reason = strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error("can't sync " + temp + ": " + reason);
+    }
+    close(fd);
+    if (rename(temp.c_str(), m_checkpoint.c_str()) != 0)
+        throw std::runtime_error("can't replace " + m_checkpoint + ": " + strerror(errno));
+}
+
+void Raytracer::load_checkpoint(const std::vector<Tile> &tiles, std::vector<uint8_t> &done)
+{
+    struct stat st;
+    if (stat(m_checkpoint.c_str(), &st) != 0 && errno == ENOENT)
+        return;
+
+    MappedFile file(m_checkpoint);
+    BinaryReader in(file, "checkpoint " + m_checkpoint);
+    CheckpointHeader header;
+    in.value(header);
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+        throw std::runtime_error(m_checkpoint + " isn't a checkpoint");
+    CheckpointHeader expected = header_for(m_width, m_height, m_tile_size, !m_features.empty(),
+        m_heatmap_mode, fingerprint());
+    if (memcmp(&header, &expected, sizeof(header)) != 0)
+        throw std::runtime_error(m_checkpoint + " is a checkpoint of a different scene, "
+            "different settings or another build");
+
+    std::vector<uint32_t> finished;
+    std::vector<Color> sums;
+    std::vector<uint32_t> counts;
+    std::vector<FeatureBuffers::Pixel> features;
+    std::vector<float> costs;
+    in.array(finished);
+    in.array(sums);
+    in.array(counts);
+    in.array(features);
+    in.array(costs);
+
+    size_t pixels = 0;
+    for (uint32_t t : finished) {
+        if (t >= tiles.size() || done[t])
+            throw std::runtime_error(m_checkpoint + " is corrupt");
+        done[t] = 1;
+        pixels += (size_t)(tiles[t].x1 - tiles[t].x0) * (tiles[t].y1 - tiles[t].y0);
+    }
+    if (sums.size() != pixels || counts.size() != pixels ||
+            features.size() != (m_features.empty() ? 0 : pixels) ||
+            costs.size() != (m_heatmap.empty() ? 0 : pixels))
+        throw std::runtime_error(m_checkpoint + " is corrupt");
+
+    size_t next = 0;
+    for (uint32_t t : finished) {
+        const Tile &tile = tiles[t];
+        for (unsigned y = tile.y0; y < tile.y1; y++)
+            for (unsigned x = tile.x0; x < tile.x1; x++, next++) {
+                size_t i = (size_t)y * m_width + x;
+                m_framebuffer.add(x, y, sums[next], counts[next]);
+                m_samples_taken += counts[next];
+                if (!m_features.empty())
+                    m_features.set_pixel(i, features[next]);
+                if (!m_heatmap.empty())
+                    m_heatmap[i] = costs[next];
+            }
+    }
+}
@@ -0,0 +1,302 @@
+#include <cstring>
+#include <stdexcept>
+#include "raytrace.h"
+#include "binary_file.h"
+
+/*
+ * Compiled scene files. A fixed header, the settings as one plain struct,
+ * then every array as a 64-bit element count followed by its raw bytes,
+ * padded to 8 bytes. The header records the layout of the structs that
+ * are dumped as-is, so a file from a different build is refused rather
+ * than misread.
+ */
+
+#define COMPILED_MAGIC "RTSCENE"
+#define COMPILED_VERSION 9
+
+namespace {
+
+struct CompiledHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t sizes[8];
+    uint32_t width;
+    uint32_t height;
+};
+
+CompiledHeader header_for(unsigned width, unsigned height)
+{
+    CompiledHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+    h.version = COMPILED_VERSION;
+    h.byte_order = 0x01020304;
+    h.sizes[0] = sizeof(XYZ);
+    h.sizes[1] = sizeof(Material);
+    h.sizes[2] = sizeof(FormRef);
+    h.sizes[3] = sizeof(WallGeometry);
+    h.sizes[4] = sizeof(BVHNode);
+    h.sizes[5] = sizeof(Color);
+    h.sizes[6] = sizeof(Light);
+    h.sizes[7] = sizeof(InstanceGeometry);
+    h.width = width;
+    h.height = height;
+    return h;
+}
+
+// Everything set_*() can change except the thread count, which belongs to
+// the machine rendering rather than the scene
+struct CompiledSettings {
+    double diffuse, ambient, specular, specular_size;
+    uint32_t reflection_depth;
+    double roulette_weight, roulette_cutoff;
+    double shadow_unit_size;
+    uint32_t shadow_grid_size;
+    double shadow_cache_cell, shadow_cache_tolerance;
+    uint32_t shadow_cache_entries;
+    uint32_t pixel_sample_size;
+    SampleSequence sequence;
+    uint32_t adaptive;
+    uint32_t adaptive_min, adaptive_max;
+    double adaptive_threshold;
+    uint32_t denoise_passes;
+    double denoise_sigma;
+    Color background;
+    Tonemap tonemap;
+    double exposure;
+    int32_t png_level;
+    uint32_t tile_size;
+    uint64_t seed;
+    uint32_t light_samples;
+    XYZ camera;
+};
+
+}
+
+void Raytracer::save_compiled(const std::string &filename)
+{
+    finalize();
+
+    CompiledSettings settings = {};
+    settings.diffuse = m_diffuse;
+    settings.ambient = m_ambient;
+    settings.specular = m_specular;
+    settings.specular_size = m_specular_size;
+    settings.reflection_depth = m_reflection_depth;
+    settings.roulette_weight = m_roulette_weight;
+    settings.roulette_cutoff = m_roulette_cutoff;
+    settings.shadow_unit_size = m_shadow_unit_size;
+    settings.shadow_grid_size = m_shadow_grid_size;
+    settings.shadow_cache_cell = m_shadow_cache_cell;
+    settings.shadow_cache_tolerance = m_shadow_cache_tolerance;
+    settings.shadow_cache_entries = m_shadow_cache_entries;
+    settings.pixel_sample_size = m_pixel_sample_size;
+    settings.sequence = m_sampler.sequence();
+    settings.adaptive = m_adaptive;
+    settings.adaptive_min = m_adaptive_min;
+    settings.adaptive_max = m_adaptive_max;
+    settings.adaptive_threshold = m_adaptive_threshold;
+    settings.denoise_passes = m_denoise_passes;
+    settings.denoise_sigma = m_denoise_sigma;
+    settings.background = m_background_color;
+    settings.tonemap = m_tonemap;
+    settings.exposure = m_exposure;
+    settings.png_level = m_png_level;
+    settings.tile_size = m_tile_size;
+    settings.seed = m_seed;
+    settings.light_samples = m_light_samples;
+    settings.camera = m_camera;
+
+    BinaryWriter out(filename);
+    out.value(header_for(m_width, m_height));
+    out.value(settings);
+    out.array(m_lights);
+    out.array(m_forms);
+    out.array(m_materials);
+
+    out.array(m_spheres.x);
+    out.array(m_spheres.y);
+    out.array(m_spheres.z);
+    out.array(m_spheres.r2);
+    out.array(m_spheres.id);
+    out.array(m_sphere_bvh.nodes());
+
+    out.array(m_walls);
+
+    for (auto *a : { &m_triangles.v0x, &m_triangles.v0y, &m_triangles.v0z,
+                     &m_triangles.e1x, &m_triangles.e1y, &m_triangles.e1z,
+                     &m_triangles.e2x, &m_triangles.e2y, &m_triangles.e2z })
+        out.array(*a);
+    out.array(m_triangles.id);
+    out.array(m_triangle_bvh.nodes());
+
+    out.value((uint64_t)m_meshes.size());
+    for (auto &geometry : m_meshes) {
+        out.value(geometry.id);
+        out.array(geometry.mesh.vertices);
+        out.array(geometry.mesh.indices);
+        out.array(geometry.bvh.nodes());
+    }
+
+    out.value((uint64_t)m_prototypes.size());
+    for (auto &prototype : m_prototypes) {
+        out.array(prototype.mesh.vertices);
+        out.array(prototype.mesh.indices);
+        out.array(prototype.bvh.nodes());
+    }
+    out.array(m_instances);
+    out.array(m_instance_bvh.nodes());
+    out.finish(filename);
+}
+
+std::unique_ptr<Raytracer> Raytracer::load_compiled(const std::string &filename)
+{
+    MappedFile file(filename);
+    BinaryReader in(file, "compiled scene");
+
+    CompiledHeader header;
+    in.value(header);
+    CompiledHeader expected = header_for(header.width, header.height);
+    if (memcmp(&header, &expected, sizeof(header)) != 0)
+        throw std::runtime_error(filename + " isn't a compiled scene from this build");
+
+    CompiledSettings settings;
+    in.value(settings);
+    // Enums are read raw, anything past their last value isn't one of them
+    if ((unsigned)settings.sequence > (unsigned)SampleSequence::Sobol ||
+            (unsigned)settings.tonemap > (unsigned)Tonemap::Reinhard)
+        throw std::runtime_error(filename + " is corrupt");
+
+    std::unique_ptr<Raytracer> r(new Raytracer(header.width, header.height));
+    r->m_diffuse = settings.diffuse;
+    r->m_ambient = settings.ambient;
+    r->m_specular = settings.specular;
+    r->m_specular_size = settings.specular_size;
+    r->m_reflection_depth = settings.reflection_depth;
+    r->m_roulette_weight = settings.roulette_weight;
+    r->m_roulette_cutoff = settings.roulette_cutoff;
+    r->m_shadow_unit_size = settings.shadow_unit_size;
+    r->m_shadow_grid_size = settings.shadow_grid_size;
+    r->m_shadow_cache_cell = settings.shadow_cache_cell;
+    r->m_shadow_cache_tolerance = settings.shadow_cache_tolerance;
+    r->m_shadow_cache_entries = settings.shadow_cache_entries;
+    r->m_pixel_sample_size = settings.pixel_sample_size;
+    r->m_sampler = Sampler(settings.sequence);
+    r->m_adaptive = settings.adaptive;
+    r->m_adaptive_min = settings.adaptive_min;
+    r->m_adaptive_max = settings.adaptive_max;
+    r->m_adaptive_threshold = settings.adaptive_threshold;
+    r->m_denoise_passes = settings.denoise_passes;
+    r->m_denoise_sigma = settings.denoise_sigma;
+    r->m_background_color = settings.background;
+    r->m_tonemap = settings.tonemap;
+    r->m_exposure = settings.exposure;
+    r->m_png_level = settings.png_level;
+    r->m_tile_size = settings.tile_size;
+    r->m_seed = settings.seed;
+    r->set_light_samples(settings.light_samples);
+    r->m_camera = settings.camera;
+    in.array(r->m_lights);
+    for (auto &light : r->m_lights)
+        if ((unsigned)light.type > (unsigned)LightType::Directional)
+            throw std::runtime_error(filename + " is corrupt");
+
+    in.array(r->m_forms);
+    in.array(r->m_materials);
+    for (unsigned i = 0; i < r->m_materials.size(); i++)
+        r->m_material_index.emplace(r->m_materials[i], i);
+
+    // Traversal trusts the trees and meshes, so they're checked like the rest
+    auto load_bvh = [&](BVH &bvh, size_t primitives) {
+        std::vector<BVHNode> nodes;
+        in.array(nodes);
+        bvh.set_nodes(std::move(nodes));
+        if (!bvh.valid(primitives))
+            throw std::runtime_error(filename + " is corrupt");
+    };
+    auto check_mesh = [&](const Mesh &mesh) {
+        if (mesh.indices.size() % 3 != 0)
+            throw std::runtime_error(filename + " is corrupt");
+        for (uint32_t index : mesh.indices)
+            if (index >= mesh.vertices.size())
+                throw std::runtime_error(filename + " is corrupt");
+    };
+
+    in.array(r->m_spheres.x);
+    in.array(r->m_spheres.y);
+    in.array(r->m_spheres.z);
+    in.array(r->m_spheres.r2);
+    in.array(r->m_spheres.id);
+    for (auto *a : { &r->m_spheres.x, &r->m_spheres.y, &r->m_spheres.z, &r->m_spheres.r2 })
+        if (a->size() != r->m_spheres.size() + SIMD_PAD)
+            throw std::runtime_error(filename + " is corrupt");
+    load_bvh(r->m_sphere_bvh, r->m_spheres.size());
+
+    in.array(r->m_walls);
+
+    TriangleSoA &t = r->m_triangles;
+    for (auto *a : { &t.v0x, &t.v0y, &t.v0z, &t.e1x, &t.e1y, &t.e1z, &t.e2x, &t.e2y, &t.e2z })
+        in.array(*a);
+    in.array(t.id);
+    for (auto *a : { &t.v0x, &t.v0y, &t.v0z, &t.e1x, &t.e1y, &t.e1z, &t.e2x, &t.e2y, &t.e2z })
+        if (a->size() != t.size() + SIMD_PAD)
+            throw std::runtime_error(filename + " is corrupt");
+    load_bvh(r->m_triangle_bvh, t.size());
+
+    uint64_t meshes;
+    in.value(meshes);
+    if (meshes > r->m_forms.size())
+        throw std::runtime_error(filename + " is corrupt");
+    r->m_meshes.resize(meshes);
+    for (auto &geometry : r->m_meshes) {
+        in.value(geometry.id);
+        in.array(geometry.mesh.vertices);
+        in.array(geometry.mesh.indices);
+        check_mesh(geometry.mesh);
+        load_bvh(geometry.bvh, geometry.mesh.triangle_count());
+    }
+
+    uint64_t prototypes;
+    in.value(prototypes);
+    if (prototypes > file.size())
+        throw std::runtime_error(filename + " is corrupt");
+    r->m_prototypes.resize(prototypes);
+    for (auto &prototype : r->m_prototypes) {
+        in.array(prototype.mesh.vertices);
+        in.array(prototype.mesh.indices);
+        check_mesh(prototype.mesh);
+        load_bvh(prototype.bvh, prototype.mesh.triangle_count());
+    }
+    in.array(r->m_instances);
+    load_bvh(r->m_instance_bvh, r->m_instances.size());
+    for (auto &instance : r->m_instances)
+        if (instance.prototype >= prototypes)
+            throw std::runtime_error(filename + " is corrupt");
+
+    for (auto &form : r->m_forms) {
+        if ((unsigned)form.type > (unsigned)FormType::Instance)
+            throw std::runtime_error(filename + " is corrupt");
+        size_t count = form.type == FormType::Sphere ? r->m_spheres.size() :
+                       form.type == FormType::Wall ? r->m_walls.size() :
+                       form.type == FormType::Triangle ? t.size() :
+                       form.type == FormType::Mesh ? r->m_meshes.size() : r->m_instances.size();
+        if (form.index >= count || form.material >= r->m_materials.size())
+            throw std::runtime_error(filename + " is corrupt");
+    }
+    // Hits are shaded through their primitive's form
+    std::vector<unsigned> ids = r->m_spheres.id;
+    ids.insert(ids.end(), t.id.begin(), t.id.end());
+    for (auto &wall : r->m_walls)
+        ids.push_back(wall.id);
+    for (auto &geometry : r->m_meshes)
+        ids.push_back(geometry.id);
+    for (auto &instance : r->m_instances)
+        ids.push_back(instance.id);
+    for (unsigned id : ids)
+        if (id >= r->m_forms.size())
+            throw std::runtime_error(filename + " is corrupt");
+
+    r->m_scene_dirty = false;
+    return r;
+}
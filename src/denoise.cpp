@@ -0,0 +1,363 @@
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include <algorithm>
+#include <stdexcept>
+#include "denoise.h"
+#include "image_writer.h"
+#include "random.h"
+#include "raytrace.h"
+
+// How far apart the other features may be: squared distance between unit
+// normals (2 - 2 cos of the angle), squared albedo distance in 0-255
+// units, and depth difference relative to the depth and the spacing of
+// the taps in pixels
+#define NORMAL_SIGMA2 0.1f
+#define ALBEDO_SIGMA2 (32.f * 32.f)
+#define DEPTH_SIGMA 0.01f
+// Keeps pixels without any variance from dividing by 0; they only mix
+// with neighbours of practically the same luminance
+#define LUMINANCE_EPSILON 0.01f
+
+#define DENOISE_TILE 64
+
+void FeatureBuffers::reset(unsigned w, unsigned h)
+{
+    size_t n = (size_t)w * h;
+    m_width = w;
+    m_height = h;
+    m_albedo.assign(n, Color{ 0, 0, 0 });
+    m_normal.assign(n, XYZf{});
+    m_depth.assign(n, 0);
+    m_id.assign(n, NO_FORM);
+    m_variance.assign(n, 0);
+    m_edge.assign(n, 0);
+}
+
+void FeatureBuffers::set(unsigned x, unsigned y, const FeatureSums &sums)
+{
+    size_t i = (size_t)y * m_width + x;
+    m_albedo[i] = sums.samples ? sums.albedo / sums.samples : Color{ 0, 0, 0 };
+    double length = sums.normal.magnitude();
+    if (length > 0) {
+        XYZ n = sums.normal / length;
+        m_normal[i] = { (float)n.x, (float)n.y, (float)n.z };
+    }
+    m_depth[i] = sums.hits ? sums.depth / sums.hits : 0;
+    m_id[i] = sums.id;
+    m_variance[i] = sums.variance;
+    m_edge[i] = sums.edge;
+}
+
+FeatureBuffers::Pixel FeatureBuffers::pixel(size_t i) const
+{
+    return { m_albedo[i], m_normal[i], m_depth[i], m_id[i], m_variance[i], m_edge[i] };
+}
+
+void FeatureBuffers::set_pixel(size_t i, const Pixel &p)
+{
+    m_albedo[i] = p.albedo;
+    m_normal[i] = p.normal;
+    m_depth[i] = p.depth;
+    m_id[i] = p.id;
+    m_variance[i] = p.variance;
+    m_edge[i] = p.edge;
+}
+
+void FeatureBuffers::save(Feature feature, const std::string &filename) const
+{
+    if (empty())
+        throw std::runtime_error("no feature buffers recorded to save to " + filename);
+
+    bool raw = image_format(filename) == ImageFormat::PFM;
+    float near = std::numeric_limits<float>::max(), far = 0;
+    for (float d : m_depth)
+        if (d > 0) {
+            near = std::min(near, d);
+            far = std::max(far, d);
+        }
+    float range = far > near ? far - near : 1;
+
+    ImageWriter writer(filename, m_width, m_height, Tonemap::Clamp, 1.0);
+    std::vector<Color> row(m_width);
+    for (unsigned y = 0; y < m_height; y++) {
+        for (unsigned x = 0; x < m_width; x++) {
+            size_t i = (size_t)y * m_width + x;
+            switch (feature) {
+            case Feature::Albedo:
+                row[x] = m_albedo[i];
+                break;
+            case Feature::Normal: {
+                const XYZf &n = m_normal[i];
+                row[x] = raw ? Color{ n.x * 255, n.y * 255, n.z * 255 }
+                             : Color{ (n.x + 1) * 127.5f, (n.y + 1) * 127.5f, (n.z + 1) * 127.5f };
+                break;
+            }
+            case Feature::Depth: {
+                float d = m_depth[i];
+                float v = raw ? d * 255 : d > 0 ? 51 + 204 * (far - d) / range : 0;
+                row[x] = { v, v, v };
+                break;
+            }
+            case Feature::Id: {
+                uint32_t id = m_id[i];
+                if (raw) {
+                    float v = id == NO_FORM ? -255.f : id * 255.f;
+                    row[x] = { v, v, v };
+                } else if (id == NO_FORM) {
+                    row[x] = { 0, 0, 0 };
+                } else {
+                    uint64_t bits = Random::mix(id);
+                    row[x] = { (float)(bits & 0xff), (float)(bits >> 8 & 0xff), (float)(bits >> 16 & 0xff) };
+                }
+                break;
+            }
+            case Feature::Variance: {
+                float v = raw ? m_variance[i] * 255 : std::sqrt(m_variance[i]);
+                row[x] = { v, v, v };
+                break;
+            }
+            }
+        }
+        writer.write_rows(row.data(), 1);
+    }
+    writer.finish();
+}
+
+namespace {
+
+// One float array per channel, so the loop along a row streams through
+// each of them and vectorizes
+struct Planes {
+    std::vector<float> r, g, b;
+
+    void resize(size_t n)
+    {
+        r.resize(n);
+        g.resize(n);
+        b.resize(n);
+    }
+};
+
+float luminance(float r, float g, float b)
+{
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// Pointers to the same stretch of pixels in every plane
+struct Span {
+    const float *r, *g, *b;          // colour
+    const float *ar, *ag, *ab;       // albedo
+    const float *nx, *ny, *nz;       // normal
+    const float *depth, *variance;
+    const uint32_t *id;
+
+    Span(const Planes &in, const Planes &albedo, const Planes &normal, const std::vector<float> &depth,
+        const std::vector<float> &variance, const std::vector<uint32_t> &id, ptrdiff_t at)
+        : r(&in.r[at]), g(&in.g[at]), b(&in.b[at]),
+          ar(&albedo.r[at]), ag(&albedo.g[at]), ab(&albedo.b[at]),
+          nx(&normal.r[at]), ny(&normal.g[at]), nz(&normal.b[at]),
+          depth(&depth[at]), variance(&variance[at]), id(&id[at])
+    {
+    }
+};
+
+// Running sums for a stretch of a row
+struct Sums {
+    float *__restrict r, *__restrict g, *__restrict b, *__restrict weight, *__restrict variance;
+    const float *luminance, *spread;
+};
+
+// Adds one tap of the kernel, weighted by k, to `count` pixels of a row.
+// Straight-line over plain arrays so the compiler can vectorize it.
+void add_tap(Span c, Span t, Sums s, int count, float k, float depth_scale)
+{
+    for (int x = 0; x < count; x++) {
+        float ar = c.ar[x] - t.ar[x], ag = c.ag[x] - t.ag[x], ab = c.ab[x] - t.ab[x];
+        float nx = c.nx[x] - t.nx[x], ny = c.ny[x] - t.ny[x], nz = c.nz[x] - t.nz[x];
+        float e = std::fabs(s.luminance[x] - luminance(t.r[x], t.g[x], t.b[x])) * s.spread[x]
+                + (ar * ar + ag * ag + ab * ab) * (1 / ALBEDO_SIGMA2)
+                + (nx * nx + ny * ny + nz * nz) * (1 / NORMAL_SIGMA2)
+                + std::fabs(c.depth[x] - t.depth[x]) / (depth_scale * c.depth[x] + 1);
+        float weight = c.id[x] == t.id[x] ? k * std::exp(-e) : 0.f;
+        s.r[x] += weight * t.r[x];
+        s.g[x] += weight * t.g[x];
+        s.b[x] += weight * t.b[x];
+        s.weight[x] += weight;
+        s.variance[x] += weight * weight * t.variance[x];
+    }
+}
+
+}
+
+void denoise(
+    std::vector<Color> &image,
+    const FeatureBuffers &features,
+    unsigned passes,
+    double sigma,
+    TileScheduler &scheduler
+){
+    if (passes == 0 || sigma <= 0)
+        return;
+
+    unsigned w = features.width(), h = features.height();
+    size_t n = (size_t)w * h;
+    Planes in, out, albedo, normal;
+    std::vector<float> variance(n), next_variance(n), depth(n);
+    std::vector<uint32_t> id(n);
+    in.resize(n);
+    out.resize(n);
+    albedo.resize(n);
+    normal.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        in.r[i] = image[i].r;
+        in.g[i] = image[i].g;
+        in.b[i] = image[i].b;
+        const Color &a = features.albedo(i);
+        albedo.r[i] = a.r;
+        albedo.g[i] = a.g;
+        albedo.b[i] = a.b;
+        const XYZf &nm = features.normal(i);
+        normal.r[i] = nm.x;
+        normal.g[i] = nm.y;
+        normal.b[i] = nm.z;
+        depth[i] = features.depth(i);
+        id[i] = features.id(i);
+        // No variance leaves a pixel be, apart from neighbours of the
+        // same luminance
+        variance[i] = features.edge(i) ? 0 : features.variance(i);
+    }
+
+    static const float kernel[5] = { 1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f };
+    static const float blur[3] = { 1 / 4.f, 1 / 2.f, 1 / 4.f };
+    std::vector<Tile> tiles = make_tiles(w, h, DENOISE_TILE);
+    for (unsigned pass = 0; pass < passes; pass++) {
+        int step = 1 << pass;
+        float depth_scale = DEPTH_SIGMA * step;
+
+        // Every pass reads the last one's output whole, so passes can't
+        // overlap, but the pixels within one are independent
+        scheduler.run(tiles, [&](unsigned, const Tile &tile) {
+            unsigned tile_width = tile.x1 - tile.x0;
+            std::vector<float> sr(tile_width), sg(tile_width), sb(tile_width), sw(tile_width),
+                sv(tile_width), lum(tile_width), spread(tile_width);
+            for (unsigned y = tile.y0; y < tile.y1; y++) {
+                ptrdiff_t row = (ptrdiff_t)y * w;
+                for (unsigned a = 0; a < tile_width; a++) {
+                    ptrdiff_t i = row + tile.x0 + a;
+                    sr[a] = sg[a] = sb[a] = sw[a] = sv[a] = 0;
+                    lum[a] = luminance(in.r[i], in.g[i], in.b[i]);
+
+                    // The variance itself is noisy with few samples, so
+                    // how far luminance may stray goes by a 3x3 blur of it
+                    float v = 0, vw = 0;
+                    for (int dy = -1; dy <= 1; dy++)
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int qx = (int)(tile.x0 + a) + dx, qy = (int)y + dy;
+                            if (qx < 0 || qx >= (int)w || qy < 0 || qy >= (int)h)
+                                continue;
+                            float k = blur[dy + 1] * blur[dx + 1];
+                            v += k * variance[(size_t)qy * w + qx];
+                            vw += k;
+                        }
+                    spread[a] = 1 / (sigma * std::sqrt(v / vw) + LUMINANCE_EPSILON);
+                }
+
+                for (int ky = -2; ky <= 2; ky++) {
+                    int qy = (int)y + ky * step;
+                    if (qy < 0 || qy >= (int)h)
+                        continue;
+                    for (int kx = -2; kx <= 2; kx++) {
+                        int offset = kx * step;
+                        // The part of the tile's row whose tap lands in the image
+                        int x0 = std::max((int)tile.x0, -offset);
+                        int x1 = std::min((int)tile.x1, (int)w - offset);
+                        if (x1 <= x0)
+                            continue;
+                        unsigned a = x0 - tile.x0;
+                        Span centre(in, albedo, normal, depth, variance, id, row + x0);
+                        Span tap(in, albedo, normal, depth, variance, id, (ptrdiff_t)qy * w + x0 + offset);
+                        Sums sums = { &sr[a], &sg[a], &sb[a], &sw[a], &sv[a], &lum[a], &spread[a] };
+                        add_tap(centre, tap, sums, x1 - x0, kernel[ky + 2] * kernel[kx + 2], depth_scale);
+                    }
+                }
+
+                // The centre tap always counts, so sw is never 0. The
+                // variance of the weighted mean goes to the next pass.
+                for (unsigned a = 0; a < tile_width; a++) {
+                    ptrdiff_t i = row + tile.x0 + a;
+                    out.r[i] = sr[a] / sw[a];
+                    out.g[i] = sg[a] / sw[a];
+                    out.b[i] = sb[a] / sw[a];
+                    next_variance[i] = sv[a] / (sw[a] * sw[a]);
+                }
+            }
+        });
+        std::swap(in, out);
+        std::swap(variance, next_variance);
+    }
+
+    for (size_t i = 0; i < n; i++)
+        image[i] = { in.r[i], in.g[i], in.b[i] };
+}
+
+void Raytracer::set_denoise(unsigned passes, double sigma)
+{
+    m_denoise_passes = passes;
+    m_denoise_sigma = sigma;
+}
+
+void Raytracer::set_features(bool on)
+{
+    m_record_features = on;
+}
+
+void Raytracer::save_feature(Feature feature, const std::string &filename)
+{
+    m_features.save(feature, filename);
+}
+
+void Raytracer::record_features(unsigned x, unsigned y, unsigned count, unsigned total, double variance)
+{
+    FeatureSums sums = { { 0, 0, 0 }, { 0, 0, 0 }, 0, count, 0, NO_FORM, false, variance };
+    unsigned reflected = NO_FORM;
+    for (unsigned p = 0; p < count; p++) {
+        RayTask ray = primary_ray(x, y, p, total);
+        Hit hit = intersect(ray.from, ray.to);
+        if (hit.id == NO_FORM) {
+            sums.albedo += m_background_color;
+            sums.edge |= p > 0 && sums.id != NO_FORM;
+            continue;
+        }
+        const Material &m = material(hit.id);
+        XYZ delta = (ray.to - ray.from).normal();
+        XYZ normal = surface_normal(hit, delta).normal();
+        sums.albedo += m.color;
+        sums.normal = sums.normal + normal;
+        sums.depth += distance(ray.from, hit.point);
+        sums.hits++;
+
+        // Edges seen in a mirror are as sharp as the forms' own, and
+        // whatever is seen through glass may be too
+        unsigned seen = NO_FORM;
+        if (m.reflectance > 0 && m_reflection_depth > 0) {
+            XYZ from = hit.point + normal * EPSILON;
+            seen = intersect(from, from + delta - normal * 2 * dot(delta, normal)).id;
+        }
+        if (p == 0) {
+            sums.id = hit.id;
+            reflected = seen;
+        }
+        sums.edge |= hit.id != sums.id || seen != reflected || m.transmittance > 0;
+    }
+    m_features.set(x, y, sums);
+}
+
+void Raytracer::no_features(const char *what)
+{
+    if (m_denoise_passes > 0 || m_record_features)
+        throw std::runtime_error(std::string(what) + " can't denoise or record feature buffers, "
+            "they need the whole image");
+    m_features.clear();
+    m_denoised.clear();
+}
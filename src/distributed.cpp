@@ -0,0 +1,487 @@
+#include <poll.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include "raytrace.h"
+#include "socket.h"
+
+/*
+ * Distributed rendering. A coordinator process cuts the frame into bands
+ * of rows and hands them to worker processes over a socket; workers have
+ * loaded the same scene, render each band with all their threads and send
+ * back the band's per-pixel sample sums and counts, which go into the
+ * coordinator's framebuffer exactly as a local render's tiles would. Rays
+ * are keyed by pixel and sample (see Random::derive), so the image doesn't
+ * depend on which worker rendered what.
+ *
+ * Bands are cut as they're needed, each a share of the rows left scaled
+ * by the worker's thread count and never more than 1/DISTRIBUTED_BANDS of
+ * the frame, so they shrink towards the end of the frame where a large
+ * one would leave the others idle. Every worker keeps
+ * DISTRIBUTED_IN_FLIGHT bands queued so it never waits on the network
+ * between them. The bands of a worker that disconnects go to the others,
+ * and once there's nothing left to cut, an idle worker takes a copy of a
+ * band that has been out DISTRIBUTED_OVERDUE times longer than bands
+ * usually take, so a hung or slow machine can't hold up the frame.
+ * Whichever copy comes back first is used.
+ *
+ * To try it on one machine:
+ *   build/raytracer --coordinator unix:/tmp/rt.sock scene out.png &
+ *   build/raytracer --worker unix:/tmp/rt.sock scene &
+ *   build/raytracer --worker unix:/tmp/rt.sock scene
+ *
+ * Messages are a type and a payload size followed by the payload, in the
+ * machine's own byte order, so every process must be the same build on
+ * the same kind of machine.
+ */
+
+#define DISTRIBUTED_MAGIC "RTWORKER"
+#define DISTRIBUTED_VERSION 1
+#define DISTRIBUTED_IN_FLIGHT 2
+#define DISTRIBUTED_BANDS 16
+#define DISTRIBUTED_OVERDUE 3
+// How long a worker keeps trying to reach a coordinator that isn't up yet
+#define DISTRIBUTED_CONNECT_SECONDS 30
+
+namespace {
+
+enum MessageType : uint32_t {
+    MSG_HELLO = 1,    // worker -> coordinator, a Hello
+    MSG_TILE,         // coordinator -> worker, a TileRequest
+    MSG_PIXELS,       // worker -> coordinator, the tile's id then a PixelSum per pixel
+    MSG_DONE,         // coordinator -> worker, nothing more to render
+};
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct Hello {
+    char magic[8];
+    uint32_t version;
+    uint32_t threads;
+    uint64_t scene;
+};
+
+struct TileRequest {
+    uint32_t id;
+    Tile tile;
+};
+
+struct PixelSum {
+    float r, g, b;
+    uint32_t count;
+};
+
+void send_message(Socket &socket, uint32_t type, const void *payload, size_t size)
+{
+    MessageHeader header = { type, (uint32_t)size };
+    socket.send(&header, sizeof(header));
+    if (size > 0)
+        socket.send(payload, size);
+}
+
+uint64_t hash_double(uint64_t key, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return Random::derive(key, bits);
+}
+
+uint64_t hash_xyz(uint64_t key, const XYZ &v)
+{
+    return hash_double(hash_double(hash_double(key, v.x), v.y), v.z);
+}
+
+uint64_t hash_color(uint64_t key, const Color &c)
+{
+    return hash_double(hash_double(hash_double(key, c.r), c.g), c.b);
+}
+
+// Building a mesh's BVH reorders its triangles, so they're summed rather
+// than chained and a built mesh hashes the same as one that isn't yet
+uint64_t hash_mesh(uint64_t key, const Mesh &mesh)
+{
+    for (auto &v : mesh.vertices)
+        key = hash_xyz(key, v);
+    uint64_t triangles = 0;
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+        triangles += Random::derive(Random::derive(mesh.indices[i], mesh.indices[i + 1]),
+            mesh.indices[i + 2]);
+    return Random::derive(Random::derive(key, mesh.indices.size()), triangles);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+struct Job {
+    Tile tile;
+    unsigned holders;   // workers it's out on
+    bool done;
+    Clock::time_point sent;
+};
+
+struct WorkerConnection {
+    Socket socket;
+    std::vector<char> buffer;
+    std::vector<unsigned> jobs;
+    unsigned threads { 0 };     // 0 until its hello arrived
+    bool failed { false };
+};
+
+}
+
+// The scene and the settings that change the image, so a worker started on
+// the wrong scene file gets turned away rather than rendering a different
+// image, and a render doesn't resume from another one's checkpoint. Forms
+// are hashed in the scene's order through their refs, which finalize()
+// keeps pointing at the geometry as it reorders it.
+uint64_t Raytracer::fingerprint() const
+{
+    uint64_t key = Random::derive(m_width, m_height);
+    key = Random::derive(key, m_forms.size());
+    key = Random::derive(key, m_materials.size());
+    key = Random::derive(key, m_lights.size());
+    key = Random::derive(key, m_seed);
+    key = Random::derive(key, m_pixel_sample_size);
+    key = Random::derive(key, m_reflection_depth);
+    key = Random::derive(key, m_shadow_grid_size);
+    key = Random::derive(key, (uint64_t)m_sampler.sequence());
+    key = hash_double(key, m_roulette_weight);
+    key = hash_double(key, m_roulette_cutoff);
+    key = Random::derive(key, m_adaptive ? m_adaptive_min : 0);
+    key = hash_double(key, m_adaptive ? m_adaptive_threshold : 0);
+    key = Random::derive(key, m_light_samples);
+    key = hash_double(key, m_shadow_unit_size);
+    key = hash_double(key, m_shadow_cache_cell);
+    key = hash_double(key, m_shadow_cache_tolerance);
+    key = Random::derive(key, m_shadow_cache_entries);
+    key = hash_double(key, m_diffuse);
+    key = hash_double(key, m_ambient);
+    key = hash_double(key, m_specular);
+    key = hash_double(key, m_specular_size);
+    key = hash_color(key, m_background_color);
+    key = Random::derive(key, m_adaptive ? m_adaptive_max : 0);
+    key = hash_double(key, m_camera.x);
+    key = hash_double(key, m_camera.y);
+    key = hash_double(key, m_camera.z);
+    for (auto &light : m_lights) {
+        key = Random::derive(key, (uint64_t)light.type);
+        key = hash_xyz(key, light.position);
+        key = hash_color(key, light.color);
+        key = hash_double(key, light.intensity);
+        key = hash_double(key, light.size);
+    }
+    for (auto &m : m_materials) {
+        key = hash_color(key, m.color);
+        key = hash_double(key, m.reflectance);
+        key = hash_double(key, m.refractive_index);
+        key = hash_double(key, m.transmittance);
+    }
+    for (auto &ref : m_forms) {
+        key = Random::derive(key, (uint64_t)ref.type);
+        key = Random::derive(key, ref.material);
+        switch (ref.type) {
+        case FormType::Sphere:
+            key = hash_xyz(key, m_spheres.center(ref.index));
+            key = hash_double(key, m_spheres.r2[ref.index]);
+            break;
+        case FormType::Wall:
+            key = hash_xyz(key, m_walls[ref.index].position);
+            key = hash_xyz(key, m_walls[ref.index].normal);
+            break;
+        case FormType::Triangle:
+            key = hash_xyz(key, m_triangles.v0(ref.index));
+            key = hash_xyz(key, m_triangles.e1(ref.index));
+            key = hash_xyz(key, m_triangles.e2(ref.index));
+            break;
+        case FormType::Mesh:
+            key = hash_mesh(key, m_meshes[ref.index].mesh);
+            break;
+        case FormType::Instance: {
+            const InstanceGeometry &instance = m_instances[ref.index];
+            key = Random::derive(key, instance.prototype);
+            key = hash_xyz(key, instance.translation);
+            for (auto &axis : instance.axes)
+                key = hash_xyz(key, axis);
+            break;
+        }
+        }
+    }
+    for (auto &prototype : m_prototypes)
+        key = hash_mesh(key, prototype.mesh);
+    return key;
+}
+
+void Raytracer::render_distributed(const std::string &address)
+{
+    no_features("distributed rendering");
+    reset_stats();
+    m_samples_taken = 0;
+    m_framebuffer.reset(m_width, m_height);
+
+    Socket server = Socket::listen(address);
+    std::deque<WorkerConnection> workers;
+    std::vector<Job> jobs;
+    std::deque<unsigned> retry;
+    unsigned next_row = 0;
+    uint64_t pixels_left = (uint64_t)m_width * m_height;
+    uint64_t scene = fingerprint();
+    unsigned band_unit = m_tile_size == 0 ? 1 : m_tile_size;
+    unsigned max_rows = std::max(band_unit, m_height / DISTRIBUTED_BANDS / band_unit * band_unit);
+    // How long bands took from being sent to coming back, per pixel
+    double done_seconds = 0, done_pixels = 0;
+
+    auto fail = [&](WorkerConnection &worker) {
+        worker.failed = true;
+        worker.socket = Socket();
+        for (unsigned id : worker.jobs)
+            if (--jobs[id].holders == 0 && !jobs[id].done)
+                retry.push_back(id);
+        worker.jobs.clear();
+    };
+
+    // A band sized to this worker's share of the rows left, in whole
+    // rows of tiles
+    auto cut = [&](const WorkerConnection &worker) {
+        unsigned total_threads = 0;
+        for (auto &w : workers)
+            if (!w.failed)
+                total_threads += w.threads;
+        unsigned rows_left = m_height - next_row;
+        unsigned rows = (uint64_t)rows_left * worker.threads / (2 * std::max(1u, total_threads));
+        rows = std::min(std::max(band_unit, rows / band_unit * band_unit), max_rows);
+        rows = std::min(rows, rows_left);
+        jobs.push_back({ { 0, next_row, m_width, next_row + rows }, 0, false, Clock::now() });
+        next_row += rows;
+        return (unsigned)jobs.size() - 1;
+    };
+
+    auto overdue = [&](const Job &job) {
+        double pixels = (double)(job.tile.x1 - job.tile.x0) * (job.tile.y1 - job.tile.y0);
+        double seconds = std::chrono::duration<double>(Clock::now() - job.sent).count();
+        return !job.done && job.holders == 1 && done_pixels > 0 &&
+            seconds > DISTRIBUTED_OVERDUE * pixels * done_seconds / done_pixels;
+    };
+
+    // Retried bands first, then new ones, then a copy of an overdue band
+    auto next_job = [&](const WorkerConnection &worker, unsigned &id) {
+        while (!retry.empty()) {
+            id = retry.front();
+            retry.pop_front();
+            if (!jobs[id].done)
+                return true;
+        }
+        if (next_row < m_height) {
+            id = cut(worker);
+            return true;
+        }
+        if (!worker.jobs.empty())
+            return false;
+        for (id = 0; id < jobs.size(); id++)
+            if (overdue(jobs[id]))
+                return true;
+        return false;
+    };
+
+    auto handle = [&](WorkerConnection &worker, uint32_t type, const char *payload, size_t size) {
+        if (type == MSG_HELLO && worker.threads == 0 && size == sizeof(Hello)) {
+            Hello hello;
+            memcpy(&hello, payload, sizeof(hello));
+            if (memcmp(hello.magic, DISTRIBUTED_MAGIC, sizeof(hello.magic)) != 0 ||
+                    hello.version != DISTRIBUTED_VERSION || hello.scene != scene) {
+                fprintf(stderr, "turned away a worker with a different build or scene\n");
+                return false;
+            }
+            worker.threads = std::max(1u, hello.threads);
+            return true;
+        }
+        if (type != MSG_PIXELS || worker.threads == 0 || size < sizeof(uint32_t))
+            return false;
+
+        uint32_t id;
+        memcpy(&id, payload, sizeof(id));
+        auto held = std::find(worker.jobs.begin(), worker.jobs.end(), id);
+        if (held == worker.jobs.end())
+            return false;
+        Job &job = jobs[id];
+        unsigned tile_width = job.tile.x1 - job.tile.x0;
+        size_t pixels = (size_t)tile_width * (job.tile.y1 - job.tile.y0);
+        if (size != sizeof(uint32_t) + pixels * sizeof(PixelSum))
+            return false;
+        worker.jobs.erase(held);
+        job.holders--;
+        if (job.done)
+            return true;
+
+        const char *at = payload + sizeof(uint32_t);
+        for (size_t i = 0; i < pixels; i++, at += sizeof(PixelSum)) {
+            PixelSum p;
+            memcpy(&p, at, sizeof(p));
+            m_framebuffer.add(job.tile.x0 + i % tile_width, job.tile.y0 + i / tile_width,
+                { p.r, p.g, p.b }, p.count);
+            m_samples_taken += p.count;
+        }
+        job.done = true;
+        pixels_left -= pixels;
+        done_seconds += std::chrono::duration<double>(Clock::now() - job.sent).count();
+        done_pixels += pixels;
+        return true;
+    };
+
+    // Splits off every whole message the worker has sent so far
+    auto drain = [&](WorkerConnection &worker) {
+        size_t at = 0;
+        while (worker.buffer.size() - at >= sizeof(MessageHeader)) {
+            MessageHeader header;
+            memcpy(&header, worker.buffer.data() + at, sizeof(header));
+            if (worker.buffer.size() - at - sizeof(header) < header.size)
+                break;
+            if (!handle(worker, header.type, worker.buffer.data() + at + sizeof(header), header.size)) {
+                fail(worker);
+                return;
+            }
+            at += sizeof(header) + header.size;
+        }
+        worker.buffer.erase(worker.buffer.begin(), worker.buffer.begin() + at);
+    };
+
+    PhaseTimer timer(m_stats.seconds[STAT_TRACE]);
+    std::vector<pollfd> fds;
+    std::vector<char> chunk(1 << 16);
+    while (pixels_left > 0) {
+        // Keep every worker's queue topped up
+        for (auto &worker : workers) {
+            unsigned id;
+            while (!worker.failed && worker.threads > 0 &&
+                    worker.jobs.size() < DISTRIBUTED_IN_FLIGHT && next_job(worker, id)) {
+                TileRequest request = { id, jobs[id].tile };
+                try {
+                    send_message(worker.socket, MSG_TILE, &request, sizeof(request));
+                } catch (const std::runtime_error &) {
+                    fail(worker);
+                    break;
+                }
+                worker.jobs.push_back(id);
+                if (jobs[id].holders++ == 0)
+                    jobs[id].sent = Clock::now();
+            }
+        }
+        while (!workers.empty() && workers.front().failed)
+            workers.pop_front();
+
+        // Idle workers look for overdue bands every so often
+        bool idle = false;
+        fds.clear();
+        fds.push_back({ server.fd(), POLLIN, 0 });
+        for (auto &worker : workers) {
+            fds.push_back({ worker.failed ? -1 : worker.socket.fd(), POLLIN, 0 });
+            idle |= !worker.failed && worker.threads > 0 && worker.jobs.empty();
+        }
+        if (poll(fds.data(), fds.size(), idle ? 100 : -1) < 0 && errno != EINTR)
+            throw std::runtime_error("poll failed while waiting for workers");
+
+        if (fds[0].revents & POLLIN) {
+            workers.emplace_back();
+            workers.back().socket = server.accept();
+        }
+        for (size_t i = 1; i < fds.size(); i++) {
+            if (!fds[i].revents)
+                continue;
+            WorkerConnection &worker = workers[i - 1];
+            size_t n = worker.socket.receive_some(chunk.data(), chunk.size());
+            if (n == 0) {
+                fail(worker);
+                continue;
+            }
+            worker.buffer.insert(worker.buffer.end(), chunk.begin(), chunk.begin() + n);
+            drain(worker);
+        }
+    }
+
+    for (auto &worker : workers) {
+        if (worker.failed)
+            continue;
+        try {
+            send_message(worker.socket, MSG_DONE, nullptr, 0);
+        } catch (const std::runtime_error &) {
+        }
+    }
+}
+
+void Raytracer::serve_tiles(const std::string &address)
+{
+    reset_stats();
+    m_render_id = ShadowCache::new_render();
+    {
+        PhaseTimer timer(m_stats.seconds[STAT_BUILD]);
+        finalize();
+    }
+    m_samples_taken = 0;
+
+    Socket socket = Socket::connect(address, DISTRIBUTED_CONNECT_SECONDS);
+    TileScheduler scheduler(m_thread_count);
+    Hello hello;
+    memcpy(hello.magic, DISTRIBUTED_MAGIC, sizeof(hello.magic));
+    hello.version = DISTRIBUTED_VERSION;
+    hello.threads = scheduler.thread_count();
+    hello.scene = fingerprint();
+    send_message(socket, MSG_HELLO, &hello, sizeof(hello));
+
+    PhaseTimer timer(m_stats.seconds[STAT_TRACE]);
+    std::vector<char> reply;
+    for (bool first = true;; first = false) {
+        MessageHeader header;
+        if (!socket.receive(&header, sizeof(header))) {
+            // The coordinator hangs up on workers it won't take
+            if (first)
+                throw std::runtime_error("the coordinator at " + address +
+                    " hung up, is it rendering the same scene with the same build?");
+            return;
+        }
+        if (header.type == MSG_DONE)
+            return;
+        TileRequest request;
+        if (header.type != MSG_TILE || header.size != sizeof(request) ||
+                !socket.receive(&request, sizeof(request)))
+            throw std::runtime_error("bad message from the coordinator at " + address);
+        const Tile &band = request.tile;
+        if (band.x1 > m_width || band.y1 > m_height || band.x0 >= band.x1 || band.y0 >= band.y1)
+            throw std::runtime_error("the coordinator at " + address + " sent a tile off the frame");
+
+        // The band is split into the usual tiles for this machine's threads,
+        // each of which fills in its own pixels of the reply
+        unsigned band_width = band.x1 - band.x0;
+        size_t pixels = (size_t)band_width * (band.y1 - band.y0);
+        reply.resize(sizeof(uint32_t) + pixels * sizeof(PixelSum));
+        memcpy(reply.data(), &request.id, sizeof(uint32_t));
+        std::vector<Tile> tiles = make_tiles(band_width, band.y1 - band.y0, m_tile_size);
+        for (auto &tile : tiles) {
+            tile.x0 += band.x0; tile.x1 += band.x0;
+            tile.y0 += band.y0; tile.y1 += band.y0;
+        }
+        scheduler.run(tiles, [&](unsigned, const Tile &tile) {
+            std::vector<Color> sums;
+            std::vector<unsigned> counts;
+            render_tile(tile, sums, counts);
+            unsigned tile_width = tile.x1 - tile.x0;
+            for (unsigned i = 0; i < sums.size(); i++) {
+                size_t x = tile.x0 + i % tile_width - band.x0, y = tile.y0 + i / tile_width - band.y0;
+                PixelSum p = { sums[i].r, sums[i].g, sums[i].b, counts[i] };
+                memcpy(reply.data() + sizeof(uint32_t) + (y * band_width + x) * sizeof(p), &p, sizeof(p));
+            }
+            STATS(merge_stats());
+        });
+        // A coordinator that got this band from another worker first may
+        // have finished and gone
+        try {
+            send_message(socket, MSG_PIXELS, reply.data(), reply.size());
+        } catch (const std::runtime_error &) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#include <cstddef>
+#include "framebuffer.h"
+
+Color tonemap(const Color &c, Tonemap op, double exposure)
+{
+    Color x = c * exposure;
+    x = { MAX(0.f, x.r), MAX(0.f, x.g), MAX(0.f, x.b) };
+    switch (op) {
+    case Tonemap::Reinhard:
+        return {
+            255 * x.r / (255 + x.r),
+            255 * x.g / (255 + x.g),
+            255 * x.b / (255 + x.b),
+        };
+    case Tonemap::Clamp:
+    default:
+        return {
+            MIN(255.f, x.r),
+            MIN(255.f, x.g),
+            MIN(255.f, x.b),
+        };
+    }
+}
+
+void Framebuffer::reset(unsigned w, unsigned h)
+{
+    m_width = w;
+    m_height = h;
+    m_sums.assign((size_t)w * h, Color{ 0, 0, 0 });
+    m_counts.assign((size_t)w * h, 0);
+}
+
+Color Framebuffer::pixel(unsigned x, unsigned y) const
+{
+    unsigned i = y * m_width + x;
+    if (m_counts[i] == 0)
+        return { 0, 0, 0 };
+    return m_sums[i] / m_counts[i];
+}
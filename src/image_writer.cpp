@@ -0,0 +1,377 @@
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <algorithm>
+#include <stdexcept>
+#include <zlib.h>
+#include "image_writer.h"
+
+ImageFormat image_format(const std::string &filename)
+{
+    auto ends_with = [&](const char *ext) {
+        size_t n = strlen(ext);
+        return filename.size() >= n && strcasecmp(filename.c_str() + filename.size() - n, ext) == 0;
+    };
+    if (ends_with(".ppm"))
+        return ImageFormat::PPM;
+    if (ends_with(".pfm"))
+        return ImageFormat::PFM;
+    return ImageFormat::PNG;
+}
+
+ImageWriter::ImageWriter(
+    const std::string &filename,
+    unsigned w,
+    unsigned h,
+    Tonemap op,
+    double exposure,
+    int level
+)
+    : m_filename(filename),
+      m_format(image_format(filename)),
+      m_width(w),
+      m_height(h),
+      m_tonemap(op),
+      m_exposure(exposure)
+{
+    m_file = fopen(filename.c_str(), "wb");
+    if (!m_file)
+        throw std::runtime_error("can't write " + filename);
+
+    switch (m_format) {
+    case ImageFormat::PNG:
+        m_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (m_png)
+            m_info = png_create_info_struct(m_png);
+        if (!m_info)
+            fail("can't set up libpng for");
+        if (setjmp(png_jmpbuf(m_png)))
+            fail("libpng failed writing");
+        png_init_io(m_png, m_file);
+        png_set_compression_level(m_png, level);
+        png_set_IHDR(m_png, m_info, w, h, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(m_png, m_info);
+        m_bytes.resize(3 * w);
+        break;
+    case ImageFormat::PPM:
+        fprintf(m_file, "P6\n%u %u\n255\n", w, h);
+        m_bytes.resize(3 * w);
+        break;
+    case ImageFormat::PFM:
+        // Negative scale means little-endian floats
+        fprintf(m_file, "PF\n%u %u\n-1.0\n", w, h);
+        m_header_bytes = ftell(m_file);
+        m_bytes.resize(3 * w * sizeof(float));
+        break;
+    }
+}
+
+ImageWriter::~ImageWriter()
+{
+    release();
+}
+
+void ImageWriter::release()
+{
+    if (m_png)
+        png_destroy_write_struct(&m_png, &m_info);
+    if (m_file)
+        fclose(m_file);
+    m_png = nullptr;
+    m_info = nullptr;
+    m_file = nullptr;
+}
+
+// The writer is of no use after an error, and when the constructor fails
+// the destructor won't run, so let go of everything here
+void ImageWriter::fail(const char *what)
+{
+    release();
+    throw std::runtime_error(std::string(what) + " " + m_filename);
+}
+
+void ImageWriter::write_rows(const Color *pixels, unsigned count)
+{
+    for (unsigned r = 0; r < count; r++, m_row++) {
+        if (m_row >= m_height)
+            fail("too many rows for");
+        const Color *row = pixels + (size_t)r * m_width;
+
+        if (m_format == ImageFormat::PFM) {
+            float *out = (float *)m_bytes.data();
+            for (unsigned x = 0; x < m_width; x++) {
+                Color c = row[x] * (m_exposure / 255);
+                out[3 * x] = c.r;
+                out[3 * x + 1] = c.g;
+                out[3 * x + 2] = c.b;
+            }
+            // PFM stores the bottom row first
+            long offset = m_header_bytes + (long)(m_height - 1 - m_row) * m_bytes.size();
+            if (fseek(m_file, offset, SEEK_SET) != 0 ||
+                    fwrite(m_bytes.data(), m_bytes.size(), 1, m_file) != 1)
+                fail("failed writing");
+            continue;
+        }
+
+        for (unsigned x = 0; x < m_width; x++) {
+            Color c = tonemap(row[x], m_tonemap, m_exposure);
+            m_bytes[3 * x] = (unsigned char)(c.r + 0.5f);
+            m_bytes[3 * x + 1] = (unsigned char)(c.g + 0.5f);
+            m_bytes[3 * x + 2] = (unsigned char)(c.b + 0.5f);
+        }
+        if (m_format == ImageFormat::PNG) {
+            if (setjmp(png_jmpbuf(m_png)))
+                fail("libpng failed writing");
+            png_write_row(m_png, m_bytes.data());
+        } else if (fwrite(m_bytes.data(), m_bytes.size(), 1, m_file) != 1) {
+            fail("failed writing");
+        }
+    }
+}
+
+void ImageWriter::finish()
+{
+    if (m_row != m_height)
+        fail("missing rows in");
+    if (m_format == ImageFormat::PNG) {
+        if (setjmp(png_jmpbuf(m_png)))
+            fail("libpng failed writing");
+        png_write_end(m_png, nullptr);
+    }
+    if (fflush(m_file) != 0)
+        fail("failed writing");
+}
+
+/*
+ * Whole-image output. Rows are converted in bands in parallel, and PNGs
+ * are encoded the way pigz parallelises gzip: every band is filtered and
+ * deflated on its own into a raw deflate stream that ends on a byte
+ * boundary (Z_SYNC_FLUSH), primed with the last 32K of the band before it
+ * so matches can still reach back across the seam. The streams simply
+ * concatenate into one, which goes into the file as one IDAT chunk per
+ * band between the zlib header and the Adler-32 of the whole.
+ */
+
+// Rough size of a band of rows, big enough that splitting the deflate
+// stream costs next to nothing in size
+#define IMAGE_BAND_BYTES (256 * 1024)
+#define DEFLATE_WINDOW 32768
+
+namespace {
+
+void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Appends a PNG chunk, crc covers the type and data
+void put_chunk(std::vector<unsigned char> &out, const char *type, const unsigned char *data, size_t size)
+{
+    size_t at = out.size();
+    out.resize(at + 12 + size);
+    put32(&out[at], size);
+    memcpy(&out[at + 4], type, 4);
+    if (size)
+        memcpy(&out[at + 8], data, size);
+    put32(&out[at + 8 + size], crc32(crc32(0, nullptr, 0), &out[at + 4], 4 + size));
+}
+
+unsigned char paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// Filters a row of RGB bytes into out, the filter type byte first, with
+// whichever of PNG's five filters leaves the smallest sum of absolute
+// values, the heuristic libpng uses. prev is the row above, or zeros.
+void filter_row(const unsigned char *row, const unsigned char *prev, size_t n, unsigned char *out,
+    std::vector<unsigned char> &scratch
+){
+    scratch.resize(5 * n);
+    unsigned char *f[5];
+    for (unsigned k = 0; k < 5; k++)
+        f[k] = &scratch[k * n];
+    for (size_t i = 0; i < n; i++) {
+        int a = i >= 3 ? row[i - 3] : 0, b = prev[i], c = i >= 3 ? prev[i - 3] : 0;
+        f[0][i] = row[i];
+        f[1][i] = row[i] - a;
+        f[2][i] = row[i] - b;
+        f[3][i] = row[i] - (a + b) / 2;
+        f[4][i] = row[i] - paeth(a, b, c);
+    }
+    unsigned best = 0;
+    uint64_t best_sum = UINT64_MAX;
+    for (unsigned k = 0; k < 5; k++) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += abs((signed char)f[k][i]);
+        if (sum < best_sum) {
+            best_sum = sum;
+            best = k;
+        }
+    }
+    out[0] = best;
+    memcpy(out + 1, f[best], n);
+}
+
+// One band's IDAT chunk: a piece of the deflate stream, the zlib header
+// in front of the first and the Adler-32 after the last
+void deflate_band(const unsigned char *filtered, size_t start, size_t size, bool last, int level,
+    uint32_t adler, std::vector<unsigned char> &chunk
+){
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK)
+        throw std::runtime_error("can't set up zlib");
+    size_t dictionary = std::min(start, (size_t)DEFLATE_WINDOW);
+    if (dictionary)
+        deflateSetDictionary(&z, filtered + start - dictionary, dictionary);
+
+    std::vector<unsigned char> data;
+    if (start == 0) {
+        // 32K window, FLEVEL as zlib would set it for the level
+        static const unsigned char headers[4][2] = {
+            { 0x78, 0x01 }, { 0x78, 0x5e }, { 0x78, 0x9c }, { 0x78, 0xda },
+        };
+        int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+        data.assign(headers[flevel], headers[flevel] + 2);
+    }
+    z.next_in = (Bytef *)(filtered + start);
+    z.avail_in = size;
+    int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+    for (;;) {
+        size_t at = data.size();
+        data.resize(at + deflateBound(&z, z.avail_in) + 16);
+        z.next_out = &data[at];
+        z.avail_out = data.size() - at;
+        int status = deflate(&z, flush);
+        data.resize(data.size() - z.avail_out);
+        if (status == Z_STREAM_END || (!last && z.avail_in == 0 && z.avail_out > 0))
+            break;
+        if (status != Z_OK && status != Z_BUF_ERROR) {
+            deflateEnd(&z);
+            throw std::runtime_error("zlib failed");
+        }
+    }
+    deflateEnd(&z);
+    if (last) {
+        data.resize(data.size() + 4);
+        put32(&data[data.size() - 4], adler);
+    }
+    chunk.clear();
+    put_chunk(chunk, "IDAT", data.data(), data.size());
+}
+
+}
+
+void write_image(
+    const std::string &filename,
+    unsigned width,
+    unsigned height,
+    const std::function<void(unsigned, Color *)> &row,
+    Tonemap op,
+    double exposure,
+    int level,
+    TileScheduler &scheduler
+){
+    ImageFormat format = image_format(filename);
+    size_t row_bytes = (size_t)width * (format == ImageFormat::PFM ? 3 * sizeof(float) : 3);
+    unsigned band_rows = std::max<size_t>(1, IMAGE_BAND_BYTES / std::max<size_t>(row_bytes, 1));
+    std::vector<Tile> bands;
+    for (unsigned y = 0; y < height; y += band_rows)
+        bands.push_back({ 0, y, width, std::min(y + band_rows, height) });
+
+    // PFM stores the bottom row first
+    std::vector<unsigned char> bytes(row_bytes * height);
+    scheduler.run(bands, [&](unsigned, const Tile &band) {
+        std::vector<Color> pixels(width);
+        for (unsigned y = band.y0; y < band.y1; y++) {
+            row(y, pixels.data());
+            if (format == ImageFormat::PFM) {
+                float *out = (float *)&bytes[(height - 1 - y) * row_bytes];
+                for (unsigned x = 0; x < width; x++) {
+                    Color c = pixels[x] * (exposure / 255);
+                    out[3 * x] = c.r;
+                    out[3 * x + 1] = c.g;
+                    out[3 * x + 2] = c.b;
+                }
+                continue;
+            }
+            unsigned char *out = &bytes[y * row_bytes];
+            for (unsigned x = 0; x < width; x++) {
+                Color c = tonemap(pixels[x], op, exposure);
+                out[3 * x] = (unsigned char)(c.r + 0.5f);
+                out[3 * x + 1] = (unsigned char)(c.g + 0.5f);
+                out[3 * x + 2] = (unsigned char)(c.b + 0.5f);
+            }
+        }
+    });
+
+    std::vector<unsigned char> head;
+    std::vector<std::vector<unsigned char>> chunks;
+    if (format == ImageFormat::PNG) {
+        // Filtering needs the row above from the band before, so every row
+        // is converted first
+        size_t filtered_row = row_bytes + 1;
+        std::vector<unsigned char> filtered(filtered_row * height);
+        std::vector<uint32_t> adlers(bands.size());
+        std::vector<unsigned char> zeros(row_bytes, 0);
+        scheduler.run(bands, [&](unsigned, const Tile &band) {
+            std::vector<unsigned char> scratch;
+            for (unsigned y = band.y0; y < band.y1; y++)
+                filter_row(&bytes[y * row_bytes], y ? &bytes[(y - 1) * row_bytes] : zeros.data(),
+                    row_bytes, &filtered[y * filtered_row], scratch);
+            adlers[band.y0 / band_rows] = adler32(adler32(0, nullptr, 0),
+                &filtered[band.y0 * filtered_row], (band.y1 - band.y0) * filtered_row);
+        });
+        uint32_t adler = adlers[0];
+        for (size_t b = 1; b < bands.size(); b++)
+            adler = adler32_combine(adler, adlers[b],
+                (bands[b].y1 - bands[b].y0) * filtered_row);
+
+        chunks.resize(bands.size());
+        scheduler.run(bands, [&](unsigned, const Tile &band) {
+            size_t b = band.y0 / band_rows;
+            deflate_band(filtered.data(), band.y0 * filtered_row, (band.y1 - band.y0) * filtered_row,
+                b + 1 == bands.size(), level, adler, chunks[b]);
+        });
+
+        static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+        unsigned char ihdr[13];
+        put32(ihdr, width);
+        put32(ihdr + 4, height);
+        ihdr[8] = 8;    // bits per channel
+        ihdr[9] = 2;    // RGB
+        ihdr[10] = 0;   // deflate
+        ihdr[11] = 0;   // adaptive filtering
+        ihdr[12] = 0;   // not interlaced
+        head.assign(signature, signature + 8);
+        put_chunk(head, "IHDR", ihdr, sizeof(ihdr));
+        chunks.emplace_back();
+        put_chunk(chunks.back(), "IEND", nullptr, 0);
+    } else {
+        char header[64];
+        int n = format == ImageFormat::PPM ?
+            snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height) :
+            snprintf(header, sizeof(header), "PF\n%u %u\n-1.0\n", width, height);
+        head.assign(header, header + n);
+        chunks.push_back(std::move(bytes));
+    }
+
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("can't write " + filename);
+    bool ok = fwrite(head.data(), head.size(), 1, file) == 1;
+    for (auto &chunk : chunks)
+        ok = ok && (chunk.empty() || fwrite(chunk.data(), chunk.size(), 1, file) == 1);
+    if (fclose(file) != 0 || !ok)
+        throw std::runtime_error("failed writing " + filename);
+}
@@ -0,0 +1,50 @@
+#include "light.h"
+
+void LightSampler::build(const std::vector<Light> &lights)
+{
+    size_t n = lights.size();
+    m_probability.assign(n, 1);
+    m_pdf.assign(n, 1.0 / n);
+    m_alias.resize(n);
+    for (size_t i = 0; i < n; i++)
+        m_alias[i] = i;
+
+    double total = 0;
+    for (auto &light : lights)
+        total += MAX(0.0, light.power());
+    // Lights that are all dark get picked evenly
+    if (total <= 0)
+        return;
+
+    // Scaled so the average bucket holds exactly 1
+    std::vector<double> scaled(n);
+    std::vector<unsigned> small, large;
+    for (size_t i = 0; i < n; i++) {
+        m_pdf[i] = MAX(0.0, lights[i].power()) / total;
+        scaled[i] = MAX(0.0, lights[i].power()) * n / total;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        unsigned s = small.back(), l = large.back();
+        small.pop_back();
+        m_probability[s] = scaled[s];
+        m_alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left over is 1 up to rounding
+    for (unsigned i : small)
+        m_probability[i] = 1;
+    for (unsigned i : large)
+        m_probability[i] = 1;
+}
+
+unsigned LightSampler::sample(double u) const
+{
+    double scaled = u * m_alias.size();
+    size_t bucket = MIN((size_t)scaled, m_alias.size() - 1);
+    return scaled - bucket < m_probability[bucket] ? bucket : m_alias[bucket];
+}
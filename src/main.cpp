@@ -1,94 +1,123 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
 #include "raytrace.h"
+#include "scenefile.h"
 
-int main(int, char **)
+static bool is_compiled(const std::string &path)
 {
-    Raytracer raytracer(480, 480);
-
-    raytracer.add_form(Wall {
-        { 240, 240, 240 },
-        0.6,
-        1,
-        0,
-        { 0, 480, 0 },
-        { 0, 479, 0 },
-    });
-
-    raytracer.add_form(Wall {
-        { 240, 240, 240 },
-        0.8,
-        1,
-        0,
-        { 0, 0, 850 },
-        { 0, 0, 849 },
-    });
-
-    raytracer.add_form(Wall {
-        { 240, 240, 240 },
-        0.6,
-        1.5,
-        0,
-        { 0, -100, 0 },
-        { 0, -99, 0 },
-    });
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".rtc") == 0;
+}
 
-    raytracer.add_form(Wall {
-        { 80, 250, 70 },
-        0.6,
-        1.6,
-        0,
-        { 580, 0, 0 },
-        { 579, 0, 0 },
-    });
+int main(int argc, char **argv)
+{
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+        printf("usage: %s [--resume] [scene] [output.png|.ppm|.pfm]\n"
+               "       %s -c scene compiled.rtc\n"
+               "       %s --coordinator address [scene] [output]\n"
+               "       %s --worker address [scene]\n"
+               "Scenes are text descriptions (see include/scenefile.h) or compiled\n"
+               ".rtc files, the default is scenes/demo.scene. A coordinator has\n"
+               "workers started on the same scene render its tiles; addresses are\n"
+               "unix:<path>, <host>:<port> or <port>, which is 127.0.0.1 only. A\n"
+               "coordinator listens on every interface only given 0.0.0.0:<port>,\n"
+               "and trusts whatever connects. --resume carries on from the scene's\n"
+               "checkpoint.\n", argv[0], argv[0], argv[0], argv[0]);
+        return 0;
+    }
 
-    raytracer.add_form(Wall {
-        { 250, 70, 80 },
-        0.5,
-        1.6,
-        0,
-        { -100, 0, 0 },
-        { -99, 0, 0 },
-    });
+    try {
+        if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+            SceneInfo info;
+            load_scene(argv[2], info)->save_compiled(argv[3]);
+            return 0;
+        }
 
-    raytracer.add_form(Sphere {
-        { 250, 70, 80 },
-        0.9,
-        2,
-        0,
-        { 480 / 2 - 60, 380, 320 },
-        100,
-    });
+        // --coordinator and --worker take an address before the usual arguments
+        std::string mode, address;
+        if (argc > 2 && (strcmp(argv[1], "--coordinator") == 0 || strcmp(argv[1], "--worker") == 0)) {
+            mode = argv[1];
+            address = argv[2];
+            argv += 2;
+            argc -= 2;
+        }
 
-    raytracer.add_form(Sphere {
-        { 245, 245, 245 },
-        1,
-        1,
-        1,
-        { 480 / 2 + 10, 480 - 50, 160 },
-        50,
-    });
+        bool resume = false;
+        if (mode.empty() && argc > 1 && strcmp(argv[1], "--resume") == 0) {
+            resume = true;
+            argv++;
+            argc--;
+        }
 
-    /*
-    raytracer.add_form(Triangle {
-        { 255, 80, 80 },
-        0,
-        1.5,
-        0,
-        { 340, 340, 400 },
-        { 340+100, 340, 400 },
-        { 340, 340+100, 400 }
-    });
-    */
+        std::string scene = argc > 1 ? argv[1] : "scenes/demo.scene";
+        SceneInfo info;
+        std::unique_ptr<Raytracer> raytracer;
+        if (is_compiled(scene)) {
+            raytracer = Raytracer::load_compiled(scene);
+        } else {
+            raytracer = load_scene(scene, info);
+            for (auto &mesh : info.meshes)
+                printf("%s: loaded in %.3fs, %.1f MB buffers, %.1f MB peak RSS\n",
+                    mesh.first.c_str(), mesh.second.seconds,
+                    mesh.second.mesh_bytes / 1e6, mesh.second.peak_rss_kb / 1e3);
+        }
+        if (argc > 2)
+            info.output = argv[2];
 
-    raytracer.set_pixel_sample_size(20);
-    raytracer.set_reflection_depth(5);
-    raytracer.set_shadow_unit_size(24);
-    raytracer.set_shadow_grid_size(2);
+        if (mode == "--worker") {
+            raytracer->serve_tiles(address);
+            return 0;
+        }
+        if (mode == "--coordinator") {
+            printf("waiting for workers on %s\n", address.c_str());
+            fflush(stdout);
+            raytracer->render_distributed(address);
+            raytracer->save(info.output);
+            return 0;
+        }
 
-    raytracer.set_light({480 - 70, 70, -400});
-    raytracer.set_background({213, 210, 210});
+        // Only a single render() of the whole frame checkpoints
+        if (!info.checkpoint.empty() && (info.animated || info.stream))
+            throw std::runtime_error("checkpoints don't work with animations or streaming");
+        if (resume && info.checkpoint.empty())
+            throw std::runtime_error("--resume needs a scene with a checkpoint line");
+        if (!info.checkpoint.empty())
+            raytracer->set_checkpoint(info.checkpoint, info.checkpoint_seconds, resume);
+        raytracer->set_heatmap(info.heatmap);
+        if (!info.features.empty())
+            raytracer->set_features(true);
+        if (info.animated) {
+            raytracer->render_animation(info.animation, info.first_frame, info.last_frame,
+                info.output, info.stream);
+        } else if (info.stream) {
+            raytracer->render_to(info.output);
+        } else {
+            // Encoding is timed on its own, it can take a while for big PNGs
+            auto start = std::chrono::steady_clock::now();
+            raytracer->render();
+            auto rendered = std::chrono::steady_clock::now();
+            raytracer->save(info.output);
+            auto saved = std::chrono::steady_clock::now();
+            printf("rendered in %.3fs", std::chrono::duration<double>(rendered - start).count());
+            if (raytracer->adaptive_sampling())
+                printf(" at %.2f samples per pixel", raytracer->average_samples_per_pixel());
+            printf(", saved in %.3fs\n", std::chrono::duration<double>(saved - rendered).count());
+        }
 
-    raytracer.render();
-    raytracer.save("out.png");
+#ifdef RT_STATS
+        raytracer->stats().print(stdout);
+#endif
+        if (!info.stats.empty())
+            raytracer->stats().write_json(info.stats);
+        if (info.heatmap != Heatmap::Off)
+            raytracer->save_heatmap(info.heatmap_output);
+        for (auto &feature : info.features)
+            raytracer->save_feature(feature.first, feature.second);
+    } catch (const std::runtime_error &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
 
     return 0;
 }
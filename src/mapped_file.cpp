@@ -0,0 +1,30 @@
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapped_file.h"
+
+MappedFile::MappedFile(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("can't open " + path);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("can't map empty or unreadable " + path);
+    }
+    m_size = st.st_size;
+    void *p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        throw std::runtime_error("can't map " + path);
+    madvise(p, m_size, MADV_WILLNEED);
+    m_data = (const char *)p;
+}
+
+MappedFile::~MappedFile()
+{
+    munmap((void *)m_data, m_size);
+}
@@ -0,0 +1,553 @@
+#include <cmath>
+#include <cctype>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <charconv>
+#include <stdexcept>
+#include <functional>
+#include <sys/resource.h>
+#include "mesh.h"
+#include "mapped_file.h"
+#include "bvh.h"
+
+size_t Mesh::memory() const
+{
+    return vertices.capacity() * sizeof(XYZ) + indices.capacity() * sizeof(uint32_t);
+}
+
+void Mesh::fit(const XYZ &center, double size)
+{
+    if (vertices.empty())
+        return;
+    AABB box = AABB::empty();
+    for (auto &v : vertices)
+        box.extend(v);
+    XYZ extent = box.max - box.min;
+    double longest = std::max(extent.x, std::max(extent.y, extent.z));
+    double scale = longest > 0 ? size / longest : 1;
+    XYZ mid = box.center();
+    for (auto &v : vertices)
+        v = center + (v - mid) * scale;
+}
+
+void Mesh::permute(const std::vector<unsigned> &order)
+{
+    std::vector<uint32_t> sorted(indices.size());
+    for (size_t i = 0; i < order.size(); i++)
+        for (unsigned c = 0; c < 3; c++)
+            sorted[3 * i + c] = indices[3 * order[i] + c];
+    indices.swap(sorted);
+}
+
+// Same operations as the scalar TriangleSoA kernel, with the edges worked
+// out from the shared vertices instead of being stored per triangle
+bool Mesh::intersect(
+    unsigned first, unsigned count,
+    const XYZ &from, const XYZ &delta, double &closest_t, unsigned &index
+) const {
+    bool found = false;
+    for (unsigned i = first; i < first + count; i++) {
+        const XYZ &v0 = vertices[indices[3 * i]];
+        XYZ e1 = vertices[indices[3 * i + 1]] - v0;
+        XYZ e2 = vertices[indices[3 * i + 2]] - v0;
+        XYZ h = cross(delta, e2);
+        double a = dot(h, e1);
+        if (fabs(a) < EPSILON)
+            continue;
+        double f = 1 / a;
+        XYZ s = from - v0;
+        double u = f * dot(s, h);
+        if (u < 0 || u > 1)
+            continue;
+        XYZ q = cross(s, e1);
+        double v = f * dot(delta, q);
+        if (v < 0 || u + v > 1)
+            continue;
+        double t = f * dot(e2, q);
+        if (t > EPSILON && t < closest_t) {
+            closest_t = t;
+            index = i;
+            found = true;
+        }
+    }
+    return found;
+}
+
+namespace {
+
+// Runs work(0) .. work(n - 1), one thread each
+void run_parallel(unsigned n, const std::function<void(unsigned)> &work)
+{
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < n; i++)
+        threads.emplace_back(work, i);
+    work(0);
+    for (auto &t : threads)
+        t.join();
+}
+
+unsigned resolve_threads(unsigned threads, size_t bytes)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    // Not worth a thread below a megabyte or so
+    size_t most = bytes / (1 << 20) + 1;
+    return (unsigned)std::min<size_t>(threads, most);
+}
+
+/*
+ * OBJ. The text is cut into one chunk per thread on line boundaries and
+ * each chunk is parsed on its own. Face indices are 1-based and absolute,
+ * or negative and relative to the vertices seen so far; the latter are
+ * kept chunk-relative until the chunks' vertex counts are known.
+ */
+
+struct ObjChunk {
+    std::vector<XYZ> vertices;
+    // Corner refs, value << 1 for absolute indices and value << 1 | 1 for
+    // ones relative to the first vertex of the chunk
+    std::vector<int64_t> corners;
+    bool bad { false };
+};
+
+const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+const char *next_line(const char *p, const char *end)
+{
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    return nl ? nl + 1 : end;
+}
+
+void parse_obj_chunk(const char *p, const char *end, ObjChunk &chunk)
+{
+    std::vector<int64_t> polygon;
+    while (p < end) {
+        const char *line_end = next_line(p, end);
+        p = skip_space(p, line_end);
+        if (line_end - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            double c[3];
+            p += 2;
+            for (unsigned i = 0; i < 3; i++) {
+                p = skip_space(p, line_end);
+                auto r = std::from_chars(p, line_end, c[i]);
+                if (r.ec != std::errc())
+                    chunk.bad = true;
+                p = r.ptr;
+            }
+            chunk.vertices.push_back({ c[0], c[1], c[2] });
+        } else if (line_end - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            polygon.clear();
+            p += 2;
+            for (;;) {
+                p = skip_space(p, line_end);
+                if (p >= line_end || *p == '\n' || *p == '\r' || *p == '#')
+                    break;
+                int64_t ref;
+                auto r = std::from_chars(p, line_end, ref);
+                if (r.ec != std::errc() || ref == 0) {
+                    chunk.bad = true;
+                    break;
+                }
+                if (ref > 0)
+                    polygon.push_back((ref - 1) * 2);
+                else
+                    polygon.push_back(((int64_t)chunk.vertices.size() + ref) * 2 + 1);
+                // Skip texture and normal refs
+                p = r.ptr;
+                while (p < line_end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+                    p++;
+            }
+            for (size_t i = 1; i + 1 < polygon.size(); i++) {
+                chunk.corners.push_back(polygon[0]);
+                chunk.corners.push_back(polygon[i]);
+                chunk.corners.push_back(polygon[i + 1]);
+            }
+        }
+        p = line_end;
+    }
+}
+
+Mesh load_obj(const MappedFile &file, unsigned threads)
+{
+    threads = resolve_threads(threads, file.size());
+    const char *begin = file.data(), *end = file.data() + file.size();
+    std::vector<const char *> cuts(threads + 1, end);
+    cuts[0] = begin;
+    for (unsigned i = 1; i < threads; i++)
+        cuts[i] = std::max(cuts[i - 1], next_line(begin + file.size() * i / threads, end));
+
+    std::vector<ObjChunk> chunks(threads);
+    run_parallel(threads, [&](unsigned i) {
+        parse_obj_chunk(cuts[i], cuts[i + 1], chunks[i]);
+    });
+
+    std::vector<size_t> vertex_base(threads), corner_base(threads);
+    size_t vertex_count = 0, corner_count = 0;
+    for (unsigned i = 0; i < threads; i++) {
+        if (chunks[i].bad)
+            throw std::runtime_error("malformed OBJ vertex or face");
+        vertex_base[i] = vertex_count;
+        corner_base[i] = corner_count;
+        vertex_count += chunks[i].vertices.size();
+        corner_count += chunks[i].corners.size();
+    }
+    if (vertex_count > UINT32_MAX)
+        throw std::runtime_error("OBJ has too many vertices");
+
+    Mesh mesh;
+    mesh.vertices.resize(vertex_count);
+    mesh.indices.resize(corner_count);
+    std::vector<char> out_of_range(threads, 0);
+    run_parallel(threads, [&](unsigned i) {
+        const ObjChunk &chunk = chunks[i];
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(),
+                  mesh.vertices.begin() + vertex_base[i]);
+        uint32_t *out = mesh.indices.data() + corner_base[i];
+        for (int64_t ref : chunk.corners) {
+            int64_t index = ref >> 1;
+            if (ref & 1)
+                index += vertex_base[i];
+            if (index < 0 || (size_t)index >= vertex_count)
+                out_of_range[i] = 1;
+            *out++ = (uint32_t)index;
+        }
+    });
+    for (char bad : out_of_range)
+        if (bad)
+            throw std::runtime_error("OBJ face refers to a missing vertex");
+    return mesh;
+}
+
+/*
+ * Binary PLY. Vertex records have a fixed size and are split evenly
+ * between threads. Face records are variable-length lists, but nearly
+ * always triangles, so threads first assume that and check their share;
+ * any other polygon sends the face list down a sequential pass instead.
+ */
+
+struct PlyProperty {
+    std::string name;
+    unsigned size;        // of the value, or of each list item
+    char kind;            // 'i' signed, 'u' unsigned, 'f' floating point
+    bool list;
+    unsigned count_size;  // list length type
+    char count_kind;
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+};
+
+bool ply_type(const std::string &name, unsigned &size, char &kind)
+{
+    static const struct { const char *name; unsigned size; char kind; } types[] = {
+        { "char", 1, 'i' }, { "int8", 1, 'i' }, { "uchar", 1, 'u' }, { "uint8", 1, 'u' },
+        { "short", 2, 'i' }, { "int16", 2, 'i' }, { "ushort", 2, 'u' }, { "uint16", 2, 'u' },
+        { "int", 4, 'i' }, { "int32", 4, 'i' }, { "uint", 4, 'u' }, { "uint32", 4, 'u' },
+        { "float", 4, 'f' }, { "float32", 4, 'f' }, { "double", 8, 'f' }, { "float64", 8, 'f' },
+    };
+    for (auto &t : types) {
+        if (name == t.name) {
+            size = t.size;
+            kind = t.kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+class PlyReader {
+public:
+    PlyReader(bool swap) : m_swap(swap) {}
+
+    double real(const char *p, unsigned size, char kind) const
+    {
+        unsigned char b[8];
+        memcpy(b, p, size);
+        if (m_swap)
+            std::reverse(b, b + size);
+        switch (kind) {
+        case 'f': {
+            if (size == 4) { float f; memcpy(&f, b, 4); return f; }
+            double d; memcpy(&d, b, 8); return d;
+        }
+        case 'i': return (double)integer_from(b, size, true);
+        default: return (double)integer_from(b, size, false);
+        }
+    }
+
+    int64_t integer(const char *p, unsigned size, char kind) const
+    {
+        if (kind == 'f')
+            return (int64_t)real(p, size, kind);
+        unsigned char b[8];
+        memcpy(b, p, size);
+        if (m_swap)
+            std::reverse(b, b + size);
+        return integer_from(b, size, kind == 'i');
+    }
+
+private:
+    static int64_t integer_from(const unsigned char *b, unsigned size, bool is_signed)
+    {
+        switch (size) {
+        case 1: return is_signed ? (int64_t)(int8_t)b[0] : (int64_t)b[0];
+        case 2: { uint16_t v; memcpy(&v, b, 2); return is_signed ? (int64_t)(int16_t)v : (int64_t)v; }
+        default: { uint32_t v; memcpy(&v, b, 4); return is_signed ? (int64_t)(int32_t)v : (int64_t)v; }
+        }
+    }
+
+    bool m_swap;
+};
+
+// Size in bytes of the record at p
+size_t ply_record_size(const PlyElement &e, const PlyReader &reader, const char *p, const char *end)
+{
+    size_t size = 0;
+    for (auto &prop : e.properties) {
+        if (!prop.list) {
+            size += prop.size;
+            continue;
+        }
+        if (p + size + prop.count_size > end)
+            throw std::runtime_error("PLY data ends early");
+        int64_t n = reader.integer(p + size, prop.count_size, prop.count_kind);
+        size += prop.count_size + n * prop.size;
+    }
+    return size;
+}
+
+bool ply_fixed_size(const PlyElement &e, size_t &size)
+{
+    size = 0;
+    for (auto &prop : e.properties) {
+        if (prop.list)
+            return false;
+        size += prop.size;
+    }
+    return true;
+}
+
+Mesh load_ply(const MappedFile &file, unsigned threads)
+{
+    const char *p = file.data(), *end = file.data() + file.size();
+    std::vector<PlyElement> elements;
+    bool swap = false;
+    bool magic = false;
+
+    // Header, one keyword line at a time up to end_header
+    for (;;) {
+        if (p >= end)
+            throw std::runtime_error("PLY header never ends");
+        const char *line_end = next_line(p, end);
+        std::string line(p, line_end);
+        p = line_end;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+            line.pop_back();
+        std::vector<std::string> words;
+        size_t at = 0;
+        while (at < line.size()) {
+            size_t stop = line.find(' ', at);
+            if (stop == std::string::npos) stop = line.size();
+            if (stop > at) words.push_back(line.substr(at, stop - at));
+            at = stop + 1;
+        }
+        if (!magic) {
+            if (words.size() != 1 || words[0] != "ply")
+                throw std::runtime_error("not a PLY file");
+            magic = true;
+        } else if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+            continue;
+        } else if (words[0] == "format" && words.size() >= 2) {
+            if (words[1] == "binary_big_endian")
+                swap = true;
+            else if (words[1] != "binary_little_endian")
+                throw std::runtime_error("only binary PLY files are supported");
+        } else if (words[0] == "element" && words.size() == 3) {
+            elements.push_back({ words[1], std::stoull(words[2]), {} });
+        } else if (words[0] == "property" && !elements.empty()) {
+            PlyProperty prop = {};
+            bool ok;
+            if (words.size() == 5 && words[1] == "list") {
+                prop.list = true;
+                prop.name = words[4];
+                ok = ply_type(words[2], prop.count_size, prop.count_kind) &&
+                     ply_type(words[3], prop.size, prop.kind);
+            } else {
+                ok = words.size() == 3 && ply_type(words[1], prop.size, prop.kind);
+                prop.name = words.back();
+            }
+            if (!ok)
+                throw std::runtime_error("bad PLY property: " + line);
+            elements.back().properties.push_back(prop);
+        } else if (words[0] == "end_header") {
+            break;
+        } else {
+            throw std::runtime_error("bad PLY header line: " + line);
+        }
+    }
+
+    PlyReader reader(swap);
+    Mesh mesh;
+    for (auto &e : elements) {
+        size_t fixed;
+        if (e.name == "vertex") {
+            if (!ply_fixed_size(e, fixed))
+                throw std::runtime_error("PLY vertices with list properties");
+            unsigned offset[3];
+            const PlyProperty *prop[3] = {};
+            size_t at = 0;
+            for (auto &pr : e.properties) {
+                for (unsigned c = 0; c < 3; c++) {
+                    if (pr.name == std::string(1, "xyz"[c])) {
+                        offset[c] = at;
+                        prop[c] = &pr;
+                    }
+                }
+                at += pr.size;
+            }
+            if (!prop[0] || !prop[1] || !prop[2])
+                throw std::runtime_error("PLY vertices without x, y and z");
+            if (p + fixed * e.count > end)
+                throw std::runtime_error("PLY data ends early");
+
+            mesh.vertices.resize(e.count);
+            unsigned n = resolve_threads(threads, fixed * e.count);
+            const char *base = p;
+            run_parallel(n, [&](unsigned t) {
+                size_t first = e.count * t / n, last = e.count * (t + 1) / n;
+                for (size_t i = first; i < last; i++) {
+                    const char *r = base + i * fixed;
+                    mesh.vertices[i] = {
+                        reader.real(r + offset[0], prop[0]->size, prop[0]->kind),
+                        reader.real(r + offset[1], prop[1]->size, prop[1]->kind),
+                        reader.real(r + offset[2], prop[2]->size, prop[2]->kind),
+                    };
+                }
+            });
+            p += fixed * e.count;
+        } else if (e.name == "face") {
+            // Offset of the index list within a record, everything before
+            // it must be fixed-size
+            const PlyProperty *list = nullptr;
+            size_t before = 0, after = 0;
+            for (auto &pr : e.properties) {
+                if (pr.list && (pr.name == "vertex_indices" || pr.name == "vertex_index") && !list)
+                    list = &pr;
+                else if (pr.list)
+                    throw std::runtime_error("PLY faces with extra list properties");
+                else
+                    (list ? after : before) += pr.size;
+            }
+            if (!list)
+                throw std::runtime_error("PLY faces without vertex indices");
+
+            size_t tri_size = before + list->count_size + 3 * list->size + after;
+            bool all_triangles = p + tri_size * e.count <= end;
+            if (all_triangles) {
+                mesh.indices.resize(3 * e.count);
+                unsigned n = resolve_threads(threads, tri_size * e.count);
+                std::vector<char> ok(n, 1);
+                const char *base = p;
+                run_parallel(n, [&](unsigned t) {
+                    size_t first = e.count * t / n, last = e.count * (t + 1) / n;
+                    for (size_t i = first; i < last; i++) {
+                        const char *r = base + i * tri_size + before;
+                        if (reader.integer(r, list->count_size, list->count_kind) != 3) {
+                            ok[t] = 0;
+                            return;
+                        }
+                        r += list->count_size;
+                        for (unsigned c = 0; c < 3; c++)
+                            mesh.indices[3 * i + c] = (uint32_t)reader.integer(
+                                r + c * list->size, list->size, list->kind);
+                    }
+                });
+                for (char good : ok)
+                    all_triangles &= good != 0;
+            }
+            if (all_triangles) {
+                p += tri_size * e.count;
+            } else {
+                mesh.indices.clear();
+                for (size_t i = 0; i < e.count; i++) {
+                    const char *r = p + before;
+                    if (r + list->count_size > end)
+                        throw std::runtime_error("PLY data ends early");
+                    int64_t corners = reader.integer(r, list->count_size, list->count_kind);
+                    r += list->count_size;
+                    if (corners < 0 || r + corners * list->size > end)
+                        throw std::runtime_error("PLY data ends early");
+                    for (int64_t c = 1; c + 1 < corners; c++) {
+                        mesh.indices.push_back((uint32_t)reader.integer(r, list->size, list->kind));
+                        mesh.indices.push_back((uint32_t)reader.integer(r + c * list->size, list->size, list->kind));
+                        mesh.indices.push_back((uint32_t)reader.integer(r + (c + 1) * list->size, list->size, list->kind));
+                    }
+                    p = r + corners * list->size + after;
+                }
+            }
+        } else if (ply_fixed_size(e, fixed)) {
+            p += fixed * e.count;
+        } else {
+            for (size_t i = 0; i < e.count; i++)
+                p += ply_record_size(e, reader, p, end);
+        }
+        if (p > end)
+            throw std::runtime_error("PLY data ends early");
+    }
+
+    for (uint32_t index : mesh.indices)
+        if (index >= mesh.vertices.size())
+            throw std::runtime_error("PLY face refers to a missing vertex");
+    return mesh;
+}
+
+bool ends_with(const std::string &s, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    if (s.size() < n)
+        return false;
+    for (size_t i = 0; i < n; i++)
+        if (tolower(s[s.size() - n + i]) != suffix[i])
+            return false;
+    return true;
+}
+
+}
+
+Mesh load_mesh(const std::string &path, unsigned threads, MeshLoadStats *stats)
+{
+    auto start = std::chrono::steady_clock::now();
+    Mesh mesh;
+    size_t file_bytes;
+    {
+        MappedFile file(path);
+        file_bytes = file.size();
+        if (ends_with(path, ".obj"))
+            mesh = load_obj(file, threads);
+        else if (ends_with(path, ".ply"))
+            mesh = load_ply(file, threads);
+        else
+            throw std::runtime_error("unknown mesh format: " + path);
+    }
+
+    if (stats) {
+        std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        stats->seconds = took.count();
+        stats->file_bytes = file_bytes;
+        stats->mesh_bytes = mesh.memory();
+        stats->peak_rss_kb = usage.ru_maxrss;
+    }
+    return mesh;
+}
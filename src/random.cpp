@@ -0,0 +1,19 @@
+#include "random.h"
+
+uint64_t Random::mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+uint64_t Random::derive(uint64_t key, uint64_t branch)
+{
+    return mix(key ^ mix(branch + 0x9e3779b97f4a7c15ULL));
+}
+
+uint32_t Random::next()
+{
+    state += 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(mix(state) >> 32);
+}
@@ -1,12 +1,12 @@
-#include <ctime>
 #include <cmath>
 #include <limits>
-#include <cstdlib>
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
 #include <algorithm>
-#include <png++/png.hpp>
 #include "raytrace.h"
-
-#define EPSILON 1e-4
+#include "image_writer.h"
 
 static inline void clamp(double &v, double min, double max)
 {
@@ -16,68 +16,319 @@ static inline void clamp(double &v, double min, double max)
         v = max;
 }
 
-std::pair<XYZ, Form *> Raytracer::intersect(const XYZ &from, const XYZ &to)
+// A refit BVH is traced more slowly the further its primitives have moved
+// from where it was built, past this much extra SAH cost it gets rebuilt
+#define REFIT_LIMIT 1.5
+
+// Keys derive()d from a hit's for the Russian roulette of its reflection
+// and its refraction, past those light_key() hands out
+#define ROULETTE_KEY (3 + 2 * MAX_LIGHT_SAMPLES)
+
+static void sphere_bounds(const SphereSoA &spheres, std::vector<AABB> &bounds)
+{
+    bounds.clear();
+    for (unsigned i = 0; i < spheres.size(); i++) {
+        double radius = sqrt(spheres.r2[i]);
+        XYZ r = { radius, radius, radius };
+        bounds.push_back({ spheres.center(i) - r, spheres.center(i) + r });
+    }
+}
+
+static void triangle_bounds(const TriangleSoA &triangles, std::vector<AABB> &bounds)
+{
+    bounds.clear();
+    for (unsigned i = 0; i < triangles.size(); i++) {
+        AABB box = AABB::empty();
+        box.extend(triangles.v0(i));
+        box.extend(triangles.v0(i) + triangles.e1(i));
+        box.extend(triangles.v0(i) + triangles.e2(i));
+        bounds.push_back(box);
+    }
+}
+
+static void mesh_bounds(const Mesh &mesh, std::vector<AABB> &bounds)
+{
+    bounds.clear();
+    for (size_t i = 0; i < mesh.triangle_count(); i++) {
+        AABB box = AABB::empty();
+        for (unsigned c = 0; c < 3; c++)
+            box.extend(mesh.vertex(i, c));
+        bounds.push_back(box);
+    }
+}
+
+// World bounds of every instance, its prototype's BVH must be built
+static void instance_bounds(
+    const std::vector<InstanceGeometry> &instances,
+    const std::vector<PrototypeGeometry> &prototypes,
+    std::vector<AABB> &bounds
+){
+    bounds.clear();
+    for (auto &instance : instances) {
+        const BVH &bvh = prototypes[instance.prototype].bvh;
+        if (bvh.empty())
+            bounds.push_back({ instance.translation, instance.translation });
+        else
+            bounds.push_back(instance.bounds(bvh.nodes()[0].bounds));
+    }
+}
+
+void Raytracer::finalize()
+{
+    m_light_sampler.build(m_lights);
+    if (!m_scene_dirty && m_moved.empty())
+        return;
+
+    // Only BVHs with something moving in them are touched, all of them
+    // once forms have been added
+    bool spheres = m_scene_dirty, triangles = m_scene_dirty, instances = m_scene_dirty;
+    std::vector<bool> meshes(m_meshes.size(), m_scene_dirty);
+    for (unsigned id : m_moved) {
+        const FormRef &ref = m_forms[id];
+        if (ref.type == FormType::Sphere)
+            spheres = true;
+        else if (ref.type == FormType::Triangle)
+            triangles = true;
+        else if (ref.type == FormType::Mesh)
+            meshes[ref.index] = true;
+        else if (ref.type == FormType::Instance)
+            instances = true;
+    }
+
+    std::vector<AABB> bounds;
+    std::vector<unsigned> order;
+
+    if (spheres) {
+        sphere_bounds(m_spheres, bounds);
+        if (m_scene_dirty || m_sphere_bvh.refit(bounds) > REFIT_LIMIT) {
+            m_sphere_bvh.build(bounds, order);
+            m_spheres.permute(order);
+            for (unsigned i = 0; i < m_spheres.size(); i++)
+                m_forms[m_spheres.id[i]].index = i;
+        }
+    }
+
+    if (triangles) {
+        triangle_bounds(m_triangles, bounds);
+        if (m_scene_dirty || m_triangle_bvh.refit(bounds) > REFIT_LIMIT) {
+            m_triangle_bvh.build(bounds, order);
+            m_triangles.permute(order);
+            for (unsigned i = 0; i < m_triangles.size(); i++)
+                m_forms[m_triangles.id[i]].index = i;
+        }
+    }
+
+    for (unsigned m = 0; m < m_meshes.size(); m++) {
+        if (!meshes[m])
+            continue;
+        MeshGeometry &geometry = m_meshes[m];
+        mesh_bounds(geometry.mesh, bounds);
+        if (m_scene_dirty || geometry.bvh.refit(bounds) > REFIT_LIMIT) {
+            geometry.bvh.build(bounds, order);
+            geometry.mesh.permute(order);
+        }
+    }
+
+    // Prototypes never move, they're built once
+    for (auto &prototype : m_prototypes) {
+        if (!prototype.bvh.empty() || prototype.mesh.triangle_count() == 0)
+            continue;
+        mesh_bounds(prototype.mesh, bounds);
+        prototype.bvh.build(bounds, order);
+        prototype.mesh.permute(order);
+    }
+
+    if (instances) {
+        instance_bounds(m_instances, m_prototypes, bounds);
+        if (m_scene_dirty || m_instance_bvh.refit(bounds) > REFIT_LIMIT) {
+            m_instance_bvh.build(bounds, order);
+            std::vector<InstanceGeometry> sorted;
+            sorted.reserve(order.size());
+            for (unsigned i : order)
+                sorted.push_back(m_instances[i]);
+            m_instances.swap(sorted);
+            for (unsigned i = 0; i < m_instances.size(); i++)
+                m_forms[m_instances[i].id].index = i;
+        }
+    }
+
+    m_moved.clear();
+    m_scene_dirty = false;
+}
+
+Hit Raytracer::intersect(const XYZ &from, const XYZ &to)
 {
     auto delta = to - from;
-    Form *nearest_form = nullptr;
+    auto inv_delta = inverse_delta(delta);
+    Hit hit = { { 0, 0, 0 }, NO_FORM, FormType::Sphere, 0 };
 
-    double a = dot(delta, delta);
     double closest_t = std::numeric_limits<double>::max();
 
-    // Intersect spheres
-    for (auto &sphere : m_spheres) {
-        double b = dot(delta * 2, from - sphere.position);
-        double c = dot(sphere.position, sphere.position) +
-            dot(from, from) + -2 * dot(sphere.position, from) -
-            std::pow(sphere.radius, 2);
-        double disc = std::pow(b, 2) - 4 * a * c;
-        if (disc > 0) {
-            double t = (-b - sqrt(disc)) / (2 * a);
+    // Intersect walls first, they are unbounded and give the BVHs an early
+    // closest_t to cull against
+    STATS(t_stats.tests[(int)FormType::Wall] += m_walls.size());
+    for (unsigned i = 0; i < m_walls.size(); i++) {
+        auto &wall = m_walls[i];
+        float denom = dot(wall.normal, delta);
+        if (fabs(denom) > EPSILON) {
+            float t = dot(wall.position - from, wall.normal) / denom;
             if (t > EPSILON && t < closest_t) {
                 closest_t = t;
-                nearest_form = &sphere;
+                hit.type = FormType::Wall;
+                hit.index = i;
+                hit.id = wall.id;
+            }
+        }
+    }
+
+    auto &kernels = simd_kernels();
+    unsigned index;
+
+    // Intersect spheres
+    m_sphere_bvh.traverse(from, inv_delta, closest_t, [&](unsigned first, unsigned count) {
+        STATS(t_stats.tests[(int)FormType::Sphere] += count);
+        if (kernels.spheres(m_spheres, first, count, from, delta, closest_t, index)) {
+            hit.type = FormType::Sphere;
+            hit.index = index;
+            hit.id = m_spheres.id[index];
+        }
+    });
+
+    // Moller-Trumbore triangle intersection
+    m_triangle_bvh.traverse(from, inv_delta, closest_t, [&](unsigned first, unsigned count) {
+        STATS(t_stats.tests[(int)FormType::Triangle] += count);
+        if (kernels.triangles(m_triangles, first, count, from, delta, closest_t, index)) {
+            hit.type = FormType::Triangle;
+            hit.index = index;
+            hit.id = m_triangles.id[index];
+        }
+    });
+
+    for (auto &geometry : m_meshes) {
+        geometry.bvh.traverse(from, inv_delta, closest_t, [&](unsigned first, unsigned count) {
+            STATS(t_stats.tests[(int)FormType::Mesh] += count);
+            if (geometry.mesh.intersect(first, count, from, delta, closest_t, index)) {
+                hit.type = FormType::Mesh;
+                hit.index = index;
+                hit.id = geometry.id;
             }
+        });
+    }
+
+    // Each instance the top-level BVH reaches takes the ray into its
+    // prototype's space, where closest_t keeps meaning the same distance
+    m_instance_bvh.traverse(from, inv_delta, closest_t, [&](unsigned first, unsigned count) {
+        for (unsigned i = first; i < first + count; i++) {
+            const InstanceGeometry &instance = m_instances[i];
+            const PrototypeGeometry &prototype = m_prototypes[instance.prototype];
+            XYZ object_from = instance.to_object(from);
+            XYZ object_delta = instance.to_object_vector(delta);
+            prototype.bvh.traverse(object_from, inverse_delta(object_delta), closest_t,
+                [&](unsigned first, unsigned count) {
+                    STATS(t_stats.tests[(int)FormType::Instance] += count);
+                    if (prototype.mesh.intersect(first, count, object_from, object_delta, closest_t, index)) {
+                        hit.type = FormType::Instance;
+                        hit.index = index;
+                        hit.id = instance.id;
+                    }
+                });
         }
+    });
+
+    if (hit.id != NO_FORM) {
+        hit.point = from + delta * closest_t;
+        STATS(t_stats.hits[(int)hit.type]++);
     }
+    return hit;
+}
+
+// Any-hit query for shadow rays: returns the id of the first form found
+// blocking from + (to - from) * t for EPSILON < t < max_t, not necessarily
+// the nearest, or NO_FORM
+unsigned Raytracer::occluded(const XYZ &from, const XYZ &to, double max_t)
+{
+    auto delta = to - from;
+    auto inv_delta = inverse_delta(delta);
+    unsigned blocker = NO_FORM;
+    STATS(t_stats.rays[STAT_SHADOW]++);
 
-    // Intersect walls
     for (auto &wall : m_walls) {
+        STATS(t_stats.tests[(int)FormType::Wall]++);
         float denom = dot(wall.normal, delta);
         if (fabs(denom) > EPSILON) {
             float t = dot(wall.position - from, wall.normal) / denom;
-            if (t > EPSILON && t < closest_t) {
-                closest_t = t;
-                nearest_form = &wall;
+            if (t > EPSILON && t < max_t) {
+                STATS(t_stats.hits[(int)FormType::Wall]++);
+                return wall.id;
             }
         }
     }
 
-    // Moller-Trumbore triangle intersection
-    for (auto &tri : m_triangles) {
-        XYZ h = cross(delta, tri.edges[1]);
-        double a = dot(h, tri.edges[0]);
-        if (fabs(a) < EPSILON)
-            continue;
-        double f = 1 / a;
-        XYZ s = from - tri.vertices[0];
-        double u = f * dot(s, h);
-        if (u < 0 || u > 1)
-            continue;
-        XYZ q = cross(s, tri.edges[0]);
-        double v = f * dot(delta, q);
-        if (v < 0 || u + v > 1)
-            continue;
-        double t = f * dot(tri.edges[1], q);
-        if (t < closest_t) {
-            closest_t = t;
-            nearest_form = &tri;
+    // Any hit inside the segment will do, so the kernels are asked for the
+    // nearest one below max_t and the walk stops on the first leaf with one
+    auto &kernels = simd_kernels();
+    unsigned index;
+
+    m_sphere_bvh.traverse_any(from, inv_delta, max_t, [&](unsigned first, unsigned count) {
+        STATS(t_stats.tests[(int)FormType::Sphere] += count);
+        double t = max_t;
+        if (!kernels.spheres(m_spheres, first, count, from, delta, t, index))
+            return false;
+        blocker = m_spheres.id[index];
+        return true;
+    });
+    if (blocker != NO_FORM) {
+        STATS(t_stats.hits[(int)FormType::Sphere]++);
+        return blocker;
+    }
+
+    m_triangle_bvh.traverse_any(from, inv_delta, max_t, [&](unsigned first, unsigned count) {
+        STATS(t_stats.tests[(int)FormType::Triangle] += count);
+        double t = max_t;
+        if (!kernels.triangles(m_triangles, first, count, from, delta, t, index))
+            return false;
+        blocker = m_triangles.id[index];
+        return true;
+    });
+    if (blocker != NO_FORM) {
+        STATS(t_stats.hits[(int)FormType::Triangle]++);
+        return blocker;
+    }
+
+    for (auto &geometry : m_meshes) {
+        if (geometry.bvh.traverse_any(from, inv_delta, max_t, [&](unsigned first, unsigned count) {
+            STATS(t_stats.tests[(int)FormType::Mesh] += count);
+            double t = max_t;
+            return geometry.mesh.intersect(first, count, from, delta, t, index);
+        })) {
+            STATS(t_stats.hits[(int)FormType::Mesh]++);
+            return geometry.id;
         }
     }
 
-    if (nearest_form == nullptr)
-        return std::make_pair(XYZ{ 0, 0, 0 }, nullptr);
-    else
-        return std::make_pair(from + delta * closest_t, nearest_form);
+    m_instance_bvh.traverse_any(from, inv_delta, max_t, [&](unsigned first, unsigned count) {
+        for (unsigned i = first; i < first + count; i++) {
+            const InstanceGeometry &instance = m_instances[i];
+            const PrototypeGeometry &prototype = m_prototypes[instance.prototype];
+            XYZ object_from = instance.to_object(from);
+            XYZ object_delta = instance.to_object_vector(delta);
+            if (prototype.bvh.traverse_any(object_from, inverse_delta(object_delta), max_t,
+                    [&](unsigned first, unsigned count) {
+                        STATS(t_stats.tests[(int)FormType::Instance] += count);
+                        double t = max_t;
+                        return prototype.mesh.intersect(first, count, object_from, object_delta, t, index);
+                    })) {
+                blocker = instance.id;
+                return true;
+            }
+        }
+        return false;
+    });
+    if (blocker != NO_FORM) {
+        STATS(t_stats.hits[(int)FormType::Instance]++);
+        return blocker;
+    }
+    return NO_FORM;
 }
 
 Color Raytracer::cast_ray(
@@ -86,60 +337,399 @@ Color Raytracer::cast_ray(
     unsigned depth = 0,
     bool is_reflect = false
 ){
-    auto hit = intersect(from, to);
-    auto &nearest_hit = hit.first;
-    auto nearest_form = hit.second;
+    return trace({ from, to, depth, is_reflect, 0 });
+}
 
-    if (nearest_form == nullptr)
-        if (is_reflect)
-            return { 0, 0, 0 };
-        else
-            return m_background_color;
+// A hit on trace()'s stack waiting for its secondary colours
+struct TraceFrame {
+    ShadePoint point;
+    uint64_t key;
+    Color reflect;
+    Color refract;
+    unsigned next;      // 0 before tracing the reflection, 1 before the
+                        // refraction, 2 once both are in
+};
+
+// One per worker, grown to the deepest ray tree traced so far
+static thread_local std::vector<TraceFrame> t_trace_stack;
+
+// Walks the ray tree depth first with an explicit stack, each ray at most
+// one frame deeper than its parent, in the same order recursion would:
+// a hit's reflection and refraction are traced, then its shadows, so the
+// shadow cache sees the same lookups either way.
+Color Raytracer::trace(const RayTask &root)
+{
+    if (t_trace_stack.size() < root.depth + 1)
+        t_trace_stack.resize(root.depth + 1);
+    TraceFrame *stack = t_trace_stack.data();
+    unsigned top = 0;
+    const RayTask *ray = &root;
+
+    for (;;) {
+        // Either trace the next ray or finish the hit on top, whose
+        // secondary rays are all in
+        Color color;
+        bool done = true;
+        if (ray) {
+            STATS(t_stats.count_depth(m_reflection_depth - ray->depth));
+            auto hit = intersect(ray->from, ray->to);
+            if (hit.id == NO_FORM) {
+                color = ray->is_reflect ? Color{ 0, 0, 0 } : m_background_color;
+            } else {
+                if (t_touched.on)
+                    t_touched.add(hit.id);
+                TraceFrame &frame = stack[top++];
+                frame.point = shade_point(hit, *ray);
+                frame.key = ray->key;
+                frame.reflect = { 0, 0, 0 };
+                frame.refract = { 0, 0, 0 };
+                frame.next = 0;
+                done = false;
+            }
+        } else {
+            TraceFrame &frame = stack[--top];
+            double shadows[MAX_LIGHT_SAMPLES];
+            shadow(frame.point, frame.key, shadows);
+            color = combine(frame.point, frame.reflect, frame.refract, shadows);
+        }
+
+        // Hand the colour to the hit that asked for it
+        if (done) {
+            if (top == 0)
+                return color;
+            TraceFrame &parent = stack[top - 1];
+            if (parent.next == 1)
+                parent.reflect = color;
+            else
+                parent.refract = color;
+        }
 
-    return nearest_form->render(this, nearest_hit, (to - from).normal(), depth);
+        TraceFrame &frame = stack[top - 1];
+        ray = nullptr;
+        if (frame.next == 0) {
+            frame.next = 1;
+            if (frame.point.reflect)
+                ray = &frame.point.reflect_ray;
+        }
+        if (!ray && frame.next == 1) {
+            frame.next = 2;
+            if (frame.point.refract)
+                ray = &frame.point.refract_ray;
+        }
+    }
 }
 
-void Raytracer::render()
+// Sample p of a pixel taking `count` samples; the sampler spreads points
+// according to the total so partial rounds still cover the pixel well
+RayTask Raytracer::primary_ray(unsigned x, unsigned y, unsigned p, unsigned count)
 {
-    for (unsigned y = 0; y < m_height; y++) {
-        for (unsigned x = 0; x < m_width; x++) {
-            int r0 = 0, g0 = 0, b0 = 0;
-            for (unsigned p = 0; p < m_pixel_sample_size; p++) {
-                Color tmp = cast_ray(
-                    m_camera,
-                    {
-                        (double)x-1 + ((double)p / m_pixel_sample_size) - 0.5,
-                        (double)y-1 + ((double)p / m_pixel_sample_size) - 0.5,
-                        0,
-                    },
-                    m_reflection_depth
-                );
-                r0 += tmp.r;
-                g0 += tmp.g;
-                b0 += tmp.b;
+    uint64_t pixel_key = Random::derive(m_seed, ((uint64_t)y << 32) | x);
+    auto offset = m_sampler.sample(pixel_key, p, count, SAMPLE_PIXEL);
+    return {
+        m_camera,
+        {
+            (double)x-1 + offset.first - 0.5,
+            (double)y-1 + offset.second - 0.5,
+            0,
+        },
+        m_reflection_depth,
+        false,
+        Random::derive(pixel_key, p),
+    };
+}
+
+void Raytracer::trace_batch(
+    const std::vector<RayTask> &rays,
+    std::vector<Color> &colors,
+    std::vector<float> *costs
+){
+    colors.resize(rays.size());
+    if (!costs) {
+        for (size_t i = 0; i < rays.size(); i++) {
+            t_touched.ray = i;
+            colors[i] = trace(rays[i]);
+        }
+        return;
+    }
+
+    // The ray counters are per thread, so the difference across a trace
+    // is exactly that ray's tree; the primary ray was counted beforehand
+    costs->resize(rays.size());
+    for (size_t i = 0; i < rays.size(); i++) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t before = t_stats.total_rays();
+        t_touched.ray = i;
+        colors[i] = trace(rays[i]);
+        if (m_heatmap_mode == Heatmap::Time)
+            (*costs)[i] = std::chrono::duration<float, std::nano>(
+                std::chrono::steady_clock::now() - start).count();
+        else
+            (*costs)[i] = t_stats.total_rays() - before + 1;
+    }
+}
+
+namespace {
+
+// Running sums for one pixel, plus Welford's mean and variance of its
+// samples' luminance for adaptive sampling
+struct PixelEstimate {
+    Color sum;
+    unsigned n;
+    double mean;
+    double m2;
+
+    void add(const Color &c)
+    {
+        sum += c;
+        double y = c.luminance();
+        double d = y - mean;
+        mean += d / ++n;
+        m2 += d * (y - mean);
+    }
+
+    double standard_error() const
+    {
+        return n > 1 ? sqrt(m2 / (n - 1) / n) : 0;
+    }
+};
+
+}
+
+// Renders every pixel of a tile, leaving the sum of its samples and their
+// count in sums and counts, row by row across the tile
+void Raytracer::render_tile(
+    const Tile &tile,
+    std::vector<Color> &sums,
+    std::vector<unsigned> &counts,
+    const std::vector<uint8_t> *only,
+    std::vector<uint64_t> *dependencies
+){
+    unsigned tile_width = tile.x1 - tile.x0;
+    unsigned pixels = tile_width * (tile.y1 - tile.y0);
+    unsigned round = m_adaptive ? m_adaptive_min : m_pixel_sample_size;
+    unsigned total = m_adaptive ? m_adaptive_max : m_pixel_sample_size;
+    if (round == 0) round = 1;
+
+    std::vector<PixelEstimate> estimates(pixels, PixelEstimate{ { 0, 0, 0 }, 0, 0, 0 });
+    std::vector<unsigned> active;
+    for (unsigned i = 0; i < pixels; i++)
+        if (!only || (*only)[i])
+            active.push_back(i);
+    if (m_shadow_cache_cell > 0)
+        t_shadow_cache.begin(m_render_id, m_shadow_cache_cell, m_shadow_cache_tolerance,
+            m_shadow_cache_entries);
+
+    // Every round traces the next batch of samples for all pixels still
+    // active, then drops those that have converged or hit the cap
+    std::vector<RayTask> rays;
+    std::vector<Color> colors;
+    std::vector<float> costs, pixel_costs;
+    std::vector<float> *want_costs = nullptr;
+    STATS(if (m_heatmap_mode != Heatmap::Off) {
+        want_costs = &costs;
+        pixel_costs.assign(pixels, 0);
+    });
+    // The pixel of each ray in the batch, to file what they touched under
+    std::vector<unsigned> ray_pixel;
+    t_touched.on = dependencies != nullptr;
+    uint64_t taken = 0;
+    while (!active.empty()) {
+        rays.clear();
+        ray_pixel.clear();
+        for (unsigned i : active) {
+            unsigned first = estimates[i].n;
+            unsigned last = std::min(first + round, total);
+            for (unsigned p = first; p < last; p++) {
+                rays.push_back(primary_ray(tile.x0 + i % tile_width, tile.y0 + i / tile_width, p, total));
+                if (dependencies)
+                    ray_pixel.push_back(i);
+            }
+        }
+        STATS(t_stats.rays[STAT_PRIMARY] += rays.size());
+        t_touched.pairs.clear();
+        trace_batch(rays, colors, want_costs);
+        taken += rays.size();
+        if (dependencies) {
+            for (auto &touched : t_touched.pairs) {
+                unsigned i = ray_pixel[touched.first];
+                size_t pixel = (size_t)(tile.y0 + i / tile_width) * m_width + tile.x0 + i % tile_width;
+                dependencies->push_back((uint64_t)touched.second << 32 | pixel);
             }
+            std::sort(dependencies->begin(), dependencies->end());
+            dependencies->erase(std::unique(dependencies->begin(), dependencies->end()),
+                dependencies->end());
+        }
 
-            m_image[y][x] = png::rgb_pixel(
-                (uint8_t)(r0 / m_pixel_sample_size),
-                (uint8_t)(g0 / m_pixel_sample_size),
-                (uint8_t)(b0 / m_pixel_sample_size)
-            );
+        size_t next = 0, kept = 0;
+        for (unsigned i : active) {
+            PixelEstimate &e = estimates[i];
+            unsigned last = std::min(e.n + round, total);
+            for (; e.n < last; next++) {
+                e.add(colors[next]);
+                if (want_costs)
+                    pixel_costs[i] += costs[next];
+            }
+            // One sample says nothing about the error, so it never converges
+            if (m_adaptive && e.n < total && (e.n < 2 || e.standard_error() > m_adaptive_threshold))
+                active[kept++] = i;
         }
+        active.resize(kept);
+    }
+    t_touched.on = false;
+    m_samples_taken += taken;
+
+    // Each pixel belongs to one tile, so the heatmap needs no locking
+    if (want_costs)
+        for (unsigned i = 0; i < pixels; i++)
+            if (!only || (*only)[i])
+                m_heatmap[(size_t)(tile.y0 + i / tile_width) * m_width + tile.x0 + i % tile_width] =
+                    pixel_costs[i];
+
+    // Each pixel belongs to one tile, so neither do the feature buffers
+    if (!m_features.empty())
+        for (unsigned i = 0; i < pixels; i++)
+            if (!only || (*only)[i])
+                record_features(tile.x0 + i % tile_width, tile.y0 + i / tile_width, estimates[i].n,
+                    total, estimates[i].standard_error() * estimates[i].standard_error());
+
+    sums.resize(pixels);
+    counts.resize(pixels);
+    for (unsigned i = 0; i < pixels; i++) {
+        sums[i] = estimates[i].sum;
+        counts[i] = estimates[i].n;
+    }
+}
+
+void Raytracer::render()
+{
+    reset_stats();
+    m_render_id = ShadowCache::new_render();
+    {
+        PhaseTimer timer(m_stats.seconds[STAT_BUILD]);
+        finalize();
     }
+    m_samples_taken = 0;
+    m_framebuffer.reset(m_width, m_height);
+    m_denoised.clear();
+    if (m_record_features || m_denoise_passes > 0)
+        m_features.reset(m_width, m_height);
+    else
+        m_features.clear();
+
+    // Tiles a checkpoint holds are done already
+    std::vector<Tile> tiles = make_tiles(m_width, m_height, m_tile_size);
+    std::vector<uint8_t> done(tiles.size(), 0);
+    bool checkpointing = !m_checkpoint.empty();
+    if (m_track_dependencies && (m_shadow_cache_cell > 0 || (checkpointing && m_resume)))
+        throw std::runtime_error("dependency tracking works with neither the shadow cache "
+            "nor resuming checkpoints");
+    // What the cache holds depends on the tiles traced before, which a
+    // resumed render doesn't trace again
+    if (checkpointing && m_shadow_cache_cell > 0)
+        throw std::runtime_error("checkpoints don't work with the shadow cache");
+    if (checkpointing && m_resume)
+        load_checkpoint(tiles, done);
+    std::vector<Tile> todo;
+    for (size_t i = 0; i < tiles.size(); i++)
+        if (!done[i])
+            todo.push_back(tiles[i]);
+    m_edited.clear();
+    m_dependencies.clear();
+    if (m_track_dependencies) {
+        m_dependencies.resize(tiles.size());
+        m_dependency_tile_size = m_tile_size;
+    }
+
+    TileScheduler scheduler(m_thread_count);
+    {
+        PhaseTimer timer(m_stats.seconds[STAT_TRACE]);
+        auto interval = std::chrono::duration<double>(m_checkpoint_seconds);
+        auto next_checkpoint = std::chrono::steady_clock::now() + interval;
+        // Workers can't throw across the scheduler, the first error is kept
+        // and the tiles left are skipped
+        std::exception_ptr error;
+        std::atomic<bool> failed { false };
+        scheduler.run(todo, [&](unsigned, const Tile &tile) {
+            if (failed)
+                return;
+            size_t index = tile_index(tile, m_tile_size);
+            std::vector<Color> sums;
+            std::vector<unsigned> counts;
+            render_tile(tile, sums, counts, nullptr,
+                m_track_dependencies ? &m_dependencies[index] : nullptr);
+            // Each pixel is written by exactly one worker, so the
+            // framebuffer needs no locking unless a checkpoint could be
+            // reading it
+            std::unique_lock<std::mutex> guard(m_checkpoint_lock, std::defer_lock);
+            if (checkpointing)
+                guard.lock();
+            unsigned tile_width = tile.x1 - tile.x0;
+            for (unsigned i = 0; i < sums.size(); i++)
+                m_framebuffer.add(tile.x0 + i % tile_width, tile.y0 + i / tile_width,
+                    sums[i], counts[i]);
+            if (checkpointing) {
+                done[index] = 1;
+                if (!failed && std::chrono::steady_clock::now() >= next_checkpoint) {
+                    try {
+                        PhaseTimer timer(t_stats.seconds[STAT_CHECKPOINT]);
+                        save_checkpoint(tiles, done);
+                    } catch (...) {
+                        error = std::current_exception();
+                        failed = true;
+                    }
+                    next_checkpoint = std::chrono::steady_clock::now() + interval;
+                }
+            }
+            STATS(merge_stats());
+        });
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    denoise_frame(scheduler);
+}
+
+size_t Raytracer::tile_index(const Tile &tile, unsigned size) const
+{
+    size = std::max(size, 1u);
+    return (size_t)(tile.y0 / size) * ((m_width + size - 1) / size) + tile.x0 / size;
+}
+
+void Raytracer::denoise_frame(TileScheduler &scheduler)
+{
+    if (m_denoise_passes == 0)
+        return;
+    PhaseTimer timer(m_stats.seconds[STAT_DENOISE]);
+    m_denoised.resize((size_t)m_width * m_height);
+    for (unsigned y = 0; y < m_height; y++)
+        for (unsigned x = 0; x < m_width; x++)
+            m_denoised[(size_t)y * m_width + x] = m_framebuffer.pixel(x, y);
+    denoise(m_denoised, m_features, m_denoise_passes, m_denoise_sigma, scheduler);
+}
+
+double Raytracer::average_samples_per_pixel() const
+{
+    return (double)m_samples_taken / ((double)m_width * m_height);
 }
 
 Raytracer::Raytracer(unsigned w, unsigned h)
     : m_width(w),
       m_height(h),
-      m_image(w, h),
+      m_thread_count(std::thread::hardware_concurrency()),
       m_camera({ (double)w/2, (double)h/2, -620 })
 {
-    srand(time(NULL));
 }
 
 void Raytracer::save(const std::string &filename)
 {
-    m_image.write(filename);
+    if (m_framebuffer.empty())
+        throw std::runtime_error("nothing rendered to save to " + filename);
+    PhaseTimer timer(m_stats.seconds[STAT_OUTPUT]);
+    TileScheduler scheduler(m_thread_count);
+    write_image(filename, m_width, m_height, [&](unsigned y, Color *row) {
+        for (unsigned x = 0; x < m_width; x++)
+            row[x] = m_denoised.empty() ? m_framebuffer.pixel(x, y) : m_denoised[(size_t)y * m_width + x];
+    }, m_tonemap, m_exposure, m_png_level, scheduler);
 }
 
 Sphere::Sphere(const Color &c, double refl, double refr, double tran, const XYZ &pos, double rad)
@@ -204,13 +794,52 @@ Triangle::Triangle(
     edges[1] = vertices[2] - vertices[0];
 }
 
-Color Raytracer::diffuse(const Color &c, const XYZ &hit, const XYZ &norm)
+MeshForm::MeshForm(const Color &c, double refl, double refr, double tran, Mesh m)
+    : mesh(std::move(m))
 {
-    double light_mag = distance(m_light, hit);
-    XYZ unit_light = (m_light - hit) / light_mag;
-    double compute_factor = dot(norm, unit_light);
-    Color diffuse_color = /*0.6 **/ c * m_diffuse * compute_factor +
-        c * m_ambient;
+    color = c;
+    reflectance = refl;
+    refractive_index = refr;
+    transmittance = tran;
+    AABB box = AABB::empty();
+    for (auto &v : mesh.vertices)
+        box.extend(v);
+    position = mesh.vertices.empty() ? XYZ{ 0, 0, 0 } : box.center();
+}
+
+Instance::Instance(
+    const Color &c,
+    double refl,
+    double refr,
+    double tran,
+    unsigned proto,
+    const Transform &t
+)
+    : prototype(proto),
+      transform(t)
+{
+    color = c;
+    reflectance = refl;
+    refractive_index = refr;
+    transmittance = tran;
+    position = t.translation;
+}
+
+// Shades a hit as lit by one light, NO_LIGHT leaves only the ambient term
+Color Raytracer::diffuse(const Color &c, const XYZ &hit, const XYZ &norm, unsigned index)
+{
+    if (index == NO_LIGHT)
+        return c * m_ambient;
+    const Light &light = m_lights[index];
+    XYZ unit_light;
+    if (light.type == LightType::Directional) {
+        unit_light = -light.position.normal();
+    } else {
+        double light_mag = distance(light.position, hit);
+        unit_light = (light.position - hit) / light_mag;
+    }
+    double compute_factor = std::max(0.0, dot(norm, unit_light));
+    Color lit = /*0.6 **/ c * m_diffuse * compute_factor;
     double sight_mag = distance(hit, m_camera);
     XYZ unit_sight = (hit - m_camera) / sight_mag;
     double combined_mag = (unit_light + unit_sight).magnitude();
@@ -218,33 +847,146 @@ Color Raytracer::diffuse(const Color &c, const XYZ &hit, const XYZ &norm)
     double specular_amount = std::pow(std::max(0.0, dot(norm, unit_bisect)),
             m_specular_size);
     Color specular_color = Color{ 255, 255, 255 } * (specular_amount * m_specular);
+    if (light.color.r != 255 || light.color.g != 255 || light.color.b != 255) {
+        Color tint = light.color / 255;
+        lit = lit * tint;
+        specular_color = specular_color * tint;
+    }
+    // Divided by the odds of picking the light, so averaging the lights
+    // pick_lights() drew estimates the sum of them all
+    double scale = light.intensity / m_light_sampler.pdf(index);
+    if (scale != 1) {
+        lit = lit * scale;
+        specular_color = specular_color * scale;
+    }
+    Color diffuse_color = lit + c * m_ambient;
     return diffuse_color * (1 - specular_amount) + specular_color;
 }
 
-double Raytracer::shadow_amount(const XYZ &hit)
+// The only light there is, or m_light_samples drawn by power with the alias
+// table, then the surface's colour under each. combine() averages them.
+void Raytracer::pick_lights(ShadePoint &point, const Color &c, uint64_t key)
+{
+    if (m_lights.size() <= 1) {
+        point.lights = 1;
+        point.light[0] = m_lights.empty() ? NO_LIGHT : 0;
+    } else {
+        point.lights = m_light_samples;
+        for (unsigned k = 0; k < point.lights; k++)
+            point.light[k] = m_light_sampler.sample((Random::derive(key, 3 + k) >> 11) * 0x1p-53);
+    }
+    for (unsigned k = 0; k < point.lights; k++)
+        point.surface[k] = diffuse(c, point.hit, point.normal, point.light[k]);
+}
+
+// The first light's shadow rays use the hit's own key, the others branch
+// off it past the keys light selection uses
+uint64_t Raytracer::light_key(uint64_t key, unsigned k)
+{
+    return k == 0 ? key : Random::derive(key, 3 + MAX_LIGHT_SAMPLES + k);
+}
+
+// Russian roulette for a secondary ray whose colour counts for at most
+// `weight` of the pixel's. Under the cutoff it isn't traced at all, under
+// the roulette weight it's traced with odds in proportion to its weight
+// and its colour scaled up by the inverse, which keeps the mean the same.
+bool Raytracer::survives(uint64_t key, double weight, double &scale)
+{
+    scale = 1;
+    if (weight < m_roulette_cutoff)
+        return false;
+    if (weight >= m_roulette_weight)
+        return true;
+    double odds = weight / m_roulette_weight;
+    if ((key >> 11) * 0x1p-53 >= odds)
+        return false;
+    scale = 1 / odds;
+    return true;
+}
+
+unsigned Raytracer::light_rays(const Light &light) const
+{
+    return light.type == LightType::Area ? m_shadow_grid_size * m_shadow_grid_size : 1;
+}
+
+// Area lights go through the grid cells row by row
+void Raytracer::light_ray(const Light &light, const XYZ &hit, unsigned i, uint64_t key, XYZ &to, double &max_t)
+{
+    switch (light.type) {
+    case LightType::Point:
+        to = light.position;
+        max_t = 1;
+        break;
+    case LightType::Area:
+        to = shadow_spot(light, i / m_shadow_grid_size, i % m_shadow_grid_size, key);
+        // Only blockers closer than the light count, in units of the
+        // hit -> grid spot segment
+        max_t = distance(hit, light.position) / distance(hit, to);
+        break;
+    case LightType::Directional:
+        to = hit - light.position.normal();
+        max_t = std::numeric_limits<double>::max();
+        break;
+    }
+}
+
+// Area light sample (sx, sy) for the ray named by key. The light is a
+// square of grid x grid cells centred on its position; how points spread
+// over it (one jittered point per cell, low-discrepancy, ...) is up to the
+// sampler, which also stops the colour banding a fixed grid would give.
+XYZ Raytracer::shadow_spot(const Light &light, unsigned sx, unsigned sy, uint64_t key)
 {
-    if (m_shadow_grid_size == 0) return 0;
+    unsigned cells = m_shadow_grid_size * m_shadow_grid_size;
+    double unit = light.size > 0 ? light.size : m_shadow_unit_size;
+    auto spot = m_sampler.sample(key, sy * m_shadow_grid_size + sx, cells, SAMPLE_LIGHT);
+    return {
+        light.position.x+(spot.first*m_shadow_grid_size-m_shadow_grid_size/2-0.5)*unit,
+        light.position.y+(spot.second*m_shadow_grid_size-m_shadow_grid_size/2-0.5)*unit,
+        light.position.z,
+    };
+}
+
+double Raytracer::shadow_amount(const XYZ &hit, unsigned index, uint64_t key)
+{
+    if (index == NO_LIGHT) return 0;
+    const Light &light = m_lights[index];
+    unsigned rays = light_rays(light);
+    if (rays == 0) return 0;
     double shadow_hits = 0;
-    for (unsigned sx = 0; sx < m_shadow_grid_size; sx++) {
-        for (unsigned sy = 0; sy < m_shadow_grid_size; sy++) {
-            // Random component for anti-color banding
-            auto antiband = rand() % (int)m_shadow_unit_size - m_shadow_unit_size/2;
-            XYZ shadow_grid_spot = {
-                m_light.x+((double)sx-m_shadow_grid_size/2)*m_shadow_unit_size + antiband,
-                m_light.y+((double)sy-m_shadow_grid_size/2)*m_shadow_unit_size + antiband,
-                m_light.z,
-            };
-            auto shadow_hit = intersect(hit, shadow_grid_spot);
-            if (shadow_hit.second != nullptr &&
-                    distance(shadow_hit.first, hit) < distance(hit, m_light))
-                shadow_hits += MAX(0.3, 1 - shadow_hit.second->transmittance);
+    for (unsigned i = 0; i < rays; i++) {
+        XYZ to;
+        double max_t;
+        light_ray(light, hit, i, key, to, max_t);
+        unsigned blocker = occluded(hit, to, max_t);
+        if (blocker != NO_FORM) {
+            shadow_hits += MAX(0.3, 1 - material(blocker).transmittance);
+            if (t_touched.on)
+                t_touched.add(blocker);
         }
     }
-    return shadow_hits / (m_shadow_grid_size * m_shadow_grid_size);
+    return shadow_hits / rays;
 }
 
-// Calculate fresnel effect
-static double fresnel_amount(const XYZ &delta, const XYZ &norm, double ior)
+void Raytracer::shadow(const ShadePoint &point, uint64_t key, double *amounts)
+{
+    for (unsigned k = 0; k < point.lights; k++) {
+        unsigned light = point.light[k];
+        uint64_t shadow_key = light_key(key, k);
+        if (m_shadow_cache_cell <= 0 || light == NO_LIGHT || light_rays(m_lights[light]) == 0) {
+            amounts[k] = shadow_amount(point.hit, light, shadow_key);
+            continue;
+        }
+        ShadowCache::Cell cell = t_shadow_cache.cell(point.hit, point.normal, point.id, light);
+        if (t_shadow_cache.lookup(cell, amounts[k])) {
+            STATS(t_stats.shadow_cache_hits++);
+            continue;
+        }
+        amounts[k] = shadow_amount(point.hit, light, shadow_key);
+        t_shadow_cache.record(cell, amounts[k]);
+    }
+}
+
+double fresnel_amount(const XYZ &delta, const XYZ &norm, double ior)
 {
     double cos_i = dot(delta, norm);
     clamp(cos_i, -1, 1);
@@ -266,24 +1008,87 @@ static double fresnel_amount(const XYZ &delta, const XYZ &norm, double ior)
     }
 }
 
-Color Sphere::render(
-    Raytracer *rt,
-    const XYZ &hit,
-    const XYZ &delta,
-    unsigned depth
-){
-    XYZ unit_norm = (hit - position) / radius;
-    Color out_color = rt->diffuse(color, hit, unit_norm);
-    double fresnel = fresnel_amount(delta, unit_norm, refractive_index);
+// Unit normal at a hit. Mesh normals face the incoming ray along delta,
+// every other form keeps the orientation its geometry gives it.
+XYZ Raytracer::surface_normal(const Hit &h, const XYZ &delta)
+{
+    XYZ unit_norm;
+    switch (h.type) {
+    case FormType::Sphere:
+        unit_norm = (h.point - m_spheres.center(h.index)) / sqrt(m_spheres.r2[h.index]);
+        break;
+    case FormType::Wall:
+        unit_norm = m_walls[h.index].normal;
+        break;
+    case FormType::Triangle:
+        unit_norm = cross(m_triangles.e1(h.index), m_triangles.e2(h.index)).normal();
+        break;
+    case FormType::Mesh: {
+        // Scanned meshes don't agree on a winding, so shade the side the
+        // ray arrived on
+        const Mesh &mesh = m_meshes[m_forms[h.id].index].mesh;
+        XYZ v0 = mesh.vertex(h.index, 0);
+        unit_norm = cross(mesh.vertex(h.index, 1) - v0, mesh.vertex(h.index, 2) - v0).normal();
+        if (dot(unit_norm, delta) > 0)
+            unit_norm = -unit_norm;
+        break;
+    }
+    case FormType::Instance: {
+        // Shaded like meshes, on the side the ray arrived on
+        const InstanceGeometry &instance = m_instances[m_forms[h.id].index];
+        const Mesh &mesh = m_prototypes[instance.prototype].mesh;
+        XYZ v0 = mesh.vertex(h.index, 0);
+        unit_norm = instance.normal_to_world(
+            cross(mesh.vertex(h.index, 1) - v0, mesh.vertex(h.index, 2) - v0)).normal();
+        if (dot(unit_norm, delta) > 0)
+            unit_norm = -unit_norm;
+        break;
+    }
+    }
+    return unit_norm;
+}
+
+// Shade a hit as far as possible without tracing further rays
+ShadePoint Raytracer::shade_point(const Hit &h, const RayTask &ray)
+{
+    const Material &m = material(h.id);
+    const XYZ &hit = h.point;
+    XYZ delta = (ray.to - ray.from).normal();
+    XYZ unit_norm = surface_normal(h, delta);
+
+    ShadePoint point;
+    point.hit = hit;
+    point.normal = unit_norm;
+    point.id = h.id;
+    pick_lights(point, m.color, ray.key);
+    point.base = m.color;
+    point.reflectance = m.reflectance;
+    point.transmittance = m.transmittance;
+    point.fresnel = fresnel_amount(delta, unit_norm, m.refractive_index);
+    point.reflect_scale = 1;
+    point.refract_scale = 1;
+    double reflect_weight = ray.weight * m.reflectance * point.fresnel;
+    point.reflect = ray.depth > 0 && m.reflectance > 0 &&
+        survives(Random::derive(ray.key, ROULETTE_KEY), reflect_weight, point.reflect_scale);
+    point.refract = false;
+
     double dot_norm = dot(delta, unit_norm);
-    if (depth > 0 && reflectance > 0) {
+    if (point.reflect) {
+        STATS(t_stats.rays[STAT_REFLECTION]++);
         XYZ eps_norm = unit_norm * EPSILON;
         XYZ delta_reflect = delta - unit_norm * 2 * dot_norm;
-        Color reflect_color = rt->cast_ray(hit + eps_norm, hit + delta_reflect, depth - 1, true);
-        out_color = out_color +
-            reflect_color * reflectance * fresnel;
+        point.reflect_ray = {
+            hit + eps_norm,
+            hit + delta_reflect,
+            ray.depth - 1,
+            true,
+            Random::derive(ray.key, 1),
+            reflect_weight * point.reflect_scale,
+        };
     }
-    if (depth > 0 && transmittance > 0 && fresnel < 1) {
+    // Only spheres refract
+    if (h.type == FormType::Sphere && ray.depth > 0 &&
+            m.transmittance > 0 && point.fresnel < 1) {
         bool outside = true;
         if (dot_norm > 0) {
             outside = false;
@@ -293,94 +1098,123 @@ Color Sphere::render(
         XYZ bias = unit_norm * 1e-8;
         double cos_i = dot(delta, unit_norm);
         clamp(cos_i, -1, 1);
-        double eta_i = 1, eta_t = refractive_index;
+        double eta_i = 1, eta_t = m.refractive_index;
         if (cos_i > 0) std::swap(eta_i, eta_t);
         double eta = eta_i / eta_t;
         double r_amount = MAX(0, 1 - eta * eta * (1 - cos_i * cos_i));
-        if (r_amount > 0) {
+        double refract_weight = ray.weight * (1 - point.fresnel) * m.transmittance;
+        if (r_amount > 0 && survives(Random::derive(ray.key, ROULETTE_KEY + 1),
+                refract_weight, point.refract_scale)) {
+            STATS(t_stats.rays[STAT_REFRACTION]++);
             XYZ dir = delta * eta + unit_norm * (eta * cos_i - sqrt(r_amount));
-            Color refract_color =
-                rt->cast_ray(outside ? hit - bias : hit + bias, hit + dir, depth - 1, false);
-            out_color = out_color * (1 - transmittance) +
-                refract_color * (1 - fresnel) * transmittance;
+            point.refract = true;
+            point.refract_ray = {
+                outside ? hit - bias : hit + bias,
+                hit + dir,
+                ray.depth - 1,
+                false,
+                Random::derive(ray.key, 2),
+                refract_weight * point.refract_scale,
+            };
         }
     }
-    double shadow_amount = rt->shadow_amount(hit);
-    return out_color * (1 - shadow_amount) + color * rt->m_ambient * shadow_amount;
+    return point;
 }
 
-Color Wall::render(
-    Raytracer *rt,
-    const XYZ &hit,
-    const XYZ &delta,
-    unsigned depth
+// Fold traced secondary colours and the shadow terms into a shaded hit,
+// averaged over its lights
+Color Raytracer::combine(
+    const ShadePoint &point,
+    const Color &reflect_color,
+    const Color &refract_color,
+    const double *shadow
 ){
-    XYZ unit_norm = normal - position;
-    Color out_color = rt->diffuse(color, hit, unit_norm);
-    double fresnel = fresnel_amount(delta, unit_norm, refractive_index);
-    if (depth > 0 && reflectance > 0) {
-        XYZ eps_norm = unit_norm * EPSILON;
-        double dot_norm = dot(unit_norm, delta);
-        XYZ delta_reflect = delta - unit_norm * 2 * dot_norm;
-        Color reflect_color =
-            rt->cast_ray(hit + eps_norm, hit + delta_reflect, depth - 1, true);
-        out_color = out_color +
-            reflect_color * reflectance * fresnel;
+    Color sum = { 0, 0, 0 };
+    for (unsigned k = 0; k < point.lights; k++) {
+        Color out_color = point.surface[k];
+        if (point.reflect)
+            out_color = out_color +
+                reflect_color * point.reflectance * point.fresnel * point.reflect_scale;
+        if (point.refract)
+            out_color = out_color * (1 - point.transmittance) +
+                refract_color * (1 - point.fresnel) * point.transmittance * point.refract_scale;
+        out_color = out_color * (1 - shadow[k]) + point.base * m_ambient * shadow[k];
+        if (point.lights == 1)
+            return out_color;
+        sum += out_color;
     }
-    double shadow_amount = rt->shadow_amount(hit);
-    return out_color * (1 - shadow_amount) + color * rt->m_ambient * shadow_amount;
+    return sum / point.lights;
 }
 
-Color Triangle::render(
-    Raytracer *rt,
-    const XYZ &hit,
-    const XYZ &delta,
-    unsigned depth
-){
-    XYZ unit_norm = cross(edges[0], edges[1]).normal();
-    Color out_color = rt->diffuse(color, hit, unit_norm);
-    double fresnel = fresnel_amount(delta, unit_norm, refractive_index);
-    if (depth > 0 && reflectance > 0) {
-        XYZ eps_norm = unit_norm * EPSILON;
-        double dot_norm = dot(unit_norm, delta);
-        XYZ delta_reflect = delta - unit_norm * 2 * dot_norm;
-        Color reflect_color =
-            rt->cast_ray(hit + eps_norm, hit + delta_reflect, depth - 1, true);
-        out_color = out_color +
-            reflect_color * reflectance * fresnel;
+unsigned Raytracer::add_form_ref(const Form &form, FormType type, unsigned index)
+{
+    Material m = {
+        form.color,
+        form.reflectance,
+        form.refractive_index,
+        form.transmittance,
+    };
+    auto found = m_material_index.find(m);
+    if (found == m_material_index.end()) {
+        found = m_material_index.emplace(m, m_materials.size()).first;
+        m_materials.push_back(m);
     }
-    double shadow_amount = rt->shadow_amount(hit);
-    return out_color * (1 - shadow_amount) + color * rt->m_ambient * shadow_amount;
+    m_forms.push_back({ type, index, found->second });
+    m_scene_dirty = true;
+    return m_forms.size() - 1;
 }
 
-void Raytracer::add_form(Sphere &&sphere)
+unsigned Raytracer::add_form(const Sphere &sphere)
 {
-    m_spheres.push_back(sphere);
+    unsigned id = add_form_ref(sphere, FormType::Sphere, m_spheres.size());
+    m_spheres.push(sphere.position, sphere.radius, id);
+    return id;
 }
 
-void Raytracer::add_form(const Sphere &sphere)
+unsigned Raytracer::add_form(const Wall &wall)
 {
-    m_spheres.push_back(sphere);
+    unsigned id = add_form_ref(wall, FormType::Wall, m_walls.size());
+    m_walls.push_back({ wall.position, (wall.normal - wall.position).normal(), id });
+    return id;
 }
 
-void Raytracer::add_form(Wall &&wall)
+unsigned Raytracer::add_form(const Triangle &tri)
 {
-    m_walls.push_back(wall);
+    unsigned id = add_form_ref(tri, FormType::Triangle, m_triangles.size());
+    m_triangles.push(tri.vertices[0], tri.edges[0], tri.edges[1], id);
+    return id;
 }
 
-void Raytracer::add_form(const Wall &wall)
+unsigned Raytracer::add_form(MeshForm form)
 {
-    m_walls.push_back(wall);
+    unsigned id = add_form_ref(form, FormType::Mesh, m_meshes.size());
+    m_meshes.push_back({ std::move(form.mesh), BVH(), id });
+    return id;
 }
 
-void Raytracer::add_form(Triangle &&tri)
+unsigned Raytracer::add_prototype(Mesh mesh)
 {
-    m_triangles.push_back(tri);
+    m_prototypes.push_back({ std::move(mesh), BVH() });
+    return m_prototypes.size() - 1;
 }
 
-void Raytracer::add_form(const Triangle &tri)
+unsigned Raytracer::add_form(const Instance &instance)
 {
-    m_triangles.push_back(tri);
+    if (instance.prototype >= m_prototypes.size())
+        throw std::runtime_error("can't place prototype " + std::to_string(instance.prototype) +
+            ", there's no such prototype");
+    unsigned id = add_form_ref(instance, FormType::Instance, m_instances.size());
+    XYZ axes[3] = {
+        instance.transform.apply_vector({ 1, 0, 0 }),
+        instance.transform.apply_vector({ 0, 1, 0 }),
+        instance.transform.apply_vector({ 0, 0, 1 }),
+    };
+    InstanceGeometry geometry;
+    geometry.prototype = instance.prototype;
+    geometry.id = id;
+    geometry.place(instance.transform.translation, axes);
+    m_instances.push_back(geometry);
+    return id;
 }
 
 void Raytracer::set_diffuse(double coeff)
@@ -408,16 +1242,35 @@ void Raytracer::set_background(const Color &c)
     m_background_color = c;
 }
 
+void Raytracer::set_tonemap(Tonemap op, double exposure)
+{
+    m_tonemap = op;
+    m_exposure = exposure;
+}
+
 void Raytracer::set_reflection_depth(unsigned depth)
 {
     m_reflection_depth = depth;
 }
 
+void Raytracer::set_russian_roulette(double weight, double cutoff)
+{
+    m_roulette_weight = weight;
+    m_roulette_cutoff = cutoff;
+}
+
 void Raytracer::set_shadow_unit_size(double size)
 {
     m_shadow_unit_size = size;
 }
 
+void Raytracer::set_shadow_cache(double cell, double tolerance, unsigned entries)
+{
+    m_shadow_cache_cell = cell;
+    m_shadow_cache_tolerance = tolerance;
+    m_shadow_cache_entries = entries;
+}
+
 void Raytracer::set_shadow_grid_size(unsigned size)
 {
     m_shadow_grid_size = size;
@@ -428,12 +1281,70 @@ void Raytracer::set_pixel_sample_size(unsigned size)
     m_pixel_sample_size = size;
 }
 
+void Raytracer::set_sampler(SampleSequence sequence)
+{
+    m_sampler = Sampler(sequence);
+}
+
+// Sample in rounds of min_samples, stopping once a pixel's standard error
+// (in 8-bit luminance levels) is at most threshold or it has max_samples.
+// m_pixel_sample_size is ignored while this is on.
+void Raytracer::set_adaptive_sampling(unsigned min_samples, unsigned max_samples, double threshold)
+{
+    m_adaptive = max_samples > 0;
+    m_adaptive_min = min_samples;
+    m_adaptive_max = std::max(min_samples, max_samples);
+    m_adaptive_threshold = threshold;
+}
+
 void Raytracer::set_light(const XYZ &pos)
 {
-    m_light = pos;
+    if (m_lights.empty())
+        m_lights.push_back({ LightType::Area, pos, { 255, 255, 255 }, 1, 0 });
+    else
+        m_lights[0].position = pos;
+}
+
+unsigned Raytracer::add_light(const Light &light)
+{
+    m_lights.push_back(light);
+    return m_lights.size() - 1;
+}
+
+void Raytracer::set_light_samples(unsigned count)
+{
+    m_light_samples = std::min(std::max(count, 1u), (unsigned)MAX_LIGHT_SAMPLES);
 }
 
 void Raytracer::set_camera(const XYZ &pos)
 {
     m_camera = pos;
 }
+
+void Raytracer::set_checkpoint(const std::string &filename, double seconds, bool resume)
+{
+    m_checkpoint = filename;
+    m_checkpoint_seconds = seconds;
+    m_resume = resume;
+}
+
+void Raytracer::set_png_compression(int level)
+{
+    m_png_level = std::min(std::max(level, 0), 9);
+}
+
+void Raytracer::set_thread_count(unsigned count)
+{
+    m_thread_count = count;
+}
+
+void Raytracer::set_tile_size(unsigned size)
+{
+    m_tile_size = size;
+}
+
+void Raytracer::set_seed(uint64_t seed)
+{
+    m_seed = seed;
+}
+
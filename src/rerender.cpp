@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <stdexcept>
+#include "raytrace.h"
+
+/*
+ * Incremental re-rendering after material changes. While tracking
+ * dependencies, render() notes for every pixel the forms any of its
+ * samples' rays hit, reflections and refractions included, and the forms
+ * that blocked its shadow rays. A material only matters where a ray hits
+ * its form or is shadowed by it, and changing it can't change what the
+ * other rays hit, so only those pixels can come out differently. Samples
+ * are keyed by pixel and sample number (see Random::derive), so rendering
+ * just those pixels again gives them exactly what a full render would.
+ *
+ * Each tile keeps its pixels' (form << 32 | pixel) pairs sorted, which
+ * makes finding the pixels of an edited form a binary search per tile.
+ */
+
+thread_local TouchedForms t_touched;
+
+void Raytracer::set_material(unsigned id, const Material &m)
+{
+    if (id >= m_forms.size())
+        throw std::runtime_error("can't change the material of form " + std::to_string(id) +
+            ", there's no such form");
+    auto found = m_material_index.find(m);
+    if (found == m_material_index.end()) {
+        found = m_material_index.emplace(m, m_materials.size()).first;
+        m_materials.push_back(m);
+    }
+    if (m_forms[id].material == found->second)
+        return;
+    m_forms[id].material = found->second;
+    m_edited.push_back(id);
+}
+
+void Raytracer::set_dependency_tracking(bool on)
+{
+    m_track_dependencies = on;
+}
+
+unsigned Raytracer::rerender()
+{
+    if (m_dependencies.empty())
+        throw std::runtime_error("rerender() needs a render() that tracked dependencies");
+    if (m_scene_dirty) {
+        render();
+        return m_width * m_height;
+    }
+
+    // Which pixels of each tile saw an edited form
+    std::sort(m_edited.begin(), m_edited.end());
+    m_edited.erase(std::unique(m_edited.begin(), m_edited.end()), m_edited.end());
+    std::vector<Tile> tiles = make_tiles(m_width, m_height, m_dependency_tile_size);
+    std::vector<std::vector<uint8_t>> only(tiles.size());
+    std::vector<Tile> todo;
+    unsigned count = 0;
+    for (size_t t = 0; t < tiles.size(); t++) {
+        const Tile &tile = tiles[t];
+        const std::vector<uint64_t> &pairs = m_dependencies[t];
+        unsigned tile_width = tile.x1 - tile.x0;
+        for (unsigned form : m_edited) {
+            auto it = std::lower_bound(pairs.begin(), pairs.end(), (uint64_t)form << 32);
+            for (; it != pairs.end() && *it >> 32 == form; ++it) {
+                unsigned pixel = (uint32_t)*it;
+                unsigned i = (pixel / m_width - tile.y0) * tile_width + pixel % m_width - tile.x0;
+                if (only[t].empty())
+                    only[t].assign(tile_width * (tile.y1 - tile.y0), 0);
+                count += !only[t][i];
+                only[t][i] = 1;
+            }
+        }
+        if (!only[t].empty())
+            todo.push_back(tile);
+    }
+    m_edited.clear();
+    if (count == 0)
+        return 0;
+
+    // The heatmap keeps the costs of the pixels that aren't traced again
+    std::vector<float> heatmap = std::move(m_heatmap);
+    reset_stats();
+    if (!heatmap.empty())
+        m_heatmap = std::move(heatmap);
+
+    TileScheduler scheduler(m_thread_count);
+    {
+        PhaseTimer timer(m_stats.seconds[STAT_TRACE]);
+        scheduler.run(todo, [&](unsigned, const Tile &tile) {
+            size_t index = tile_index(tile, m_dependency_tile_size);
+            const std::vector<uint8_t> &mask = only[index];
+            std::vector<Color> sums;
+            std::vector<unsigned> counts;
+            std::vector<uint64_t> pairs;
+            render_tile(tile, sums, counts, &mask, &pairs);
+
+            // Only this tile's worker touches its pixels and pairs
+            unsigned tile_width = tile.x1 - tile.x0;
+            for (unsigned i = 0; i < sums.size(); i++) {
+                if (!mask[i])
+                    continue;
+                unsigned x = tile.x0 + i % tile_width, y = tile.y0 + i / tile_width;
+                m_samples_taken -= m_framebuffer.samples(x, y);
+                m_framebuffer.set(x, y, sums[i], counts[i]);
+            }
+            for (uint64_t pair : m_dependencies[index]) {
+                unsigned pixel = (uint32_t)pair;
+                if (!mask[(pixel / m_width - tile.y0) * tile_width + pixel % m_width - tile.x0])
+                    pairs.push_back(pair);
+            }
+            std::sort(pairs.begin(), pairs.end());
+            m_dependencies[index] = std::move(pairs);
+            STATS(merge_stats());
+        });
+    }
+
+    denoise_frame(scheduler);
+    return count;
+}
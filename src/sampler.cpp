@@ -0,0 +1,82 @@
+#include <cmath>
+#include "sampler.h"
+#include "random.h"
+
+static const unsigned halton_primes[] = { 2, 3, 5, 7, 11, 13, 17, 19 };
+
+// Top 53 bits of a hash as a double in [0, 1)
+static double unit(uint64_t bits)
+{
+    return (bits >> 11) * 0x1.0p-53;
+}
+
+static double radical_inverse(unsigned index, unsigned base)
+{
+    double inv_base = 1.0 / base, f = inv_base, r = 0;
+    while (index > 0) {
+        r += (index % base) * f;
+        index /= base;
+        f *= inv_base;
+    }
+    return r;
+}
+
+// First two dimensions of the Sobol sequence, a (0, 2)-sequence in base 2
+static uint32_t sobol_x(uint32_t index)
+{
+    uint32_t r = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v >>= 1)
+        if (index & 1)
+            r ^= v;
+    return r;
+}
+
+static uint32_t sobol_y(uint32_t index)
+{
+    uint32_t r = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            r ^= v;
+    return r;
+}
+
+std::pair<double, double> Sampler::sample(
+    uint64_t key,
+    unsigned index,
+    unsigned count,
+    unsigned dimension
+) const {
+    uint64_t scramble = Random::derive(key, dimension);
+
+    switch (m_sequence) {
+    case SampleSequence::Random: {
+        uint64_t point = Random::derive(scramble, index);
+        return { unit(point), unit(Random::mix(point)) };
+    }
+    case SampleSequence::Stratified: {
+        // One jittered point per cell of the smallest square grid holding
+        // `count` cells, filled row by row
+        unsigned side = (unsigned)ceil(sqrt((double)count));
+        if (side == 0) side = 1;
+        uint64_t jitter = Random::derive(scramble, index);
+        return {
+            (index % side + unit(jitter)) / side,
+            (index / side % side + unit(Random::mix(jitter))) / side,
+        };
+    }
+    case SampleSequence::Halton: {
+        // Cranley-Patterson rotation by a per-key offset
+        unsigned d = (2 * dimension) % (sizeof(halton_primes) / sizeof(*halton_primes));
+        double u = radical_inverse(index, halton_primes[d]) + unit(scramble);
+        double v = radical_inverse(index, halton_primes[d + 1]) + unit(Random::mix(scramble));
+        return { u - floor(u), v - floor(v) };
+    }
+    case SampleSequence::Sobol: {
+        // Random digital shift, which keeps the (0, 2) stratification
+        uint32_t u = sobol_x(index) ^ (uint32_t)scramble;
+        uint32_t v = sobol_y(index) ^ (uint32_t)(scramble >> 32);
+        return { u * 0x1.0p-32, v * 0x1.0p-32 };
+    }
+    }
+    return { 0.5, 0.5 };
+}
@@ -0,0 +1,87 @@
+#include <tuple>
+#include "scene.h"
+
+bool Material::operator<(const Material &other) const
+{
+    return std::tie(color.r, color.g, color.b, reflectance, refractive_index, transmittance) <
+        std::tie(other.color.r, other.color.g, other.color.b,
+                 other.reflectance, other.refractive_index, other.transmittance);
+}
+
+// Append to a padded array, keeping SIMD_PAD zeros behind the new entry
+static void push_padded(std::vector<double> &a, unsigned size, double v)
+{
+    a.resize(size);
+    a.push_back(v);
+    a.resize(size + 1 + SIMD_PAD, 0);
+}
+
+template <typename T>
+static void permute_array(std::vector<T> &a, const std::vector<unsigned> &order, unsigned pad)
+{
+    std::vector<T> sorted;
+    sorted.reserve(order.size() + pad);
+    for (unsigned i : order)
+        sorted.push_back(a[i]);
+    sorted.resize(order.size() + pad, T());
+    a.swap(sorted);
+}
+
+void SphereSoA::push(const XYZ &center, double radius, unsigned form)
+{
+    unsigned n = size();
+    push_padded(x, n, center.x);
+    push_padded(y, n, center.y);
+    push_padded(z, n, center.z);
+    push_padded(r2, n, radius * radius);
+    id.push_back(form);
+}
+
+void SphereSoA::permute(const std::vector<unsigned> &order)
+{
+    for (auto *a : { &x, &y, &z, &r2 })
+        permute_array(*a, order, SIMD_PAD);
+    permute_array(id, order, 0);
+}
+
+void TriangleSoA::push(const XYZ &v0, const XYZ &e1, const XYZ &e2, unsigned form)
+{
+    unsigned n = size();
+    push_padded(v0x, n, v0.x); push_padded(v0y, n, v0.y); push_padded(v0z, n, v0.z);
+    push_padded(e1x, n, e1.x); push_padded(e1y, n, e1.y); push_padded(e1z, n, e1.z);
+    push_padded(e2x, n, e2.x); push_padded(e2y, n, e2.y); push_padded(e2z, n, e2.z);
+    id.push_back(form);
+}
+
+void TriangleSoA::permute(const std::vector<unsigned> &order)
+{
+    for (auto *a : { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z })
+        permute_array(*a, order, SIMD_PAD);
+    permute_array(id, order, 0);
+}
+
+void InstanceGeometry::place(const XYZ &t, const XYZ *columns)
+{
+    translation = t;
+    for (unsigned i = 0; i < 3; i++)
+        axes[i] = columns[i];
+    // Rows of the inverse are the cross products of column pairs over the
+    // determinant
+    double det = dot(axes[0], cross(axes[1], axes[2]));
+    double inv_det = det != 0 ? 1 / det : 0;
+    inverse[0] = cross(axes[1], axes[2]) * inv_det;
+    inverse[1] = cross(axes[2], axes[0]) * inv_det;
+    inverse[2] = cross(axes[0], axes[1]) * inv_det;
+}
+
+AABB InstanceGeometry::bounds(const AABB &box) const
+{
+    AABB world = AABB::empty();
+    for (unsigned corner = 0; corner < 8; corner++)
+        world.extend(to_world({
+            corner & 1 ? box.max.x : box.min.x,
+            corner & 2 ? box.max.y : box.min.y,
+            corner & 4 ? box.max.z : box.min.z,
+        }));
+    return world;
+}
@@ -0,0 +1,380 @@
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "scenefile.h"
+
+namespace {
+
+class SceneParser {
+public:
+    SceneParser(const std::string &path, SceneInfo &info)
+        : m_path(path), m_info(info)
+    {
+        size_t slash = path.rfind('/');
+        m_dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    }
+
+    std::unique_ptr<Raytracer> parse();
+
+private:
+    void directive(const std::string &);
+
+    [[noreturn]] void fail(const std::string &what) const
+    {
+        throw std::runtime_error(m_path + ":" + std::to_string(m_line) + ": " + what);
+    }
+
+    template <typename T>
+    T read(const char *what)
+    {
+        T value;
+        if (!(m_words >> value))
+            fail(std::string("expected ") + what);
+        return value;
+    }
+
+    XYZ read_xyz() { double x = read<double>("x"), y = read<double>("y"); return { x, y, read<double>("z") }; }
+    Color read_color()
+    {
+        float r = read<float>("red"), g = read<float>("green");
+        return { r, g, read<float>("blue") };
+    }
+    const Material &read_material();
+    Raytracer &raytracer();
+    void keyframe();
+    void light(LightType);
+    Mesh read_mesh();
+    Transform read_transform(const char *);
+
+    std::string m_path;
+    std::string m_dir;
+    SceneInfo &m_info;
+    unsigned m_line { 0 };
+    std::istringstream m_words;
+
+    std::unique_ptr<Raytracer> m_raytracer;
+    std::map<std::string, Material> m_materials;
+    std::map<std::string, unsigned> m_names;
+    std::map<std::string, unsigned> m_prototypes;
+    unsigned m_last_form { NO_FORM };
+};
+
+Raytracer &SceneParser::raytracer()
+{
+    if (!m_raytracer)
+        fail("`size` has to come before everything else");
+    return *m_raytracer;
+}
+
+const Material &SceneParser::read_material()
+{
+    std::string name = read<std::string>("material name");
+    auto found = m_materials.find(name);
+    if (found == m_materials.end())
+        fail("unknown material " + name);
+    return found->second;
+}
+
+void SceneParser::keyframe()
+{
+    double frame = read<double>("frame");
+    std::string what = read<std::string>("camera, light or form name");
+    if (what == "camera") {
+        m_info.animation.camera.add(frame, read_xyz());
+        return;
+    }
+    if (what == "light") {
+        m_info.animation.light.add(frame, read_xyz());
+        return;
+    }
+
+    auto found = m_names.find(what);
+    if (found == m_names.end())
+        fail("no form named " + what);
+    m_info.animation.forms[found->second].add(frame, read_transform("keyframe"));
+}
+
+// Options to the end of the line
+Transform SceneParser::read_transform(const char *what)
+{
+    Transform transform;
+    std::string option;
+    while (m_words >> option) {
+        if (option == "translate")
+            transform.translation = read_xyz();
+        else if (option == "rotate")
+            transform.rotation = read_xyz();
+        else if (option == "scale")
+            transform.scale = read<double>("scale");
+        else
+            fail(std::string("unknown ") + what + " option " + option);
+    }
+    return transform;
+}
+
+// A mesh file and its options to the end of the line
+Mesh SceneParser::read_mesh()
+{
+    std::string file = read<std::string>("mesh file");
+    if (file.empty() || file[0] != '/')
+        file = m_dir + file;
+    raytracer();
+
+    MeshLoadStats stats;
+    Mesh mesh;
+    try {
+        mesh = load_mesh(file, 0, &stats);
+    } catch (const std::runtime_error &e) {
+        fail(e.what());
+    }
+    m_info.meshes.push_back({ file, stats });
+
+    std::string option;
+    while (m_words >> option) {
+        if (option == "flip_y") {
+            for (auto &v : mesh.vertices)
+                v.y = -v.y;
+        } else if (option == "fit") {
+            XYZ center = read_xyz();
+            mesh.fit(center, read<double>("size"));
+        } else {
+            fail("unknown mesh option " + option);
+        }
+    }
+    return mesh;
+}
+
+void SceneParser::light(LightType type)
+{
+    Light light = { type, read_xyz(), { 255, 255, 255 }, 1, 0 };
+    std::string option;
+    while (m_words >> option) {
+        if (option == "color")
+            light.color = read_color();
+        else if (option == "intensity")
+            light.intensity = read<double>("intensity");
+        else if (option == "size" && type == LightType::Area)
+            light.size = read<double>("size");
+        else
+            fail("unknown light option " + option);
+    }
+    if (light.intensity < 0)
+        fail("light intensity can't be negative");
+    raytracer().add_light(light);
+}
+
+void SceneParser::directive(const std::string &name)
+{
+    if (name == "size") {
+        if (m_raytracer)
+            fail("size given twice");
+        unsigned w = read<unsigned>("width"), h = read<unsigned>("height");
+        m_raytracer.reset(new Raytracer(w, h));
+    } else if (name == "output") {
+        m_info.output = read<std::string>("file name");
+    } else if (name == "stream") {
+        std::string on = read<std::string>("on or off");
+        if (on != "on" && on != "off")
+            fail("stream is on or off");
+        m_info.stream = on == "on";
+    } else if (name == "checkpoint") {
+        m_info.checkpoint = read<std::string>("file name");
+        m_info.checkpoint_seconds = read<double>("seconds");
+    } else if (name == "stats") {
+#ifndef RT_STATS
+        // The counters would all be zero
+        fail("stats need a build with stats enabled (make STATS=1)");
+#endif
+        m_info.stats = read<std::string>("file name");
+    } else if (name == "heatmap") {
+        std::string mode = read<std::string>("rays or time");
+        if (mode == "rays")
+            m_info.heatmap = Heatmap::Rays;
+        else if (mode == "time")
+            m_info.heatmap = Heatmap::Time;
+        else
+            fail("heatmap is rays or time");
+        m_info.heatmap_output = read<std::string>("file name");
+    } else if (name == "feature") {
+        static const std::map<std::string, Feature> features = {
+            { "albedo", Feature::Albedo },
+            { "normal", Feature::Normal },
+            { "depth", Feature::Depth },
+            { "id", Feature::Id },
+            { "variance", Feature::Variance },
+        };
+        auto found = features.find(read<std::string>("feature"));
+        if (found == features.end())
+            fail("feature is one of albedo, normal, depth, id or variance");
+        m_info.features.emplace_back(found->second, read<std::string>("file name"));
+    } else if (name == "camera") {
+        raytracer().set_camera(read_xyz());
+    } else if (name == "light") {
+        raytracer().set_light(read_xyz());
+    } else if (name == "point_light") {
+        light(LightType::Point);
+    } else if (name == "area_light") {
+        light(LightType::Area);
+    } else if (name == "directional_light") {
+        light(LightType::Directional);
+    } else if (name == "light_samples") {
+        raytracer().set_light_samples(read<unsigned>("light count"));
+    } else if (name == "background") {
+        raytracer().set_background(read_color());
+    } else if (name == "material") {
+        std::string material = read<std::string>("material name");
+        Color c = read_color();
+        double refl = read<double>("reflectance");
+        double refr = read<double>("refractive index");
+        m_materials[material] = { c, refl, refr, read<double>("transmittance") };
+    } else if (name == "wall") {
+        const Material &m = read_material();
+        XYZ position = read_xyz();
+        m_last_form = raytracer().add_form(Wall { m.color, m.reflectance, m.refractive_index,
+            m.transmittance, position, read_xyz() });
+    } else if (name == "sphere") {
+        const Material &m = read_material();
+        XYZ center = read_xyz();
+        m_last_form = raytracer().add_form(Sphere { m.color, m.reflectance, m.refractive_index,
+            m.transmittance, center, read<double>("radius") });
+    } else if (name == "triangle") {
+        const Material &m = read_material();
+        XYZ v0 = read_xyz(), v1 = read_xyz();
+        m_last_form = raytracer().add_form(Triangle { m.color, m.reflectance, m.refractive_index,
+            m.transmittance, v0, v1, read_xyz() });
+    } else if (name == "mesh") {
+        const Material &m = read_material();
+        Mesh mesh = read_mesh();
+        m_last_form = raytracer().add_form(MeshForm { m.color, m.reflectance, m.refractive_index,
+            m.transmittance, std::move(mesh) });
+    } else if (name == "prototype") {
+        std::string label = read<std::string>("prototype name");
+        if (m_prototypes.count(label))
+            fail("two prototypes named " + label);
+        unsigned index = raytracer().add_prototype(read_mesh());
+        m_prototypes[label] = index;
+    } else if (name == "instance") {
+        const Material &m = read_material();
+        std::string label = read<std::string>("prototype name");
+        auto found = m_prototypes.find(label);
+        if (found == m_prototypes.end())
+            fail("no prototype named " + label);
+        m_last_form = raytracer().add_form(Instance { m.color, m.reflectance, m.refractive_index,
+            m.transmittance, found->second, read_transform("instance") });
+    } else if (name == "name") {
+        if (m_last_form == NO_FORM)
+            fail("`name` has to follow a form");
+        std::string label = read<std::string>("form name");
+        if (label == "camera" || label == "light")
+            fail(label + " can't be a form name");
+        if (!m_names.emplace(label, m_last_form).second)
+            fail("two forms named " + label);
+    } else if (name == "keyframe") {
+        keyframe();
+    } else if (name == "frames") {
+        unsigned first = read<unsigned>("first frame");
+        unsigned last = read<unsigned>("last frame");
+        if (last < first)
+            fail("the last frame comes before the first");
+        m_info.first_frame = first;
+        m_info.last_frame = last;
+        m_info.animated = true;
+    } else if (name == "diffuse") {
+        raytracer().set_diffuse(read<double>("coefficient"));
+    } else if (name == "ambient") {
+        raytracer().set_ambient(read<double>("coefficient"));
+    } else if (name == "specular") {
+        raytracer().set_specular(read<double>("coefficient"));
+    } else if (name == "specular_size") {
+        raytracer().set_specular_size(read<int>("power"));
+    } else if (name == "reflection_depth") {
+        raytracer().set_reflection_depth(read<unsigned>("depth"));
+    } else if (name == "russian_roulette") {
+        double weight = read<double>("weight");
+        raytracer().set_russian_roulette(weight, read<double>("cutoff"));
+    } else if (name == "shadow_unit_size") {
+        raytracer().set_shadow_unit_size(read<double>("size"));
+    } else if (name == "shadow_grid_size") {
+        raytracer().set_shadow_grid_size(read<unsigned>("size"));
+    } else if (name == "shadow_cache") {
+        double cell = read<double>("cell size");
+        double tolerance = read<double>("tolerance");
+        raytracer().set_shadow_cache(cell, tolerance, read<unsigned>("entries"));
+    } else if (name == "pixel_sample_size") {
+        raytracer().set_pixel_sample_size(read<unsigned>("sample count"));
+    } else if (name == "sampler") {
+        static const std::map<std::string, SampleSequence> sequences = {
+            { "random", SampleSequence::Random },
+            { "stratified", SampleSequence::Stratified },
+            { "halton", SampleSequence::Halton },
+            { "sobol", SampleSequence::Sobol },
+        };
+        auto found = sequences.find(read<std::string>("sequence"));
+        if (found == sequences.end())
+            fail("sampler is one of random, stratified, halton or sobol");
+        raytracer().set_sampler(found->second);
+    } else if (name == "adaptive_sampling") {
+        unsigned min_samples = read<unsigned>("minimum samples");
+        unsigned max_samples = read<unsigned>("maximum samples");
+        raytracer().set_adaptive_sampling(min_samples, max_samples, read<double>("threshold"));
+    } else if (name == "denoise") {
+        unsigned passes = read<unsigned>("pass count");
+        raytracer().set_denoise(passes, read<double>("sigma"));
+    } else if (name == "png_compression") {
+        raytracer().set_png_compression(read<int>("level"));
+    } else if (name == "tonemap") {
+        std::string op = read<std::string>("tonemap operator");
+        double exposure = read<double>("exposure");
+        if (op == "clamp")
+            raytracer().set_tonemap(Tonemap::Clamp, exposure);
+        else if (op == "reinhard")
+            raytracer().set_tonemap(Tonemap::Reinhard, exposure);
+        else
+            fail("tonemap is clamp or reinhard");
+    } else if (name == "thread_count") {
+        raytracer().set_thread_count(read<unsigned>("thread count"));
+    } else if (name == "tile_size") {
+        raytracer().set_tile_size(read<unsigned>("size"));
+    } else if (name == "seed") {
+        raytracer().set_seed(read<uint64_t>("seed"));
+    } else {
+        fail("unknown directive " + name);
+    }
+
+    std::string extra;
+    if (m_words >> extra)
+        fail("unexpected " + extra);
+}
+
+std::unique_ptr<Raytracer> SceneParser::parse()
+{
+    std::ifstream in(m_path);
+    if (!in)
+        throw std::runtime_error("can't open " + m_path);
+
+    std::string line;
+    while (std::getline(in, line)) {
+        m_line++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+        m_words.clear();
+        m_words.str(line);
+        std::string name;
+        if (m_words >> name)
+            directive(name);
+    }
+    if (!m_raytracer)
+        fail("no size given");
+    if (!m_info.animation.empty() && !m_info.animated)
+        throw std::runtime_error(m_path + ": keyframes but no `frames` to render");
+    return std::move(m_raytracer);
+}
+
+}
+
+std::unique_ptr<Raytracer> load_scene(const std::string &path, SceneInfo &info)
+{
+    return SceneParser(path, info).parse();
+}
@@ -0,0 +1,95 @@
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "scheduler.h"
+
+std::vector<Tile> make_tiles(unsigned width, unsigned height, unsigned size)
+{
+    std::vector<Tile> tiles;
+    if (size == 0) size = 1;
+    for (unsigned y = 0; y < height; y += size)
+        for (unsigned x = 0; x < width; x += size)
+            tiles.push_back({
+                x,
+                y,
+                std::min(x + size, width),
+                std::min(y + size, height),
+            });
+    return tiles;
+}
+
+TileScheduler::TileScheduler(unsigned threads)
+    : m_thread_count(threads == 0 ? 1 : threads)
+{
+    for (unsigned i = 0; i < m_thread_count; i++)
+        m_queues.emplace_back(new Queue);
+}
+
+bool TileScheduler::pop(unsigned worker, Tile &tile)
+{
+    Queue &own = *m_queues[worker];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (own.tiles.empty())
+        return false;
+    tile = own.tiles.back();
+    own.tiles.pop_back();
+    return true;
+}
+
+bool TileScheduler::steal(unsigned worker, Tile &tile)
+{
+    for (unsigned i = 1; i < m_thread_count; i++) {
+        Queue &victim = *m_queues[(worker + i) % m_thread_count];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tiles.empty()) {
+            tile = victim.tiles.front();
+            victim.tiles.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TileScheduler::run(
+    const std::vector<Tile> &tiles,
+    const std::function<void(unsigned, const Tile &)> &work
+){
+    // Deal out contiguous runs of tiles so neighbouring work starts out on
+    // the same thread; stealing evens things up afterwards
+    size_t per_worker = (tiles.size() + m_thread_count - 1) / m_thread_count;
+    for (size_t i = 0; i < tiles.size(); i++)
+        m_queues[i / per_worker]->tiles.push_front(tiles[i]);
+
+    // No tiles are added once workers start, so a worker can quit as soon
+    // as there is nothing left to pop or steal
+    auto worker_loop = [&](unsigned worker) {
+        Tile tile;
+        while (pop(worker, tile) || steal(worker, tile))
+            work(worker, tile);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < m_thread_count; i++)
+        threads.emplace_back(worker_loop, i);
+    worker_loop(0);
+    for (auto &t : threads)
+        t.join();
+}
+
+void TileScheduler::run_in_order(
+    const std::vector<Tile> &tiles,
+    const std::function<void(unsigned, const Tile &)> &work
+){
+    std::atomic<size_t> next { 0 };
+    auto worker_loop = [&](unsigned worker) {
+        for (size_t i = next++; i < tiles.size(); i = next++)
+            work(worker, tiles[i]);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < m_thread_count; i++)
+        threads.emplace_back(worker_loop, i);
+    worker_loop(0);
+    for (auto &t : threads)
+        t.join();
+}
@@ -0,0 +1,117 @@
+#include <cmath>
+#include <atomic>
+#include <algorithm>
+#include "shadow_cache.h"
+#include "random.h"
+
+thread_local ShadowCache t_shadow_cache;
+
+uint64_t ShadowCache::new_render()
+{
+    static std::atomic<uint64_t> renders { 0 };
+    return ++renders;
+}
+
+void ShadowCache::begin(uint64_t render, double cell, double tolerance, unsigned capacity)
+{
+    if (render == m_render)
+        return;
+    m_render = render;
+    size_t size = 16;
+    while (size < capacity)
+        size *= 2;
+    if (m_entries.size() != size)
+        m_entries.assign(size, Entry());
+    m_inv_cell = 1 / cell;
+    m_tolerance = tolerance;
+    clear();
+}
+
+void ShadowCache::clear()
+{
+    if (++m_generation == 0) {
+        std::fill(m_entries.begin(), m_entries.end(), Entry());
+        m_generation = 1;
+    }
+}
+
+ShadowCache::Cell ShadowCache::cell(const XYZ &p, const XYZ &normal, unsigned form, unsigned light) const
+{
+    // The axis the surface mostly faces along and its direction, so the
+    // two sides of a thin object or a corner's walls don't share cells
+    double ax = fabs(normal.x), ay = fabs(normal.y), az = fabs(normal.z);
+    uint64_t face = ax >= ay && ax >= az ? (normal.x < 0) :
+                    ay >= az ? 2 + (normal.y < 0) : 4 + (normal.z < 0);
+    return {
+        Random::derive(Random::derive(form, face), light),
+        (int64_t)floor(p.x * m_inv_cell),
+        (int64_t)floor(p.y * m_inv_cell),
+        (int64_t)floor(p.z * m_inv_cell),
+    };
+}
+
+uint64_t ShadowCache::key(const Cell &c, int dx, int dy, int dz)
+{
+    uint64_t k = Random::derive(c.base, c.x + dx);
+    k = Random::derive(k, c.y + dy);
+    return Random::derive(k, c.z + dz);
+}
+
+// The table is split into buckets of SHADOW_CACHE_WAYS entries and a key
+// can only live in its bucket. Returns its entry, or the one it would
+// replace: an empty entry, else the one with the fewest samples.
+size_t ShadowCache::slot(uint64_t key) const
+{
+    size_t first = (key & (m_entries.size() - 1)) & ~(size_t)(SHADOW_CACHE_WAYS - 1);
+    size_t victim = first;
+    for (size_t i = first; i < first + SHADOW_CACHE_WAYS; i++) {
+        const Entry &e = m_entries[i];
+        if (e.generation != m_generation)
+            victim = i;
+        else if (e.key == key)
+            return i;
+        else if (m_entries[victim].generation == m_generation && e.count < m_entries[victim].count)
+            victim = i;
+    }
+    return victim;
+}
+
+const ShadowCache::Entry *ShadowCache::find(uint64_t key) const
+{
+    const Entry &e = m_entries[slot(key)];
+    return e.generation == m_generation && e.key == key ? &e : nullptr;
+}
+
+bool ShadowCache::lookup(const Cell &c, double &shadow) const
+{
+    const Entry *e = find(key(c, 0, 0, 0));
+    if (!e || e->count < SHADOW_CACHE_SAMPLES || e->max - e->min > m_tolerance)
+        return false;
+
+    // A cell that only ever saw one side of a shadow's edge still agrees
+    // with itself, but its neighbour across the edge won't agree with it
+    static const int around[6][3] = {
+        { -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 },
+    };
+    for (auto &d : around) {
+        const Entry *n = find(key(c, d[0], d[1], d[2]));
+        if (n && std::max(n->max, e->max) - std::min(n->min, e->min) > m_tolerance)
+            return false;
+    }
+    shadow = e->sum / e->count;
+    return true;
+}
+
+void ShadowCache::record(const Cell &c, double shadow)
+{
+    uint64_t k = key(c, 0, 0, 0);
+    Entry &e = m_entries[slot(k)];
+    if (e.generation != m_generation || e.key != k) {
+        e = { k, m_generation, 1, (float)shadow, (float)shadow, shadow };
+        return;
+    }
+    e.count++;
+    e.min = std::min(e.min, (float)shadow);
+    e.max = std::max(e.max, (float)shadow);
+    e.sum += shadow;
+}
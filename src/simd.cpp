@@ -0,0 +1,267 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+// Lanes are resolved in order with a strict `<`, which is what keeps hit
+// selection identical to the scalar loops
+static inline bool select_lanes(const double *t, unsigned lanes, unsigned base,
+                                double &closest_t, unsigned &index)
+{
+    bool found = false;
+    for (unsigned l = 0; l < lanes; l++) {
+        if (t[l] > EPSILON && t[l] < closest_t) {
+            closest_t = t[l];
+            index = base + l;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/*
+ * Scalar reference kernels. The vector versions below perform the same
+ * operations in the same order, so they produce the same bits.
+ */
+
+static bool spheres_scalar(
+    const SphereSoA &s, unsigned first, unsigned count,
+    const XYZ &from, const XYZ &delta, double &closest_t, unsigned &index
+){
+    double a = delta.x * delta.x + delta.y * delta.y + delta.z * delta.z;
+    bool found = false;
+    for (unsigned i = first; i < first + count; i++) {
+        double ox = from.x - s.x[i], oy = from.y - s.y[i], oz = from.z - s.z[i];
+        double half_b = delta.x * ox + delta.y * oy + delta.z * oz;
+        double c = ox * ox + oy * oy + oz * oz - s.r2[i];
+        double disc = half_b * half_b - a * c;
+        if (disc > 0) {
+            double t = (-half_b - sqrt(disc)) / a;
+            found |= select_lanes(&t, 1, i, closest_t, index);
+        }
+    }
+    return found;
+}
+
+// Moller-Trumbore
+static bool triangles_scalar(
+    const TriangleSoA &s, unsigned first, unsigned count,
+    const XYZ &from, const XYZ &delta, double &closest_t, unsigned &index
+){
+    bool found = false;
+    for (unsigned i = first; i < first + count; i++) {
+        double hx = delta.y * s.e2z[i] - delta.z * s.e2y[i];
+        double hy = delta.z * s.e2x[i] - delta.x * s.e2z[i];
+        double hz = delta.x * s.e2y[i] - delta.y * s.e2x[i];
+        double a = hx * s.e1x[i] + hy * s.e1y[i] + hz * s.e1z[i];
+        if (fabs(a) < EPSILON)
+            continue;
+        double f = 1 / a;
+        double sx = from.x - s.v0x[i], sy = from.y - s.v0y[i], sz = from.z - s.v0z[i];
+        double u = f * (sx * hx + sy * hy + sz * hz);
+        if (u < 0 || u > 1)
+            continue;
+        double qx = sy * s.e1z[i] - sz * s.e1y[i];
+        double qy = sz * s.e1x[i] - sx * s.e1z[i];
+        double qz = sx * s.e1y[i] - sy * s.e1x[i];
+        double v = f * (delta.x * qx + delta.y * qy + delta.z * qz);
+        if (v < 0 || u + v > 1)
+            continue;
+        double t = f * (s.e2x[i] * qx + s.e2y[i] * qy + s.e2z[i] * qz);
+        found |= select_lanes(&t, 1, i, closest_t, index);
+    }
+    return found;
+}
+
+#ifdef SIMD_X86
+
+/*
+ * SSE2, two doubles per register
+ */
+
+static bool spheres_sse2(
+    const SphereSoA &s, unsigned first, unsigned count,
+    const XYZ &from, const XYZ &delta, double &closest_t, unsigned &index
+){
+    double a_s = delta.x * delta.x + delta.y * delta.y + delta.z * delta.z;
+    __m128d fx = _mm_set1_pd(from.x), fy = _mm_set1_pd(from.y), fz = _mm_set1_pd(from.z);
+    __m128d dx = _mm_set1_pd(delta.x), dy = _mm_set1_pd(delta.y), dz = _mm_set1_pd(delta.z);
+    __m128d a = _mm_set1_pd(a_s), zero = _mm_setzero_pd(), miss = _mm_set1_pd(-1);
+    __m128d sign = _mm_set1_pd(-0.0);
+    bool found = false;
+    alignas(16) double t[2];
+    for (unsigned i = first; i < first + count; i += 2) {
+        __m128d ox = _mm_sub_pd(fx, _mm_loadu_pd(&s.x[i]));
+        __m128d oy = _mm_sub_pd(fy, _mm_loadu_pd(&s.y[i]));
+        __m128d oz = _mm_sub_pd(fz, _mm_loadu_pd(&s.z[i]));
+        __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, ox), _mm_mul_pd(dy, oy)), _mm_mul_pd(dz, oz));
+        __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ox, ox), _mm_mul_pd(oy, oy)), _mm_mul_pd(oz, oz)),
+                               _mm_loadu_pd(&s.r2[i]));
+        __m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+        __m128d hit = _mm_cmpgt_pd(disc, zero);
+        if (_mm_movemask_pd(hit) == 0)
+            continue;
+        __m128d root = _mm_sqrt_pd(_mm_and_pd(disc, hit));
+        __m128d tv = _mm_div_pd(_mm_sub_pd(_mm_xor_pd(half_b, sign), root), a);
+        _mm_store_pd(t, _mm_or_pd(_mm_and_pd(hit, tv), _mm_andnot_pd(hit, miss)));
+        found |= select_lanes(t, std::min(2u, first + count - i), i, closest_t, index);
+    }
+    return found;
+}
+
+static bool triangles_sse2(
+    const TriangleSoA &s, unsigned first, unsigned count,
+    const XYZ &from, const XYZ &delta, double &closest_t, unsigned &index
+){
+    __m128d fx = _mm_set1_pd(from.x), fy = _mm_set1_pd(from.y), fz = _mm_set1_pd(from.z);
+    __m128d dx = _mm_set1_pd(delta.x), dy = _mm_set1_pd(delta.y), dz = _mm_set1_pd(delta.z);
+    __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1), miss = _mm_set1_pd(-1);
+    __m128d eps = _mm_set1_pd(EPSILON), abs_mask = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffffLL));
+    bool found = false;
+    alignas(16) double t[2];
+    for (unsigned i = first; i < first + count; i += 2) {
+        __m128d e1x = _mm_loadu_pd(&s.e1x[i]), e1y = _mm_loadu_pd(&s.e1y[i]), e1z = _mm_loadu_pd(&s.e1z[i]);
+        __m128d e2x = _mm_loadu_pd(&s.e2x[i]), e2y = _mm_loadu_pd(&s.e2y[i]), e2z = _mm_loadu_pd(&s.e2z[i]);
+        __m128d hx = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+        __m128d hy = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+        __m128d hz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+        __m128d a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(hx, e1x), _mm_mul_pd(hy, e1y)), _mm_mul_pd(hz, e1z));
+        __m128d hit = _mm_cmpge_pd(_mm_and_pd(a, abs_mask), eps);
+        if (_mm_movemask_pd(hit) == 0)
+            continue;
+        __m128d f = _mm_div_pd(one, _mm_or_pd(_mm_and_pd(hit, a), _mm_andnot_pd(hit, one)));
+        __m128d sx = _mm_sub_pd(fx, _mm_loadu_pd(&s.v0x[i]));
+        __m128d sy = _mm_sub_pd(fy, _mm_loadu_pd(&s.v0y[i]));
+        __m128d sz = _mm_sub_pd(fz, _mm_loadu_pd(&s.v0z[i]));
+        __m128d u = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(sx, hx), _mm_mul_pd(sy, hy)), _mm_mul_pd(sz, hz)));
+        hit = _mm_and_pd(hit, _mm_and_pd(_mm_cmpge_pd(u, zero), _mm_cmple_pd(u, one)));
+        __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, e1z), _mm_mul_pd(sz, e1y));
+        __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, e1x), _mm_mul_pd(sx, e1z));
+        __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, e1y), _mm_mul_pd(sy, e1x));
+        __m128d v = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)), _mm_mul_pd(dz, qz)));
+        hit = _mm_and_pd(hit, _mm_and_pd(_mm_cmpge_pd(v, zero), _mm_cmple_pd(_mm_add_pd(u, v), one)));
+        if (_mm_movemask_pd(hit) == 0)
+            continue;
+        __m128d tv = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_mul_pd(e2y, qy)), _mm_mul_pd(e2z, qz)));
+        _mm_store_pd(t, _mm_or_pd(_mm_and_pd(hit, tv), _mm_andnot_pd(hit, miss)));
+        found |= select_lanes(t, std::min(2u, first + count - i), i, closest_t, index);
+    }
+    return found;
+}
+
+/*
+ * AVX2, four doubles per register
+ */
+
+__attribute__((target("avx2")))
+static bool spheres_avx2(
+    const SphereSoA &s, unsigned first, unsigned count,
+    const XYZ &from, const XYZ &delta, double &closest_t, unsigned &index
+){
+    double a_s = delta.x * delta.x + delta.y * delta.y + delta.z * delta.z;
+    __m256d fx = _mm256_set1_pd(from.x), fy = _mm256_set1_pd(from.y), fz = _mm256_set1_pd(from.z);
+    __m256d dx = _mm256_set1_pd(delta.x), dy = _mm256_set1_pd(delta.y), dz = _mm256_set1_pd(delta.z);
+    __m256d a = _mm256_set1_pd(a_s), zero = _mm256_setzero_pd(), miss = _mm256_set1_pd(-1);
+    __m256d sign = _mm256_set1_pd(-0.0);
+    bool found = false;
+    alignas(32) double t[4];
+    for (unsigned i = first; i < first + count; i += 4) {
+        __m256d ox = _mm256_sub_pd(fx, _mm256_loadu_pd(&s.x[i]));
+        __m256d oy = _mm256_sub_pd(fy, _mm256_loadu_pd(&s.y[i]));
+        __m256d oz = _mm256_sub_pd(fz, _mm256_loadu_pd(&s.z[i]));
+        __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ox), _mm256_mul_pd(dy, oy)),
+                                       _mm256_mul_pd(dz, oz));
+        __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ox, ox), _mm256_mul_pd(oy, oy)),
+                                                _mm256_mul_pd(oz, oz)),
+                                  _mm256_loadu_pd(&s.r2[i]));
+        __m256d disc = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+        __m256d hit = _mm256_cmp_pd(disc, zero, _CMP_GT_OQ);
+        if (_mm256_movemask_pd(hit) == 0)
+            continue;
+        __m256d root = _mm256_sqrt_pd(_mm256_and_pd(disc, hit));
+        __m256d tv = _mm256_div_pd(_mm256_sub_pd(_mm256_xor_pd(half_b, sign), root), a);
+        _mm256_store_pd(t, _mm256_blendv_pd(miss, tv, hit));
+        found |= select_lanes(t, std::min(4u, first + count - i), i, closest_t, index);
+    }
+    return found;
+}
+
+__attribute__((target("avx2")))
+static bool triangles_avx2(
+    const TriangleSoA &s, unsigned first, unsigned count,
+    const XYZ &from, const XYZ &delta, double &closest_t, unsigned &index
+){
+    __m256d fx = _mm256_set1_pd(from.x), fy = _mm256_set1_pd(from.y), fz = _mm256_set1_pd(from.z);
+    __m256d dx = _mm256_set1_pd(delta.x), dy = _mm256_set1_pd(delta.y), dz = _mm256_set1_pd(delta.z);
+    __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1), miss = _mm256_set1_pd(-1);
+    __m256d eps = _mm256_set1_pd(EPSILON), sign = _mm256_set1_pd(-0.0);
+    bool found = false;
+    alignas(32) double t[4];
+    for (unsigned i = first; i < first + count; i += 4) {
+        __m256d e1x = _mm256_loadu_pd(&s.e1x[i]), e1y = _mm256_loadu_pd(&s.e1y[i]), e1z = _mm256_loadu_pd(&s.e1z[i]);
+        __m256d e2x = _mm256_loadu_pd(&s.e2x[i]), e2y = _mm256_loadu_pd(&s.e2y[i]), e2z = _mm256_loadu_pd(&s.e2z[i]);
+        __m256d hx = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+        __m256d hy = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+        __m256d hz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+        __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(hx, e1x), _mm256_mul_pd(hy, e1y)),
+                                  _mm256_mul_pd(hz, e1z));
+        __m256d hit = _mm256_cmp_pd(_mm256_andnot_pd(sign, a), eps, _CMP_GE_OQ);
+        if (_mm256_movemask_pd(hit) == 0)
+            continue;
+        __m256d f = _mm256_div_pd(one, _mm256_blendv_pd(one, a, hit));
+        __m256d sx = _mm256_sub_pd(fx, _mm256_loadu_pd(&s.v0x[i]));
+        __m256d sy = _mm256_sub_pd(fy, _mm256_loadu_pd(&s.v0y[i]));
+        __m256d sz = _mm256_sub_pd(fz, _mm256_loadu_pd(&s.v0z[i]));
+        __m256d u = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, hx), _mm256_mul_pd(sy, hy)),
+                                                   _mm256_mul_pd(sz, hz)));
+        hit = _mm256_and_pd(hit, _mm256_and_pd(_mm256_cmp_pd(u, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_pd(u, one, _CMP_LE_OQ)));
+        __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+        __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+        __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+        __m256d v = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)),
+                                                   _mm256_mul_pd(dz, qz)));
+        hit = _mm256_and_pd(hit, _mm256_and_pd(_mm256_cmp_pd(v, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_LE_OQ)));
+        if (_mm256_movemask_pd(hit) == 0)
+            continue;
+        __m256d tv = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)),
+                                                    _mm256_mul_pd(e2z, qz)));
+        _mm256_store_pd(t, _mm256_blendv_pd(miss, tv, hit));
+        found |= select_lanes(t, std::min(4u, first + count - i), i, closest_t, index);
+    }
+    return found;
+}
+
+#endif
+
+static SimdKernels pick_kernels()
+{
+    static const SimdKernels scalar = { "scalar", spheres_scalar, triangles_scalar };
+#ifdef SIMD_X86
+    static const SimdKernels sse2 = { "sse2", spheres_sse2, triangles_sse2 };
+    static const SimdKernels avx2 = { "avx2", spheres_avx2, triangles_avx2 };
+
+    const char *wanted = getenv("RT_SIMD");
+    if (wanted != nullptr && strcmp(wanted, "scalar") == 0)
+        return scalar;
+    __builtin_cpu_init();
+    if ((wanted == nullptr || strcmp(wanted, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+        return avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return sse2;
+#endif
+    return scalar;
+}
+
+const SimdKernels &simd_kernels()
+{
+    static const SimdKernels kernels = pick_kernels();
+    return kernels;
+}
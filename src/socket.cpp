@@ -0,0 +1,195 @@
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include <utility>
+#include <stdexcept>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "socket.h"
+
+namespace {
+
+bool is_unix(const std::string &address)
+{
+    return address.compare(0, 5, "unix:") == 0;
+}
+
+sockaddr_un unix_address(const std::string &address)
+{
+    std::string path = address.substr(5);
+    sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(sun.sun_path))
+        throw std::runtime_error("bad Unix socket path in " + address);
+    memcpy(sun.sun_path, path.c_str(), path.size());
+    return sun;
+}
+
+// getaddrinfo() results for host:port or a bare port, freed by the caller.
+// The tile protocol trusts whoever connects, so a bare port is loopback
+// only and listening on every interface takes an explicit 0.0.0.0:<port>.
+addrinfo *tcp_addresses(const std::string &address)
+{
+    size_t colon = address.rfind(':');
+    std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+    std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *list;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &list);
+    if (err != 0)
+        throw std::runtime_error("can't resolve " + address + ": " + gai_strerror(err));
+    return list;
+}
+
+}
+
+Socket::~Socket()
+{
+    close();
+}
+
+Socket::Socket(Socket &&other)
+    : m_fd(other.m_fd), m_unlink(std::move(other.m_unlink))
+{
+    other.m_fd = -1;
+    other.m_unlink.clear();
+}
+
+Socket &Socket::operator=(Socket &&other)
+{
+    if (this != &other) {
+        close();
+        m_fd = other.m_fd;
+        m_unlink = std::move(other.m_unlink);
+        other.m_fd = -1;
+        other.m_unlink.clear();
+    }
+    return *this;
+}
+
+void Socket::close()
+{
+    if (m_fd >= 0)
+        ::close(m_fd);
+    if (!m_unlink.empty())
+        unlink(m_unlink.c_str());
+    m_fd = -1;
+    m_unlink.clear();
+}
+
+Socket Socket::listen(const std::string &address)
+{
+    if (is_unix(address)) {
+        sockaddr_un sun = unix_address(address);
+        Socket s(socket(AF_UNIX, SOCK_STREAM, 0));
+        if (s.m_fd < 0)
+            throw std::runtime_error("can't create a socket for " + address);
+        // A socket file left behind by a coordinator that died is no use
+        unlink(sun.sun_path);
+        if (bind(s.m_fd, (sockaddr *)&sun, sizeof(sun)) < 0 || ::listen(s.m_fd, 64) < 0)
+            throw std::runtime_error("can't listen on " + address + ": " + strerror(errno));
+        s.m_unlink = sun.sun_path;
+        return s;
+    }
+
+    addrinfo *list = tcp_addresses(address);
+    for (addrinfo *a = list; a; a = a->ai_next) {
+        Socket s(socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+        if (s.m_fd < 0)
+            continue;
+        int on = 1;
+        setsockopt(s.m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(s.m_fd, a->ai_addr, a->ai_addrlen) == 0 && ::listen(s.m_fd, 64) == 0) {
+            freeaddrinfo(list);
+            return s;
+        }
+    }
+    freeaddrinfo(list);
+    throw std::runtime_error("can't listen on " + address + ": " + strerror(errno));
+}
+
+Socket Socket::connect(const std::string &address, double seconds)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    for (;;) {
+        if (is_unix(address)) {
+            sockaddr_un sun = unix_address(address);
+            Socket s(socket(AF_UNIX, SOCK_STREAM, 0));
+            if (s.m_fd >= 0 && ::connect(s.m_fd, (sockaddr *)&sun, sizeof(sun)) == 0)
+                return s;
+        } else {
+            addrinfo *list = tcp_addresses(address);
+            for (addrinfo *a = list; a; a = a->ai_next) {
+                Socket s(socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+                if (s.m_fd >= 0 && ::connect(s.m_fd, a->ai_addr, a->ai_addrlen) == 0) {
+                    freeaddrinfo(list);
+                    // Tile requests are small and shouldn't sit in Nagle's buffer
+                    int on = 1;
+                    setsockopt(s.m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                    return s;
+                }
+            }
+            freeaddrinfo(list);
+        }
+        if (std::chrono::steady_clock::now() >= deadline)
+            throw std::runtime_error("can't connect to " + address + ": " + strerror(errno));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+Socket Socket::accept()
+{
+    Socket s(::accept(m_fd, nullptr, nullptr));
+    if (s.m_fd < 0)
+        throw std::runtime_error(std::string("accept failed: ") + strerror(errno));
+    int on = 1;
+    setsockopt(s.m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return s;
+}
+
+void Socket::send(const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = ::send(m_fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error(std::string("send failed: ") + strerror(errno));
+        p += n;
+        size -= n;
+    }
+}
+
+bool Socket::receive(void *data, size_t size)
+{
+    char *p = (char *)data;
+    while (size > 0) {
+        size_t n = receive_some(p, size);
+        if (n == 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+size_t Socket::receive_some(void *data, size_t size)
+{
+    for (;;) {
+        ssize_t n = recv(m_fd, data, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n < 0 ? 0 : n;
+    }
+}
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <stdexcept>
+#include "raytrace.h"
+#include "image_writer.h"
+
+thread_local RenderStats t_stats;
+
+static const char *ray_names[STAT_RAY_KINDS] = { "primary", "reflection", "refraction", "shadow" };
+static const char *phase_names[STAT_PHASES] = { "build", "trace", "checkpoint", "denoise", "output" };
+static const char *form_names[STAT_FORM_TYPES] = { "sphere", "wall", "triangle", "mesh", "instance" };
+
+uint64_t RenderStats::total_rays() const
+{
+    uint64_t total = 0;
+    for (uint64_t n : rays)
+        total += n;
+    return total;
+}
+
+void RenderStats::merge(const RenderStats &other)
+{
+    for (unsigned i = 0; i < STAT_RAY_KINDS; i++)
+        rays[i] += other.rays[i];
+    for (unsigned i = 0; i < STAT_FORM_TYPES; i++) {
+        tests[i] += other.tests[i];
+        hits[i] += other.hits[i];
+    }
+    for (unsigned i = 0; i < STAT_DEPTHS; i++)
+        depth[i] += other.depth[i];
+    for (unsigned i = 0; i < STAT_PHASES; i++)
+        seconds[i] += other.seconds[i];
+    shadow_cache_hits += other.shadow_cache_hits;
+}
+
+void RenderStats::print(FILE *out) const
+{
+    fprintf(out, "rays:");
+    for (unsigned i = 0; i < STAT_RAY_KINDS; i++)
+        fprintf(out, " %s %llu", ray_names[i], (unsigned long long)rays[i]);
+    fprintf(out, "\nprimitive tests / hits:");
+    for (unsigned i = 0; i < STAT_FORM_TYPES; i++)
+        fprintf(out, " %s %llu / %llu", form_names[i],
+            (unsigned long long)tests[i], (unsigned long long)hits[i]);
+    fprintf(out, "\nrays per recursion level:");
+    unsigned last = STAT_DEPTHS;
+    while (last > 1 && depth[last - 1] == 0)
+        last--;
+    for (unsigned i = 0; i < last; i++)
+        fprintf(out, " %llu", (unsigned long long)depth[i]);
+    fprintf(out, "\nshadow cache hits: %llu", (unsigned long long)shadow_cache_hits);
+    fprintf(out, "\nsamples per pixel: %.2f", samples_per_pixel);
+    fprintf(out, "\nseconds:");
+    for (unsigned i = 0; i < STAT_PHASES; i++)
+        fprintf(out, " %s %.3f", phase_names[i], seconds[i]);
+    fprintf(out, "\n");
+}
+
+void RenderStats::write_json(const std::string &path) const
+{
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+        throw std::runtime_error("can't write " + path);
+
+    fprintf(out, "{\n  \"rays\": {");
+    for (unsigned i = 0; i < STAT_RAY_KINDS; i++)
+        fprintf(out, "%s \"%s\": %llu", i ? "," : "", ray_names[i], (unsigned long long)rays[i]);
+    fprintf(out, " },\n  \"tests\": {");
+    for (unsigned i = 0; i < STAT_FORM_TYPES; i++)
+        fprintf(out, "%s \"%s\": %llu", i ? "," : "", form_names[i], (unsigned long long)tests[i]);
+    fprintf(out, " },\n  \"hits\": {");
+    for (unsigned i = 0; i < STAT_FORM_TYPES; i++)
+        fprintf(out, "%s \"%s\": %llu", i ? "," : "", form_names[i], (unsigned long long)hits[i]);
+    fprintf(out, " },\n  \"depth\": [");
+    for (unsigned i = 0; i < STAT_DEPTHS; i++)
+        fprintf(out, "%s %llu", i ? "," : "", (unsigned long long)depth[i]);
+    fprintf(out, " ],\n  \"shadow_cache_hits\": %llu,", (unsigned long long)shadow_cache_hits);
+    fprintf(out, "\n  \"samples_per_pixel\": %.6f,", samples_per_pixel);
+    fprintf(out, "\n  \"seconds\": {");
+    for (unsigned i = 0; i < STAT_PHASES; i++)
+        fprintf(out, "%s \"%s\": %.6f", i ? "," : "", phase_names[i], seconds[i]);
+    fprintf(out, " }\n}\n");
+
+    if (fclose(out) != 0)
+        throw std::runtime_error("failed writing " + path);
+}
+
+RenderStats Raytracer::stats() const
+{
+    RenderStats stats = m_stats;
+    stats.samples_per_pixel = average_samples_per_pixel();
+    return stats;
+}
+
+void Raytracer::reset_stats()
+{
+    m_stats = RenderStats();
+    t_stats = RenderStats();
+    STATS(if (m_heatmap_mode != Heatmap::Off) m_heatmap.assign((size_t)m_width * m_height, 0));
+}
+
+// Folds the calling worker's counters into the totals and starts it over
+void Raytracer::merge_stats()
+{
+    std::lock_guard<std::mutex> guard(m_stats_lock);
+    m_stats.merge(t_stats);
+    t_stats = RenderStats();
+}
+
+void Raytracer::set_heatmap(Heatmap mode)
+{
+#ifndef RT_STATS
+    if (mode != Heatmap::Off)
+        throw std::runtime_error("heatmaps need a build with stats enabled (make STATS=1)");
+#endif
+    m_heatmap_mode = mode;
+}
+
+// Black through red and yellow to white
+static Color heat_color(float v)
+{
+    v = std::min(std::max(v, 0.0f), 1.0f) * 3;
+    return { std::min(v, 1.0f) * 255, std::min(std::max(v - 1, 0.0f), 1.0f) * 255,
+             std::max(v - 2, 0.0f) * 255 };
+}
+
+void Raytracer::save_heatmap(const std::string &filename)
+{
+    if (m_heatmap.size() != (size_t)m_width * m_height)
+        throw std::runtime_error("no heatmap recorded to save to " + filename);
+
+    // PFM gets the costs themselves, the other formats are scaled so the
+    // 99th percentile is white. Timings have the odd pixel that lost its
+    // thread for a while, scaling to the maximum would leave the rest black.
+    bool raw = image_format(filename) == ImageFormat::PFM;
+    std::vector<float> sorted(m_heatmap);
+    auto top = sorted.begin() + sorted.size() * 99 / 100;
+    std::nth_element(sorted.begin(), top, sorted.end());
+    float scale = *top > 0 ? 1 / *top : 0;
+
+    ImageWriter writer(filename, m_width, m_height, Tonemap::Clamp, 1.0);
+    std::vector<Color> row(m_width);
+    for (unsigned y = 0; y < m_height; y++) {
+        const float *costs = &m_heatmap[(size_t)y * m_width];
+        for (unsigned x = 0; x < m_width; x++) {
+            float c = costs[x] * 255;
+            row[x] = raw ? Color{ c, c, c } : heat_color(costs[x] * scale);
+        }
+        writer.write_rows(row.data(), 1);
+    }
+    writer.finish();
+}
@@ -0,0 +1,101 @@
+#include <map>
+#include <mutex>
+#include <exception>
+#include <condition_variable>
+#include "raytrace.h"
+#include "image_writer.h"
+
+/*
+ * Streaming output. Image formats want rows top to bottom, so tiles are
+ * handed out in raster order and each finished tile is copied into the
+ * buffer of its band, the row of tiles it belongs to. Whenever the first
+ * unwritten band is complete its rows go to the writer and the buffer is
+ * dropped. Tiles more than STREAM_BANDS bands ahead of the writer wait
+ * before rendering, so one slow tile can't make the buffer grow towards
+ * the whole image.
+ */
+
+#define STREAM_BANDS 2
+
+void Raytracer::render_to(const std::string &filename)
+{
+    no_features("streaming");
+    reset_stats();
+    m_render_id = ShadowCache::new_render();
+    {
+        PhaseTimer timer(m_stats.seconds[STAT_BUILD]);
+        finalize();
+    }
+    m_samples_taken = 0;
+    m_framebuffer = Framebuffer();
+
+    ImageWriter writer(filename, m_width, m_height, m_tonemap, m_exposure, m_png_level);
+    unsigned tile_size = m_tile_size == 0 ? 1 : m_tile_size;
+    unsigned tiles_across = (m_width + tile_size - 1) / tile_size;
+    auto band_rows = [&](unsigned band) {
+        return std::min(tile_size, m_height - band * tile_size);
+    };
+
+    struct Band {
+        std::vector<Color> pixels;
+        unsigned tiles_done;
+    };
+    std::map<unsigned, Band> bands;
+    unsigned next_band = 0;
+    std::mutex lock;
+    std::condition_variable written;
+    // Workers can't throw across the scheduler, the first error is kept
+    // and rethrown once they're done
+    std::exception_ptr error;
+
+    // Rows get written while tiles are still rendering, so trace time
+    // includes the output and output time only counts the writes
+    PhaseTimer timer(m_stats.seconds[STAT_TRACE]);
+    TileScheduler scheduler(m_thread_count);
+    scheduler.run_in_order(make_tiles(m_width, m_height, tile_size),
+        [&](unsigned, const Tile &tile) {
+            unsigned band = tile.y0 / tile_size;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                written.wait(guard, [&] { return band < next_band + STREAM_BANDS || error; });
+                if (error)
+                    return;
+            }
+
+            std::vector<Color> sums;
+            std::vector<unsigned> counts;
+            render_tile(tile, sums, counts);
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (error)
+                return;
+            Band &b = bands[band];
+            if (b.pixels.empty())
+                b.pixels.resize((size_t)band_rows(band) * m_width);
+            unsigned tile_width = tile.x1 - tile.x0;
+            for (unsigned i = 0; i < sums.size(); i++) {
+                size_t at = (size_t)(i / tile_width) * m_width + tile.x0 + i % tile_width;
+                b.pixels[at] = counts[i] ? sums[i] / counts[i] : Color{ 0, 0, 0 };
+            }
+            b.tiles_done++;
+
+            try {
+                PhaseTimer output(t_stats.seconds[STAT_OUTPUT]);
+                for (auto ready = bands.find(next_band);
+                        ready != bands.end() && ready->second.tiles_done == tiles_across;
+                        ready = bands.find(next_band)) {
+                    writer.write_rows(ready->second.pixels.data(), band_rows(next_band));
+                    bands.erase(ready);
+                    next_band++;
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+            STATS(merge_stats());
+            written.notify_all();
+        });
+
+    if (error)
+        std::rethrow_exception(error);
+    writer.finish();
+}